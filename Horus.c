@@ -1,10 +1,39 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
+#include <direct.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif // _WIN32
+
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <math.h>
 
-#pragma pack(1)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define SIMD_SSE
+#endif // __SSE2__
+
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#endif // __AVX2__
 
 typedef signed char			s8;
 typedef char				u8;
@@ -27,12 +56,41 @@ typedef double				f64;
 #define NUM_AA_SAMPLES 			128	
 #define OUTPUT_WIDTH			1024
 #define OUTPUT_HEIGHT			512
-#define	OUTPUTSIZE			OUTPUT_WIDTH * OUTPUT_HEIGHT
-#define ASPECT				OUTPUT_WIDTH / OUTPUT_HEIGHT
 #define V_FOV				50
 #define	RENDER				0
 #define	IDLE				1
 #define MAX_BOUNCES			50
+#define ROULETTE_DEPTH			3
+#define MIN_AA_SAMPLES			16
+#define PASS_SAMPLES			16
+#define PREVIEW_COARSE_BLOCK		16
+#define PREVIEW_FINE_BLOCK		4
+#define SAMPLE_PIXEL			0
+#define SAMPLE_LENS			2
+#define SAMPLE_BOUNCE			4
+#define SAMPLE_BOUNCE_DIMENSIONS	8
+#define SAMPLE_DIRECTION		0
+#define SAMPLE_ROULETTE			3
+#define SAMPLE_LIGHT			4
+#define BLUE_NOISE_SIZE			64
+#define BLUE_NOISE_RADIUS		6
+#define BLUE_NOISE_SIGMA		1.5f
+#define CHECKPOINT_INTERVAL		60
+#define CHECKPOINT_MAGIC		0x43535248
+#define CHECKPOINT_VERSION		2
+#define SCENE_FILL_SPHERES		256
+#define SCENE_REGION_SPHERES		16384
+#define SCENE_MAX_RETRIES		200
+#define SCENE_GRID_EMPTY		0xFFFFFFFF
+#define SCENE_MAGIC			0x4E435348
+#define SCENE_VERSION			2
+#define GROUND_HEIGHT			-0.005f
+#define MESH_MAGIC			0x48534D48
+#define MESH_VERSION			1
+#define MESH_CHUNK			65536
+#define RAY_OFFSET_ORIGIN		(1.0f / 32.0f)
+#define RAY_OFFSET_FLOAT		(1.0f / 65536.0f)
+#define RAY_OFFSET_INT			256.0f
 #define CAM_POS_X			0.00f
 #define CAM_POS_Y			0.70f
 #define CAM_POS_Z			-1.450f
@@ -40,6 +98,77 @@ typedef double				f64;
 #define CAM_TARGET_Y			0.47f
 #define CAM_TARGET_Z			0.00f
 #define CAM_APERTURE			0.05f
+#define BVH_BINS			16
+#define BVH_MAX_LEAF_SIZE		4
+#define BVH_STACK_SIZE			64
+#define BVH_TASKS_PER_THREAD		8
+#define BVH_MIN_TASK_SIZE		4096
+#define STATS_PATH_LENGTHS		16
+#define STATS_ESCAPED			4
+#define PI				3.14159265358979323846f
+#define BENCHMARK_SEED			46557
+#define BENCHMARK_WIDTH			320
+#define BENCHMARK_HEIGHT		160
+#define BENCHMARK_SAMPLES		16
+#define BENCHMARK_REPEATS		3
+#define BENCHMARK_TOLERANCE		0.05f
+#define NET_MAX_CONNECTIONS		256
+#define NET_CONNECT_ATTEMPTS		100
+#define NET_TIMEOUT			30
+#define NET_SLOW_FACTOR			4.0
+#define NET_MAGIC			0x5445484E
+#define TONE_LUT_SIZE			65536
+#define DENOISE_FEATURE_SAMPLES		4
+#define DENOISE_ITERATIONS		5
+#define DENOISE_SIGMA_LUMINANCE		4.0f
+#define DENOISE_SIGMA_NORMAL		128.0f
+#define DENOISE_SIGMA_DEPTH		0.05f
+#define DENOISE_SIGMA_ALBEDO		0.1f
+#define DEFLATE_WINDOW			32768
+#define DEFLATE_HASH_SIZE		65536
+#define DEFLATE_CHAIN			16
+#define DEFLATE_MAX_MATCH		258
+#define VERIFY_RAYS			100000
+#define VERIFY_TRIANGLE_TESTS		400000000ull
+#define PACKET_SIZE			8
+#define PACKET_MAX			16
+#define TILE_SIZE			32
+
+#if defined(_WIN32) && !defined(HEADLESS)
+#define WINDOWED
+#endif // _WIN32 && !HEADLESS
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL			__declspec(thread)
+#else
+#define THREAD_LOCAL			__thread
+#endif // _MSC_VER
+
+#ifdef _WIN32
+#define atomic_cas_u64(p, e, d)		(InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(d), (LONG64)(e)) == (LONG64)(e))
+#define atomic_inc_u32(p)		((u32)InterlockedIncrement((volatile LONG*)(p)))
+#define atomic_dec_u32(p)		((u32)InterlockedDecrement((volatile LONG*)(p)))
+#define atomic_add_u64(p, v)		InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#else
+#define atomic_cas_u64(p, e, d)		__sync_bool_compare_and_swap((p), (e), (d))
+#define atomic_inc_u32(p)		__sync_add_and_fetch((p), 1)
+#define atomic_dec_u32(p)		__sync_sub_and_fetch((p), 1)
+#define atomic_add_u64(p, v)		__sync_fetch_and_add((p), (v))
+#endif // _WIN32
+
+#define RNG_STREAM_SCENE		0xFFFFFFFFFFFFFFFFull
+#define RNG_STREAM_VERIFY		0xFFFFFFFFFFFFFFFEull
+#define RNG_STREAM_BLUE_NOISE		0xFFFFFFFFFFFFFFFDull
+
+#ifdef _WIN32
+#define OUTPUT_PATH			"D:\\Root\\Horus_Renders\\"
+#define PATH_SEPARATOR			"\\"
+#define make_directory(p)		_mkdir(p)
+#else
+#define OUTPUT_PATH			"Horus_Renders/"
+#define PATH_SEPARATOR			"/"
+#define make_directory(p)		mkdir(p, 0755)
+#endif // _WIN32
 
 typedef enum MaterialType
 {
@@ -56,6 +185,9 @@ typedef struct v3
 } v3;
 
 v3 viridis(f32 f);
+s32 compare_f64(const void* a, const void* b);
+
+#pragma pack(push, 1)
 
 typedef struct BitmapFileHeader
 {
@@ -83,15 +215,41 @@ typedef struct BitmapInfoHeader
 
 } BitmapInfoHeader;
 
+#pragma pack(pop)
+
 typedef struct Ray
 {
 	v3	origin;
 	v3	direction;
 	u32 	bounces;
-	u32 	id;
 
 } Ray;
 
+// The random state of one camera sample. Besides the PCG stream it carries what the quasi-random
+// samplers need to find the sample's point: its pixel, its index among the pixel's samples (bit
+// reversed, as sobol_sample uses it), the scramble seed and the first dimension of the bounce.
+typedef struct Rng
+{
+	u64	state;
+	u64	inc;
+	u32	scramble;
+	u32	index;
+	u32	dimension;
+	u32	x;
+	u32	y;
+
+} Rng;
+
+// Where a sample's random numbers come from. Random draws each one independently. Sobol gives
+// each group of four dimensions its own 4D Sobol sequence, shuffled and Owen scrambled per pixel
+// and per group. Blue noise uses one such sequence for every pixel, shifted per pixel by a blue-noise
+// mask, so the error left at low sample counts is high-frequency rather than clumped.
+typedef enum SamplerType
+{
+	SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE
+
+} SamplerType;
+
 typedef struct Material
 {
 	MaterialType type;
@@ -105,10 +263,21 @@ typedef struct Sphere
 {
 	v3		position;
 	f32		radius;
-	Material	material;
+	u32		material;
 
 } Sphere;
 
+// An infinite plane through centre, or a disk of the given radius around it when radius > 0.
+// Both sides are solid, so a ray may hit one from either side.
+typedef struct Plane
+{
+	v3		normal;
+	v3		centre;
+	f32		radius;
+	u32		material;
+
+} Plane;
+
 typedef struct Camera
 {
 	v3  		bottom_left;
@@ -128,704 +297,7679 @@ typedef struct Hit
 	v3		point;
 	v3		normal;
 	Material	material;
+	u32		object;
 
 } Hit;
 
-static HWND					hwnd;
-static Sphere*					spheres;
-static v3*					palette;
-static u8*					bitmap_image_data;
-static HBITMAP					bitmap_handle;
-static HDC					device_context;
-static BITMAPINFO				bitmapinfo;
-static BitmapFileHeader				file_header;
-static BitmapInfoHeader				info_header;
-static Camera					camera;
-static u8					STATE = RENDER;
-static s32					SEED;
-static char					path[128];
-static f64					render_time;
+typedef struct SphereSoA
+{
+	f32*		x;
+	f32*		y;
+	f32*		z;
+	f32*		radius2;
+	u32*		ids;
+	u32		count;
 
-const char class_name[] = "Horus";
+} SphereSoA;
 
-f32 fract(f32 x)
+typedef struct RayPacket
 {
-	return x - (s64)x;
-}
+	f32		ox[PACKET_MAX];
+	f32		oy[PACKET_MAX];
+	f32		oz[PACKET_MAX];
+	f32		dx[PACKET_MAX];
+	f32		dy[PACKET_MAX];
+	f32		dz[PACKET_MAX];
+	f32		inv_x[PACKET_MAX];
+	f32		inv_y[PACKET_MAX];
+	f32		inv_z[PACKET_MAX];
+	f32		a[PACKET_MAX];
+	f32		t[PACKET_MAX];
+	s32		slot[PACKET_MAX];
+	u32		count;
+
+} RayPacket;
+
+// What a path carries from one hit to the next. With next-event estimation on, bsdf_pdf is the
+// density the last diffuse bounce chose its direction with (0 after any other surface) and is
+// needed to weight the light that direction finds.
+typedef struct PathState
+{
+	v3		radiance;
+	v3		throughput;
+	v3		last_point;
+	f32		bsdf_pdf;
+	u32		material_bounces[4];
 
-f32 hash(f32 x)
+} PathState;
+
+// A path in flight in wavefront mode, carrying everything trace_path() keeps on its stack so it
+// can be parked between stages.
+typedef struct WavefrontPath
 {
-	return abs(fract(sin(x) * 43758.5453));
-}
+	Ray		ray;
+	Hit		hit;
+	PathState	state;
+	Rng		rng;
 
-f32 ffmin(f32 a, f32 b)
+} WavefrontPath;
+
+// Keyframes for animation mode, interpolated linearly. Camera keys are sorted by frame and sphere
+// keys by sphere and then frame.
+typedef struct CameraKey
 {
-	return a < b ? a : b;
-}
+	u32		frame;
+	v3		position;
+	v3		target;
+	f32		v_fov;
+	f32		aperture;
 
-f32 ffmax(f32 a, f32 b)
+} CameraKey;
+
+typedef struct SphereKey
 {
-	return a > b ? a : b;
-}
+	u32		sphere;
+	u32		frame;
+	v3		position;
+	f32		radius;
 
-f32 v3_dot(v3 a, v3 b)
+} SphereKey;
+
+typedef struct Animation
 {
-	return a.x * b.x + a.y * b.y + a.z * b.z;
-}
+	CameraKey*	cameras;
+	u32		camera_count;
+	SphereKey*	spheres;
+	u32		sphere_count;
+	v3		orbit_position;
 
-v3 v3_div(v3 a, f32 n)
+} Animation;
+
+// Image formats the renderer can write. BMP and PNG hold the gamma-corrected 8-bit image, PFM and
+// EXR the linear float radiance straight from the accumulation buffer.
+typedef enum ImageFormat
 {
-	v3 v;
-	v.x = a.x / n;
-	v.y = a.y / n;
-	v.z = a.z / n;
+	FORMAT_BMP, FORMAT_PNG, FORMAT_PFM, FORMAT_EXR
 
-	return v;
-}
+} ImageFormat;
 
-f32 v3_mag(v3 a)
+// How the float framebuffer becomes 8-bit pixels. Gamma is the original square-root encoding;
+// the others encode with the sRGB curve, after Reinhard's or the ACES filmic curve for the last two.
+typedef enum ToneMap
 {
-	return (f32)sqrt(a.x*a.x + a.y * a.y + a.z * a.z);
-}
+	TONE_GAMMA, TONE_SRGB, TONE_REINHARD, TONE_ACES
 
-v3 vec3(f32 x, f32 y, f32 z)
+} ToneMap;
+
+// The benchmark scenes are the procedural scene at different sizes, with the small spheres'
+// materials optionally swapped to stress lights or mirrors.
+typedef enum BenchmarkVariant
 {
-	v3 v;
-	v.x = x;
-	v.y = y;
-	v.z = z;
+	BENCHMARK_DEFAULT, BENCHMARK_LIGHTS, BENCHMARK_MIRRORS
 
-	return v;
-}
+} BenchmarkVariant;
 
-v3 v3_normalized(v3 a)
+typedef struct BenchmarkScene
 {
-	f32  m = v3_mag(a);
-	v3 v;
-	v.x = 0.0f;
-	v.y = 0.0f;
-	v.z = 0.0f;
+	const char*		name;
+	u32			spheres;
+	BenchmarkVariant	variant;
 
-	if (m != 0.0f && m != 1.0f) v = v3_div(a, m);
+} BenchmarkScene;
 
-	return v;
-}
+// Every emissive sphere, picked for next-event estimation in proportion to its power.
+typedef struct LightList
+{
+	u32*		ids;
+	f32*		cdf;
+	u32		count;
+	f32		power;
 
-v3 v3_mulf(v3 a, f32 n)
+} LightList;
+
+typedef struct Wavefront
 {
-	v3 v;
-	v.x = a.x * n;
-	v.y = a.y * n;
-	v.z = a.z * n;
+	WavefrontPath*	paths;
+	v3*		results;
+	u32*		active;
+	u32*		queue;
+	u32*		pixel_first;
+	u32*		pixel_count;
+	u32		capacity;
 
-	return v;
-}
+} Wavefront;
 
-v3 v3_mulv(v3 a, v3 b)
+typedef struct BVHNode
 {
-	v3 v;
-	v.x = a.x * b.x;
-	v.y = a.y * b.y;
-	v.z = a.z * b.z;
+	v3		bounds_min;
+	u32		offset;
+	v3		bounds_max;
+	u32		count;
 
-	return v;
-}
+} BVHNode;
 
-v3 v3_sub(v3 a, v3 b)
+typedef struct BVHPrimitive
 {
-	v3 v;
-	v.x = a.x - b.x;
-	v.y = a.y - b.y;
-	v.z = a.z - b.z;
+	v3		bounds_min;
+	v3		bounds_max;
+	v3		centroid;
 
-	return v;
-}
+} BVHPrimitive;
 
-v3 v3_cross(v3 a, v3 b)
+typedef struct BVH
 {
-	v3 v;
+	BVHNode*	nodes;
+	u32*		indices;
+	u32		node_count;
 
-	v.x = a.y * b.z - b.y * a.z;
-	v.y = a.z * b.x - b.z * a.x;
-	v.z = a.x * b.y - b.x * a.y;
+} BVH;
 
-	return v;
-}
+// A subtree left for a worker by a parallel build, with the 2 * count - 1 node slots a tree over
+// count primitives can need already reserved from node onwards.
+typedef struct BVHTask
+{
+	u32		node;
+	u32		first;
+	u32		count;
+	u32		depth;
 
-v3 v3_add(v3 a, v3 b)
+} BVHTask;
+
+typedef struct BVHBuild
 {
-	v3 v;
+	BVH*		bvh;
+	BVHPrimitive*	primitives;
+	u32		next_node;
+	u32		task_size;
+	BVHTask*	tasks;
+	u32		task_count;
+	u32		task_capacity;
+
+} BVHBuild;
+
+// A binary mesh: this header, then vertex_count vertices of three f32 each from vertex_offset and
+// triangle_count triangles of three u32 vertex indices each from index_offset.
+typedef struct MeshHeader
+{
+	u32		magic;
+	u32		version;
+	u32		vertex_count;
+	u32		triangle_count;
+	u64		vertex_offset;
+	u64		index_offset;
+
+} MeshHeader;
+
+// A mesh file placed in the scene: its vertices are scaled, then moved by offset, and all of its
+// triangles use one material.
+typedef struct MeshFile
+{
+	const char*	path;
+	u32		material;
+	v3		offset;
+	f32		scale;
 
-	v.x = a.x + b.x;
-	v.y = a.y + b.y;
-	v.z = a.z + b.z;
+} MeshFile;
 
-	return v;
-}
+// Every triangle in the scene in BVH order, each corner split by axis so four triangles load
+// straight into SSE registers whichever axis a ray is projected along. Padded like SphereSoA.
+typedef struct TriangleSoA
+{
+	f32*		a[3];
+	f32*		b[3];
+	f32*		c[3];
+	u32*		ids;
+	u32		count;
 
-v3 v3_reflect(v3 a, v3 normal)
+} TriangleSoA;
+
+// The triangles of every mesh file gathered into one soup, with a BVH of its own next to the
+// spheres'. The corners and primitive bounds are only kept until the SoA arrays are filled.
+typedef struct Mesh
 {
-	f32 dp = v3_dot(a, normal);
-	v3	v = v3_mulf(normal, 2.0f*dp);
-	v3  r = v3_sub(a, v);
+	v3*		corners;
+	u32*		materials;
+	u32		triangle_count;
+	u32		capacity;
+	BVHPrimitive*	primitives;
+	BVH		bvh;
+	TriangleSoA	soa;
+
+} Mesh;
+
+// What the watertight ray-triangle test (Woop, Benthin and Wald 2013) works out once per ray: the
+// axis the ray mostly travels along is relabelled z, and a shear lines the ray up with that axis.
+typedef struct TriangleRay
+{
+	f32		origin[3];
+	u32		k[3];
+	f32		shear[3];
 
-	return r;
-}
+} TriangleRay;
 
-v3 point_at_parameter(Ray r, float t)
+typedef struct Settings
 {
-	v3 t_dir = v3_mulf(r.direction, t);
-	v3 point = v3_add(t_dir, r.origin);
+	u32		output_width;
+	u32		output_height;
+	u32		num_aa_samples;
+	u32		min_samples;
+	u32		pass_samples;
+	f32		noise_threshold;
+	const char*	checkpoint_path;
+	f64		checkpoint_interval;
+	u32		max_bounces;
+	u32		roulette_depth;
+	u32		material_bounces[4];
+	u32		num_spheres;
+	u32		thread_count;
+	v3		cam_position;
+	v3		cam_target;
+	f32		cam_aperture;
+	f32		v_fov;
+	u32		camera_from_args;
+	const char*	scene_path;
+	const char*	export_path;
+	const char*	output_path;
+	u32		verify;
+	u32		packet_size;
+	u32		wavefront;
+	u32		wavefront_benchmark;
+	u32		nee;
+	u32		frames;
+	const char*	animation_path;
+	const char*	coordinator_address;
+	const char*	worker_address;
+	const char*	benchmark_path;
+	const char*	baseline_path;
+	f32		tolerance;
+	const char*	trace_path;
+	u32		heatmap;
+	const char*	image_path;
+	ImageFormat	image_format;
+	ToneMap		tone_map;
+	SamplerType	sampler;
+	f32		exposure;
+	u32		denoise;
+	u32		preview;
+	u32		tile_size;
+	u32		check_hash;
+	u64		expected_hash;
+	s32*		seeds;
+	u32		seed_count;
+
+} Settings;
+
+// One pixel of the float framebuffer: the running sum of its samples plus the online luminance
+// statistics adaptive sampling needs. Padded to 32 bytes so a record never straddles a page of
+// the checkpoint mapping.
+typedef struct AccumPixel
+{
+	f32		r;
+	f32		g;
+	f32		b;
+	u32		samples;
+	f32		mean;
+	f32		m2;
+	u32		pad[2];
+
+} AccumPixel;
+
+// Binary scene files are this header followed by the material and sphere arrays at the offsets
+// it gives, each stored exactly as the renderer uses them so a mapped file needs no parsing.
+typedef struct SceneHeader
+{
+	u32		magic;
+	u32		version;
+	u32		sphere_count;
+	u32		material_count;
+	u64		material_offset;
+	u64		sphere_offset;
+	v3		cam_position;
+	v3		cam_target;
+	f32		cam_aperture;
+	f32		v_fov;
+	u32		plane_count;
+	u32		pad;
+	u64		plane_offset;
+
+} SceneHeader;
+
+typedef struct CheckpointHeader
+{
+	u32		magic;
+	u32		version;
+	u32		width;
+	u32		height;
+	s32		seed;
+	u32		num_spheres;
+	u64		fingerprint;
 
-	return point;
-}
+} CheckpointHeader;
 
-f32 v3_squared_length(v3 a)
+typedef struct Tile
 {
-	return (a.x*a.x + a.y * a.y + a.z * a.z);
-}
+	u32		x0;
+	u32		y0;
+	u32		x1;
+	u32		y1;
+	u32		morton;
+
+} Tile;
+
+// A worker's share of the tiles is the index range [top, bottom), packed into one word so the
+// owner (popping from the bottom) and thieves (taking from the top) only ever need a single
+// compare-and-swap. Padded to a cache line so workers don't share them.
+typedef struct TileQueue
+{
+	volatile u64	range;
+	u8		pad[56];
 
-f32 nrand()
+} TileQueue;
+
+
+#ifdef _WIN32
+typedef HANDLE					thread_handle;
+typedef DWORD					thread_result;
+#define THREAD_CALL				WINAPI
+#else
+typedef pthread_t				thread_handle;
+typedef void*					thread_result;
+#define THREAD_CALL
+#endif // _WIN32
+
+typedef thread_result (THREAD_CALL *thread_proc)(void*);
+
+typedef struct Semaphore
 {
-	return ((f32)rand() / ((f32)RAND_MAX));
-}
+#ifdef _WIN32
+	HANDLE		handle;
+#else
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	u32		count;
+#endif // _WIN32
 
-u32 ray_index = 0;
+} Semaphore;
 
-Ray get_ray(Camera* cam, f32 s, f32 t)
+#ifdef _WIN32
+typedef SOCKET					socket_handle;
+#define INVALID_SOCKET_HANDLE			INVALID_SOCKET
+#else
+typedef int					socket_handle;
+#define INVALID_SOCKET_HANDLE			-1
+#endif // _WIN32
+
+// Every message between the coordinator and its workers starts with this header. A result is
+// followed by the tile's accumulation records, row by row.
+typedef enum NetMessageType
 {
-	v3 lens_ray_offset = vec3(0.0f, 0.0f, 0.0f);
+	NET_HELLO, NET_TILE, NET_RESULT, NET_DONE, NET_REJECT
 
-	while (1)
-	{
-		v3 pos = vec3(nrand(), nrand(), 0.0f);
-		v3 offset = vec3(1.0f, 1.0f, 0.0f);
-		v3 point = v3_sub(pos, offset);
-		v3 lens_point = v3_mulf(point, 2.0f);
+} NetMessageType;
 
-		if (v3_dot(lens_point, lens_point) < 1.0f)
-		{
-			lens_ray_offset = v3_mulf(lens_point, cam->lens_radius);
-			break;
-		}
-	}
+typedef struct NetMessage
+{
+	u32		magic;
+	u32		type;
+	u32		tile;
+	u32		x0;
+	u32		y0;
+	u32		x1;
+	u32		y1;
+	u32		pad;
+	u64		fingerprint;
+
+} NetMessage;
+
+typedef struct NetConnection
+{
+	socket_handle	socket;
+	s32		tile;
+	u32		ready;
 
-	v3 ray_origin_offset_u = v3_mulf(cam->u, lens_ray_offset.x);
-	v3 ray_origin_offset_v = v3_mulf(cam->v, lens_ray_offset.y);
-	v3 final_ray_origin_offset = v3_add(ray_origin_offset_u, ray_origin_offset_v);
+} NetConnection;
 
-	Ray ray;
-	ray.origin = v3_add(cam->position, final_ray_origin_offset);
+// Counters every render thread keeps for itself and adds into the scheduler's totals once it runs
+// out of tiles, so the hot loops never touch shared memory. Paths are counted by where they ended
+// (a material type, or STATS_ESCAPED for the sky) and by their length, the last bucket holding
+// everything from STATS_PATH_LENGTHS - 1 bounces up.
+typedef struct RenderStats
+{
+	u64		rays;
+	u64		box_tests;
+	u64		sphere_tests;
+	u64		triangle_tests;
+	u64		path_lengths[STATS_PATH_LENGTHS];
+	u64		path_ends[STATS_ESCAPED + 1];
+
+} RenderStats;
+
+// The workers are created by the first render_start() and then kept for every pass and frame after
+// it: each waits on its own start semaphore, renders until the tiles run out and posts finish.
+typedef struct Scheduler
+{
+	Tile*		tiles;
+	f64*		tile_seconds;
+	u32		tile_count;
+	volatile u32	tiles_done;
+	volatile u32	tiles_dirty;
+	TileQueue*	queues;
+	u32*		worker_index;
+	f64*		worker_finish;
+	u32		worker_count;
+	thread_handle*	threads;
+	Semaphore*	start;
+	Semaphore	finish;
+	volatile u32	shutdown;
+	RenderStats	stats;
+	f64*		tile_begin;
+	u32*		tile_worker;
+	u64*		tile_rays;
+	FILE*		trace;
+	f64		trace_epoch;
+	u32		trace_events;
+	f64		start_time;
+	f64		tail_latency;
+	f64		tile_p50;
+	f64		tile_p99;
+	f64		tile_max;
+
+} Scheduler;
+
+// A deflate stream made of fixed-Huffman blocks, one per call, with LZ77 matches found through hash
+// chains over the last DEFLATE_WINDOW bytes. Positions in the tables are absolute and stored plus
+// one, so zero means empty.
+typedef struct Deflate
+{
+	unsigned char*	data;
+	u64		capacity;
+	u64		history;
+	u64		position;
+	u64*		head;
+	u64*		chain;
+	u64		bits;
+	u32		bit_count;
+	unsigned char*	out;
+	u64		out_size;
+	u64		out_capacity;
+	u32		adler_a;
+	u32		adler_b;
+
+} Deflate;
+
+// Writes an image a band of rows at a time, in whichever order the format stores them: top down
+// for PNG, bottom up (the renderer's own order) for the others.
+typedef struct ImageWriter
+{
+	FILE*		file;
+	ImageFormat	format;
+	unsigned char*	line;
+	unsigned char*	previous;
+	unsigned char*	filtered;
+	f32*		floats;
+	Deflate		deflate;
+
+} ImageWriter;
+
+// Streams the final pass to disk while it renders. Workers count down the tiles left in each band
+// (a row of tiles) and post ready as each band completes; the writer thread writes bands as soon
+// as every band before them in file order is done.
+typedef struct ImageStream
+{
+	ImageWriter	writer;
+	thread_handle	thread;
+	Semaphore	ready;
+	volatile u32*	tiles_left;
+	volatile u32*	band_done;
+	u32		band_count;
+	u32		active;
+	u32		ok;
+	f64		wait;
+	char		filename[1024];
+
+} ImageStream;
+
+// First-hit features of a pixel, averaged over its first DENOISE_FEATURE_SAMPLES camera rays.
+// Depth is the hit distance, and zero for rays that escape to the sky.
+typedef struct FeaturePixel
+{
+	v3		albedo;
+	v3		normal;
+	f32		depth;
+	f32		pad;
 
-	v3 u_norm = v3_mulf(cam->horizontal, s);
-	v3 v_norm = v3_mulf(cam->vertical, t);
-	v3 uv_norm = v3_add(u_norm, v_norm);
-	v3 uv_cam = v3_add(uv_norm, cam->bottom_left);
+} FeaturePixel;
 
-	ray.direction = v3_sub(uv_cam, ray.origin);
-	ray.bounces = 0;
+// The denoiser filters illumination (colour divided by albedo) so texture is kept sharp, then
+// multiplies the albedo back in. Alongside it goes the variance of each pixel's mean luminance,
+// from the same running statistics adaptive sampling keeps. Its output is written to an
+// accumulation buffer of its own that stands in for the real one while the image is written, so
+// a checkpoint keeps the raw samples.
+typedef struct Denoiser
+{
+	FeaturePixel*	features;
+	v3*		input;
+	v3*		output;
+	f32*		variance;
+	f32*		variance_out;
+	AccumPixel*	result;
+	AccumPixel*	raw;
+	u32		step;
+
+} Denoiser;
+
+// Whole-image post-processing hands rows out to threads one at a time.
+typedef struct ParallelJob
+{
+	void		(*run)(u32 index);
+	u32		count;
+	volatile u32	next;
 
-	ray.id = ray_index;
+} ParallelJob;
 
-	ray_index++;
+// Procedural scenes are generated in strips along x that never share a sphere, so the strips can
+// be filled in parallel and the result depends only on the seed and the sphere count.
+typedef struct SceneRegion
+{
+	f32		min_x;
+	f32		max_x;
+	u32		first;
+	u32		count;
 
-	return ray;
-}
+} SceneRegion;
 
-void save_file(void)
+typedef struct SceneGrid
 {
-	char* system_path = "D:\\Root\\Horus_Renders\\";
-	char* prefix = "render_";
-	char* suffix = ".bmp";
+	f32		min_x;
+	f32		min_z;
+	f32		cell_size;
+	u32		columns;
+	u32		rows;
+	u32*		heads;
+	u32*		next;
 
-	sprintf(path, "%s%i%s", system_path, SEED, "\\");
+} SceneGrid;
 
-	_mkdir(path);
+typedef struct SceneBuilder
+{
+	SceneRegion*	regions;
+	u32		region_count;
+	volatile u32	next_region;
+	f32		radius_scale;
+	s32		seed;
+	Sphere*		spheres;
+	Material*	materials;
+
+} SceneBuilder;
+
+// The procedural scene and sphere BVH for one seed, held apart from the scene being rendered so a
+// seed sweep can build the next variant on a background thread while the current one renders.
+typedef struct SceneVariant
+{
+	s32		seed;
+	Sphere*		spheres;
+	Plane*		planes;
+	Material*	materials;
+	BVH		bvh;
+	thread_handle	thread;
 
-	char filepath_and_name[128];
+} SceneVariant;
+
+#ifdef WINDOWED
+static HWND					hwnd;
+static HBITMAP					bitmap_handle;
+static HDC					device_context;
+static BITMAPINFO				bitmapinfo;
+static u8					STATE = RENDER;
+#endif // WINDOWED
+static Settings					settings;
+static Sphere*					spheres;
+static Plane*					planes;
+static u32					plane_count;
+static Material*				materials;
+static u32					material_count;
+static BVH					scene_bvh;
+static SphereSoA				sphere_soa;
+static Mesh					mesh;
+static MeshFile*				mesh_files;
+static u32					mesh_file_count;
+static v3*					palette;
+static u8*					bitmap_image_data;
+static AccumPixel*				accumulation;
+static CheckpointHeader*			checkpoint;
+static u64					checkpoint_size;
+static u32					pass_target;
+static u32					preview_block;
+static BitmapFileHeader				file_header;
+static BitmapInfoHeader				info_header;
+static Camera					camera;
+static s32					SEED;
+static char					path[512];
+static f64					render_time;
+static THREAD_LOCAL Rng				rng;
+static THREAD_LOCAL RenderStats			stats;
+static const char*				material_names[4] = { "metal", "lambert", "checker", "light" };
+static const char*				format_names[4] = { "bmp", "png", "pfm", "exr" };
+static const char*				tone_map_names[4] = { "gamma", "srgb", "reinhard", "aces" };
+static const char*				sampler_names[3] = { "random", "sobol", "bluenoise" };
+static f32*					blue_noise;
+static u32					sobol_tables[4][4][256];
+static unsigned char*				tone_lut;
+static ImageStream				image_stream;
+static Denoiser					denoiser;
+static ParallelJob				parallel_job;
+static f64*					pixel_seconds;
+static Scheduler				scheduler;
+static u64					net_fingerprint;
+static SceneBuilder				scene_builder;
+static LightList				lights;
+static Animation				animation;
+static BenchmarkScene				benchmark_scenes[4] =
+{
+	{ "night",		128,		BENCHMARK_DEFAULT },
+	{ "spheres_100k",	100000,		BENCHMARK_DEFAULT },
+	{ "lights",		128,		BENCHMARK_LIGHTS },
+	{ "mirrors",		128,		BENCHMARK_MIRRORS },
+};
 
-	sprintf(filepath_and_name, "%s%s%s%i%s", path, "\\", prefix, SEED, suffix);
+const char class_name[] = "Horus";
 
-	FILE* file = fopen(filepath_and_name, "wb");
+thread_handle thread_create(thread_proc proc, void* data)
+{
+#ifdef _WIN32
+	return CreateThread(NULL, 0, proc, data, 0, NULL);
+#else
+	pthread_t thread;
 
-	if (!file) return;
+	pthread_create(&thread, NULL, proc, data);
 
-	fwrite(&file_header, sizeof(BitmapFileHeader), 1, file);
-	fwrite(&info_header, sizeof(BitmapInfoHeader), 1, file);
-	fwrite(bitmap_image_data, info_header.image_size, 1, file);
+	return thread;
+#endif // _WIN32
+}
 
-	fclose(file);
+void thread_join(thread_handle thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif // _WIN32
+}
 
-	char log_filename_and_path[128];
+void semaphore_init(Semaphore* semaphore)
+{
+#ifdef _WIN32
+	semaphore->handle = CreateSemaphoreA(NULL, 0, 0x7FFFFFFF, NULL);
+#else
+	pthread_mutex_init(&semaphore->mutex, NULL);
+	pthread_cond_init(&semaphore->cond, NULL);
+	semaphore->count = 0;
+#endif // _WIN32
+}
 
-	sprintf(log_filename_and_path, "%s%s%i%s", path, "data_", SEED, ".txt");
+void semaphore_post(Semaphore* semaphore, u32 count)
+{
+#ifdef _WIN32
+	ReleaseSemaphore(semaphore->handle, count, NULL);
+#else
+	pthread_mutex_lock(&semaphore->mutex);
+	semaphore->count += count;
+	pthread_cond_broadcast(&semaphore->cond);
+	pthread_mutex_unlock(&semaphore->mutex);
+#endif // _WIN32
+}
 
-	FILE* log;
+void semaphore_wait(Semaphore* semaphore)
+{
+#ifdef _WIN32
+	WaitForSingleObject(semaphore->handle, INFINITE);
+#else
+	pthread_mutex_lock(&semaphore->mutex);
 
-	log = fopen(log_filename_and_path, "w");
+	while (semaphore->count == 0) pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
 
-	fprintf(log, "SEED			%i\n\n", SEED);
-	fprintf(log, "NUM_COLOURS		%i\n", NUM_COLOURS);
-	fprintf(log, "NUM_SPHERES:		%i\n", NUM_SPHERES);
-	fprintf(log, "NUM_AA_SAMPLES: 		%i\n", NUM_AA_SAMPLES);
-	fprintf(log, "OUTPUT_WIDTH:		%i\n", OUTPUT_WIDTH);
-	fprintf(log, "OUTPUT_HEIGHT:		%i\n", OUTPUT_HEIGHT);
-	fprintf(log, "ASPECT:			%i\n", ASPECT);
-	fprintf(log, "V_FOV:			%i\n", V_FOV);
-	fprintf(log, "RENDER_TIME:		%f s\n", render_time);
-	fprintf(log, "MAX_BOUNCES:		%i\n", MAX_BOUNCES);
-	fprintf(log, "CAM_POS_X:		%f\n", CAM_POS_X);
-	fprintf(log, "CAM_POS_Y:		%f\n", CAM_POS_Y);
-	fprintf(log, "CAM_POS_Z:		%f\n", CAM_POS_Z);
-	fprintf(log, "CAM_TARGET_X:		%f\n", CAM_TARGET_X);
-	fprintf(log, "CAM_TARGET_Z:		%f\n", CAM_TARGET_Z);
-	fprintf(log, "CAM_APERTURE:		%f\n", CAM_APERTURE);
+	semaphore->count--;
+	pthread_mutex_unlock(&semaphore->mutex);
+#endif // _WIN32
+}
 
-	fclose(log);
+void semaphore_destroy(Semaphore* semaphore)
+{
+#ifdef _WIN32
+	CloseHandle(semaphore->handle);
+#else
+	pthread_cond_destroy(&semaphore->cond);
+	pthread_mutex_destroy(&semaphore->mutex);
+#endif // _WIN32
 }
 
-v3 random_unit_sphere(void)
+thread_result THREAD_CALL JobWorker(void* data)
 {
 	while (1)
 	{
-		v3 pos = vec3(nrand(), nrand(), nrand());
-		v3 point = v3_mulf(pos, 2.0f);
-		v3 unit = vec3(1.0f, 1.0f, 1.0f);
-		v3 final = v3_sub(point, unit);
+		u32 index = atomic_inc_u32(&parallel_job.next) - 1;
 
-		if (v3_squared_length(final) < 1.0f)
-		{
-			return final;
-		}
+		if (index >= parallel_job.count) break;
+
+		parallel_job.run(index);
 	}
+
+	return 0;
 }
 
-u32 intersection(Ray* r, Sphere s, Hit* h, float t_min, float t_max)
+// Runs run(0) .. run(count - 1) across settings.thread_count short-lived threads, each taking the
+// next index as it finishes one. Used for work outside the tile scheduler: post-processing rows
+// and building meshes.
+void parallel_for(void (*run)(u32 index), u32 count)
 {
-	v3	i = v3_sub(r->origin, s.position);
-	f32	a = v3_dot(r->direction, r->direction);
-	f32	b = v3_dot(i, r->direction);
-	f32	c = v3_dot(i, i) - s.radius * s.radius;
-	f32	d = b * b*a*c;
+	u32 workers = (count < settings.thread_count) ? count : settings.thread_count;
 
-	if (d > 0)
+	parallel_job.run = run;
+	parallel_job.count = count;
+	parallel_job.next = 0;
+
+	if (workers <= 1)
 	{
-		float temp = 0.0f;
-		temp = (-b - sqrt(b*b - a * c)) / a;
+		JobWorker(NULL);
+		return;
+	}
 
-		if (temp < t_max && temp > t_min)
-		{
-			h->t = temp;
-			h->point = point_at_parameter(*r, temp);
+	thread_handle* threads = malloc(workers * sizeof(thread_handle));
 
-			v3 dir = v3_sub(h->point, s.position);
-			h->normal = v3_div(dir, s.radius);
+	for (u32 i = 0; i < workers; i++) threads[i] = thread_create(JobWorker, NULL);
+	for (u32 i = 0; i < workers; i++) thread_join(threads[i]);
 
-			return 1;
-		}
+	free(threads);
+}
 
-		temp = (-b + sqrt(b*b - a * c)) / a;
+u32 net_startup(void)
+{
+#ifdef _WIN32
+	WSADATA wsa_data;
+
+	return WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0;
+#else
+	signal(SIGPIPE, SIG_IGN);
+
+	return 1;
+#endif // _WIN32
+}
+
+void net_close(socket_handle socket)
+{
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif // _WIN32
+}
+
+// Addresses are host:port (or just a port, meaning localhost) for TCP, or unix:<path> for a Unix
+// domain socket.
+socket_handle net_open(const char* address, u32 listening)
+{
+	socket_handle result = INVALID_SOCKET_HANDLE;
+
+#ifndef _WIN32
+	if (!strncmp(address, "unix:", 5))
+	{
+		struct sockaddr_un unix_address;
+
+		memset(&unix_address, 0, sizeof(unix_address));
+		unix_address.sun_family = AF_UNIX;
+		strncpy(unix_address.sun_path, address + 5, sizeof(unix_address.sun_path) - 1);
+
+		result = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (result == INVALID_SOCKET_HANDLE) return result;
+
+		if (listening) unlink(unix_address.sun_path);
+
+		if ((listening ? bind(result, (struct sockaddr*)&unix_address, sizeof(unix_address)) : connect(result, (struct sockaddr*)&unix_address, sizeof(unix_address))) != 0)
+		{
+			net_close(result);
+			return INVALID_SOCKET_HANDLE;
+		}
+
+		if (listening && listen(result, NET_MAX_CONNECTIONS) != 0)
+		{
+			net_close(result);
+			return INVALID_SOCKET_HANDLE;
+		}
+
+		return result;
+	}
+#endif // _WIN32
+
+	char		host[256];
+	const char*	port = strrchr(address, ':');
+	struct addrinfo	hints;
+	struct addrinfo*	addresses;
+
+	if (port)
+	{
+		snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+		port++;
+	}
+	else
+	{
+		snprintf(host, sizeof(host), "%s", listening ? "" : "127.0.0.1");
+		port = address;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &addresses) != 0) return INVALID_SOCKET_HANDLE;
+
+	result = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+
+	if (result != INVALID_SOCKET_HANDLE)
+	{
+		s32 yes = 1;
+		u32 ok;
+
+		setsockopt(result, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+
+		if (listening)
+		{
+			setsockopt(result, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+			ok = bind(result, addresses->ai_addr, (int)addresses->ai_addrlen) == 0 && listen(result, NET_MAX_CONNECTIONS) == 0;
+		}
+		else
+		{
+			ok = connect(result, addresses->ai_addr, (int)addresses->ai_addrlen) == 0;
+		}
+
+		if (!ok)
+		{
+			net_close(result);
+			result = INVALID_SOCKET_HANDLE;
+		}
+	}
+
+	freeaddrinfo(addresses);
+
+	return result;
+}
+
+// A peer that stops talking mid-message for NET_TIMEOUT seconds is treated as dead.
+void net_set_timeout(socket_handle socket, u32 seconds)
+{
+#ifdef _WIN32
+	DWORD timeout = seconds * 1000;
+#else
+	struct timeval timeout = { seconds, 0 };
+#endif // _WIN32
+
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+u32 net_send(socket_handle socket, const void* data, u64 size)
+{
+	const char* bytes = data;
+
+	while (size)
+	{
+		s64 sent = send(socket, bytes, (int)(size < 0x40000000 ? size : 0x40000000), 0);
+
+		if (sent <= 0) return 0;
+
+		bytes += sent;
+		size -= sent;
+	}
+
+	return 1;
+}
+
+u32 net_recv(socket_handle socket, void* data, u64 size)
+{
+	char* bytes = data;
+
+	while (size)
+	{
+		s64 received = recv(socket, bytes, (int)(size < 0x40000000 ? size : 0x40000000), 0);
+
+		if (received <= 0) return 0;
+
+		bytes += received;
+		size -= received;
+	}
+
+	return 1;
+}
+
+u32 get_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+
+	return system_info.dwNumberOfProcessors;
+#else
+	s64 count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (count > 0) ? (u32)count : 1;
+#endif // _WIN32
+}
+
+f64 get_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+
+	return (f64)counter.QuadPart / (f64)frequency.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+#endif // _WIN32
+}
+
+void sleep_milliseconds(u32 milliseconds)
+{
+#ifdef _WIN32
+	Sleep(milliseconds);
+#else
+	usleep(milliseconds * 1000);
+#endif // _WIN32
+}
+
+void* alloc_aligned(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void* memory = NULL;
+
+	if (posix_memalign(&memory, alignment, size) != 0) return NULL;
+
+	return memory;
+#endif // _WIN32
+}
+
+void free_aligned(void* memory)
+{
+#ifdef _WIN32
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif // _WIN32
+}
+
+// Maps size bytes of a file read-write. An empty or missing file is created at that size; any
+// other file is only mapped if it is exactly that size, and *existed is set so the caller checks
+// what it holds before writing to it.
+void* map_file(const char* filename, u64 size, u32* existed)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	*existed = file_size.QuadPart > 0;
+
+	if (*existed && (u64)file_size.QuadPart != size)
+	{
+		CloseHandle(file);
+		return NULL;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+	CloseHandle(file);
+
+	if (!mapping) return NULL;
+
+	void* memory = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	CloseHandle(mapping);
+
+	return memory;
+#else
+	s32 file = open(filename, O_RDWR | O_CREAT, 0644);
+
+	if (file < 0) return NULL;
+
+	struct stat file_stat;
+	fstat(file, &file_stat);
+	*existed = file_stat.st_size > 0;
+
+	if ((*existed && (u64)file_stat.st_size != size) || (!*existed && ftruncate(file, size) != 0))
+	{
+		close(file);
+		return NULL;
+	}
+
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	close(file);
+
+	return (memory == MAP_FAILED) ? NULL : memory;
+#endif // _WIN32
+}
+
+// Maps a whole file copy-on-write: reads come straight from the page cache, and any writes the
+// renderer makes stay private to this process.
+void* map_file_private(const char* filename, u64* size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	*size = (u64)file_size.QuadPart;
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+
+	if (!mapping) return NULL;
+
+	void* memory = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+
+	return memory;
+#else
+	s32 file = open(filename, O_RDONLY);
+
+	if (file < 0) return NULL;
+
+	struct stat file_stat;
+	fstat(file, &file_stat);
+	*size = (u64)file_stat.st_size;
+
+	if (*size == 0)
+	{
+		close(file);
+		return NULL;
+	}
+
+	void* memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	close(file);
+
+	return (memory == MAP_FAILED) ? NULL : memory;
+#endif // _WIN32
+}
+
+void unmap_file(void* memory, u64 size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(memory);
+#else
+	munmap(memory, size);
+#endif // _WIN32
+}
+
+void flush_file(void* memory, u64 size)
+{
+#ifdef _WIN32
+	FlushViewOfFile(memory, size);
+#else
+	msync(memory, size, MS_SYNC);
+#endif // _WIN32
+}
+
+f32 fract(f32 x)
+{
+	return x - (s64)x;
+}
+
+f32 hash(f32 x)
+{
+	return fabsf(fract(sin(x) * 43758.5453));
+}
+
+f32 ffmin(f32 a, f32 b)
+{
+	return a < b ? a : b;
+}
+
+f32 ffmax(f32 a, f32 b)
+{
+	return a > b ? a : b;
+}
+
+f32 v3_dot(v3 a, v3 b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+v3 v3_div(v3 a, f32 n)
+{
+	v3 v;
+	v.x = a.x / n;
+	v.y = a.y / n;
+	v.z = a.z / n;
+
+	return v;
+}
+
+f32 v3_mag(v3 a)
+{
+	return (f32)sqrt(a.x*a.x + a.y * a.y + a.z * a.z);
+}
+
+v3 vec3(f32 x, f32 y, f32 z)
+{
+	v3 v;
+	v.x = x;
+	v.y = y;
+	v.z = z;
+
+	return v;
+}
+
+v3 v3_normalized(v3 a)
+{
+	f32  m = v3_mag(a);
+	v3 v;
+	v.x = 0.0f;
+	v.y = 0.0f;
+	v.z = 0.0f;
+
+	if (m == 1.0f) v = a;
+	else if (m != 0.0f) v = v3_div(a, m);
+
+	return v;
+}
+
+v3 v3_mulf(v3 a, f32 n)
+{
+	v3 v;
+	v.x = a.x * n;
+	v.y = a.y * n;
+	v.z = a.z * n;
+
+	return v;
+}
+
+v3 v3_mulv(v3 a, v3 b)
+{
+	v3 v;
+	v.x = a.x * b.x;
+	v.y = a.y * b.y;
+	v.z = a.z * b.z;
+
+	return v;
+}
+
+v3 v3_sub(v3 a, v3 b)
+{
+	v3 v;
+	v.x = a.x - b.x;
+	v.y = a.y - b.y;
+	v.z = a.z - b.z;
+
+	return v;
+}
+
+v3 v3_cross(v3 a, v3 b)
+{
+	v3 v;
+
+	v.x = a.y * b.z - b.y * a.z;
+	v.y = a.z * b.x - b.z * a.x;
+	v.z = a.x * b.y - b.x * a.y;
+
+	return v;
+}
+
+v3 v3_add(v3 a, v3 b)
+{
+	v3 v;
+
+	v.x = a.x + b.x;
+	v.y = a.y + b.y;
+	v.z = a.z + b.z;
+
+	return v;
+}
+
+v3 v3_reflect(v3 a, v3 normal)
+{
+	f32 dp = v3_dot(a, normal);
+	v3	v = v3_mulf(normal, 2.0f*dp);
+	v3  r = v3_sub(a, v);
+
+	return r;
+}
+
+v3 point_at_parameter(Ray r, float t)
+{
+	v3 t_dir = v3_mulf(r.direction, t);
+	v3 point = v3_add(t_dir, r.origin);
+
+	return point;
+}
+
+f32 v3_squared_length(v3 a)
+{
+	return (a.x*a.x + a.y * a.y + a.z * a.z);
+}
+
+u64 mix64(u64 x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBull;
+	x ^= x >> 31;
+
+	return x;
+}
+
+// Every random number comes from a PCG32 stream picked by hashing the seed with a stream (a pixel
+// index, or one of the RNG_STREAM_ constants) and an index within it (the sample). Each camera
+// sample draws its lens, subpixel and bounce randoms in order from its own stream, so the image
+// depends only on the seed and never on which thread rendered which pixel.
+void rng_seed(Rng* r, u64 seed, u64 stream, u64 index)
+{
+	u64 key = mix64(mix64(mix64(seed) ^ stream) ^ index);
+
+	r->state = key;
+	r->inc = (mix64(key ^ 0x9E3779B97F4A7C15ull) << 1) | 1;
+}
+
+u32 rng_next(Rng* r)
+{
+	u64 old = r->state;
+
+	r->state = old * 6364136223846793005ull + r->inc;
+
+	u32 xorshifted = (u32)(((old >> 18) ^ old) >> 27);
+	u32 rot = (u32)(old >> 59);
+
+	return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+}
+
+f32 nrand()
+{
+	return (rng_next(&rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+u32 reverse_bits32(u32 x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00FF00FF) << 8) | ((x >> 8) & 0x00FF00FF);
+	x = ((x & 0x0F0F0F0F) << 4) | ((x >> 4) & 0x0F0F0F0F);
+	x = ((x & 0x33333333) << 2) | ((x >> 2) & 0x33333333);
+	x = ((x & 0x55555555) << 1) | ((x >> 1) & 0x55555555);
+
+	return x;
+}
+
+// Starts the random numbers of sample index of a pixel. The random sampler draws from the PCG
+// stream for the pixel and index, as every sample did before there were samplers.
+void sampler_begin(u64 pixel, u32 index)
+{
+	rng_seed(&rng, SEED, pixel, index);
+
+	rng.scramble = (u32)mix64((settings.sampler == SAMPLER_SOBOL) ? mix64(SEED) ^ pixel : mix64(SEED));
+	rng.index = reverse_bits32(index);
+	rng.dimension = 0;
+	rng.x = (u32)(pixel % settings.output_width);
+	rng.y = (u32)(pixel / settings.output_width);
+}
+
+// Every bounce owns a fixed block of SAMPLE_BOUNCE_DIMENSIONS dimensions after the pixel and lens
+// ones, whether or not it uses all of them, so a dimension always means the same decision. The
+// quasi-random samplers stratify each aligned group of four together: pixel and lens, a bounce's
+// direction and roulette, and its light sample.
+void sampler_bounce(u32 bounce)
+{
+	rng.dimension = SAMPLE_BOUNCE + bounce * SAMPLE_BOUNCE_DIMENSIONS;
+}
+
+// Nested uniform (Owen) scrambling of a bit-reversed 32-bit fraction: each bit is flipped
+// depending on the bits above it, which reversed are the ones below. This is Laine and Karras's
+// hash as used in Burley's "Practical Hash-based Owen Scrambling".
+u32 owen_scramble_reversed(u32 x, u32 seed)
+{
+	x += seed;
+	x ^= x * 0x6C50B47Cu;
+	x ^= x * 0xB82F1E52u;
+	x ^= x * 0xC7AFE638u;
+	x ^= x * 0x8D22F6E6u;
+
+	return x;
+}
+
+// Coordinate dimension % 4 of point index (bit reversed) of the 4D Sobol sequence that the group of four
+// dimensions holding dimension uses. Shuffling the index with an Owen scramble of its own keeps
+// every power-of-two prefix stratified in all four at once while decorrelating the groups.
+// Everything stays bit-reversed until the end; sobol_tables are built for that.
+f32 sobol_sample(u32 index, u32 dimension, u32 seed)
+{
+	u32	group_seed = (u32)mix64(((u64)seed << 32) | (dimension >> 2));
+	u32	i = owen_scramble_reversed(index, group_seed);
+	u32	(*table)[256] = sobol_tables[dimension & 3];
+	u32	x = table[0][i & 0xFF] ^ table[1][(i >> 8) & 0xFF] ^ table[2][(i >> 16) & 0xFF] ^ table[3][i >> 24];
+
+	x = reverse_bits32(owen_scramble_reversed(x, group_seed ^ (0x9E3779B9u * (1 + (dimension & 3)))));
+
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// The random number for dimension offset of the current bounce (or of the camera, before the first).
+f32 sample_dimension(u32 offset)
+{
+	u32 dimension = rng.dimension + offset;
+
+	if (settings.sampler == SAMPLER_SOBOL) return sobol_sample(rng.index, dimension, rng.scramble);
+
+	if (settings.sampler == SAMPLER_BLUE_NOISE)
+	{
+		u32	shift = (dimension + 1) * 0x9E3779B9u;
+		u32	x = (rng.x + (shift >> 26)) & (BLUE_NOISE_SIZE - 1);
+		u32	y = (rng.y + (shift >> 20)) & (BLUE_NOISE_SIZE - 1);
+		f32	u = sobol_sample(rng.index, dimension, rng.scramble) + blue_noise[y * BLUE_NOISE_SIZE + x];
+
+		return (u >= 1.0f) ? u - 1.0f : u;
+	}
+
+	return nrand();
+}
+
+// A uniform point in the unit ball from three dimensions, or on its surface from the first two.
+v3 sample_ball(u32 offset, u32 surface)
+{
+	f32	z = 1.0f - 2.0f * sample_dimension(offset);
+	f32	phi = 2.0f * PI * sample_dimension(offset + 1);
+	f32	r = sqrtf(ffmax(0.0f, 1.0f - z * z));
+	v3	point = vec3(r * cosf(phi), r * sinf(phi), z);
+
+	return surface ? point : v3_mulf(point, cbrtf(sample_dimension(offset + 2)));
+}
+
+// Shirley and Chiu's concentric map from the unit square to the unit disk, which keeps strata
+// intact where rejection sampling would throw quasi-random points away.
+v3 sample_disk(f32 a, f32 b)
+{
+	f32 x = 2.0f * a - 1.0f;
+	f32 y = 2.0f * b - 1.0f;
+	f32 r, phi;
+
+	if (x == 0.0f && y == 0.0f) return vec3(0.0f, 0.0f, 0.0f);
+
+	if (fabsf(x) > fabsf(y))
+	{
+		r = x;
+		phi = (PI / 4.0f) * (y / x);
+	}
+	else
+	{
+		r = y;
+		phi = (PI / 2.0f) - (PI / 4.0f) * (x / y);
+	}
+
+	return vec3(r * cosf(phi), r * sinf(phi), 0.0f);
+}
+
+// Adds or removes one point's Gaussian in the toroidal energy field void-and-cluster works on.
+void blue_noise_splat(f32* energy, f32* kernel, u32 index, f32 sign)
+{
+	s32 r = BLUE_NOISE_RADIUS;
+	s32 x = (s32)(index % BLUE_NOISE_SIZE);
+	s32 y = (s32)(index / BLUE_NOISE_SIZE);
+
+	for (s32 dy = -r; dy <= r; dy++)
+	{
+		for (s32 dx = -r; dx <= r; dx++)
+		{
+			u32 cell = ((y + dy) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE + ((x + dx) & (BLUE_NOISE_SIZE - 1));
+
+			energy[cell] += sign * kernel[(dy + r) * (2 * r + 1) + dx + r];
+		}
+	}
+}
+
+// The point with the highest energy among those set (the tightest cluster), or the lowest among
+// those clear (the largest void).
+u32 blue_noise_extreme(f32* energy, unsigned char* pattern, u32 set)
+{
+	u32 best = 0;
+	f32 best_energy = set ? -FLT_MAX : FLT_MAX;
+
+	for (u32 i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; i++)
+	{
+		if (pattern[i] != set) continue;
+
+		if (set ? energy[i] > best_energy : energy[i] < best_energy)
+		{
+			best = i;
+			best_energy = energy[i];
+		}
+	}
+
+	return best;
+}
+
+// Fills the Sobol tables every run and, for --sampler bluenoise, builds the blue-noise mask once.
+void setup_sampler(void)
+{
+	// Direction numbers of the first four Sobol dimensions (Joe and Kuo): van der Corput, then
+	// the primitive polynomials x + 1, x^2 + x + 1 and x^3 + x + 1. A point is the xor of the
+	// numbers for the set bits of its index. The tables hold those xors a byte at a time, indexed
+	// by the index and giving the point both bit-reversed, as sobol_sample works on them.
+	u32 degree[4] = { 0, 1, 2, 3 };
+	u32 coefficients[4] = { 0, 0, 1, 1 };
+	u32 initial_numbers[4][3] = { { 0 }, { 1 }, { 1, 3 }, { 1, 3, 1 } };
+
+	for (u32 d = 0; d < 4; d++)
+	{
+		u32 v[32];
+		u32 s = degree[d];
+
+		for (u32 k = 0; k < 32; k++)
+		{
+			if (s == 0)		v[k] = 1u << (31 - k);
+			else if (k < s)		v[k] = initial_numbers[d][k] << (31 - k);
+			else
+			{
+				v[k] = v[k - s] ^ (v[k - s] >> s);
+
+				for (u32 j = 1; j < s; j++)
+				{
+					if ((coefficients[d] >> (s - 1 - j)) & 1) v[k] ^= v[k - j];
+				}
+			}
+		}
+
+		for (u32 b = 0; b < 4; b++)
+		{
+			for (u32 byte = 0; byte < 256; byte++)
+			{
+				u32 x = 0;
+
+				for (u32 bit = 0; bit < 8; bit++)
+				{
+					if ((byte >> bit) & 1) x ^= reverse_bits32(v[31 - (b * 8 + bit)]);
+				}
+
+				sobol_tables[d][b][byte] = x;
+			}
+		}
+	}
+
+	if (settings.sampler != SAMPLER_BLUE_NOISE || blue_noise) return;
+
+	// The mask comes from Ulichney's void-and-cluster method: a random tenth of the cells is
+	// relaxed until no point moves, ranked by removing the tightest clusters one at a time, and
+	// then the rest are ranked by filling the largest voids. A rank becomes a value in [0, 1), and
+	// any threshold of the mask is evenly spread with no low frequencies.
+
+	u32		count = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+	u32		initial = count / 10;
+	u32		width = 2 * BLUE_NOISE_RADIUS + 1;
+	f32*		kernel = malloc(width * width * sizeof(f32));
+	f32*		energy = calloc(count, sizeof(f32));
+	f32*		start_energy = malloc(count * sizeof(f32));
+	unsigned char*	pattern = calloc(count, 1);
+	unsigned char*	start_pattern = malloc(count);
+	u32*		rank = malloc(count * sizeof(u32));
+
+	for (u32 i = 0; i < width * width; i++)
+	{
+		f32 dx = (f32)(i % width) - BLUE_NOISE_RADIUS;
+		f32 dy = (f32)(i / width) - BLUE_NOISE_RADIUS;
+
+		kernel[i] = expf(-(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+	}
+
+	rng_seed(&rng, 0, RNG_STREAM_BLUE_NOISE, 0);
+
+	for (u32 placed = 0; placed < initial;)
+	{
+		u32 cell = rng_next(&rng) % count;
+
+		if (pattern[cell]) continue;
+
+		pattern[cell] = 1;
+		blue_noise_splat(energy, kernel, cell, 1.0f);
+		placed++;
+	}
+
+	while (1)
+	{
+		u32 cluster = blue_noise_extreme(energy, pattern, 1);
+
+		pattern[cluster] = 0;
+		blue_noise_splat(energy, kernel, cluster, -1.0f);
+
+		u32 void_cell = blue_noise_extreme(energy, pattern, 0);
+
+		pattern[void_cell] = 1;
+		blue_noise_splat(energy, kernel, void_cell, 1.0f);
+
+		if (void_cell == cluster) break;
+	}
+
+	memcpy(start_pattern, pattern, count);
+	memcpy(start_energy, energy, count * sizeof(f32));
+
+	for (u32 r = initial; r-- > 0;)
+	{
+		u32 cluster = blue_noise_extreme(energy, pattern, 1);
+
+		pattern[cluster] = 0;
+		blue_noise_splat(energy, kernel, cluster, -1.0f);
+		rank[cluster] = r;
+	}
+
+	memcpy(pattern, start_pattern, count);
+	memcpy(energy, start_energy, count * sizeof(f32));
+
+	for (u32 r = initial; r < count; r++)
+	{
+		u32 void_cell = blue_noise_extreme(energy, pattern, 0);
+
+		pattern[void_cell] = 1;
+		blue_noise_splat(energy, kernel, void_cell, 1.0f);
+		rank[void_cell] = r;
+	}
+
+	blue_noise = malloc(count * sizeof(f32));
+
+	for (u32 i = 0; i < count; i++) blue_noise[i] = (rank[i] + 0.5f) / count;
+
+	free(kernel);
+	free(energy);
+	free(start_energy);
+	free(pattern);
+	free(start_pattern);
+	free(rank);
+}
+
+Ray get_ray(Camera* cam, f32 s, f32 t)
+{
+	f32 a = sample_dimension(SAMPLE_LENS);
+	f32 b = sample_dimension(SAMPLE_LENS + 1);
+	v3 lens_ray_offset = v3_mulf(sample_disk(a, b), cam->lens_radius);
+
+	v3 ray_origin_offset_u = v3_mulf(cam->u, lens_ray_offset.x);
+	v3 ray_origin_offset_v = v3_mulf(cam->v, lens_ray_offset.y);
+	v3 final_ray_origin_offset = v3_add(ray_origin_offset_u, ray_origin_offset_v);
+
+	Ray ray;
+	ray.origin = v3_add(cam->position, final_ray_origin_offset);
+
+	v3 u_norm = v3_mulf(cam->horizontal, s);
+	v3 v_norm = v3_mulf(cam->vertical, t);
+	v3 uv_norm = v3_add(u_norm, v_norm);
+	v3 uv_cam = v3_add(uv_norm, cam->bottom_left);
+
+	ray.direction = v3_sub(uv_cam, ray.origin);
+	ray.bounces = 0;
+
+	return ray;
+}
+
+u64 fnv1a(const void* data, u64 size, u64 h)
+{
+	const unsigned char* bytes = data;
+
+	for (u64 i = 0; i < size; i++)
+	{
+		h ^= bytes[i];
+		h *= 0x100000001B3ull;
+	}
+
+	return h;
+}
+
+u64 image_hash(void)
+{
+	return fnv1a(bitmap_image_data, info_header.image_size, 0xCBF29CE484222325ull);
+}
+
+u32 write_bitmap(const char* filename, u8* data)
+{
+	FILE* file = fopen(filename, "wb");
+
+	if (!file) return 0;
+
+	fwrite(&file_header, sizeof(BitmapFileHeader), 1, file);
+	fwrite(&info_header, sizeof(BitmapInfoHeader), 1, file);
+	fwrite(data, info_header.image_size, 1, file);
+
+	fclose(file);
+
+	return 1;
+}
+
+// Writes the per-pixel sample counts of an adaptive or resumed render as a viridis image next to the render,
+// scaled so the sample cap is the top of the palette. Returns the total samples taken.
+u64 write_sample_map(void)
+{
+	u8*	map = alloc_aligned(info_header.image_size, 64);
+	u64	total = 0;
+	u64	pixels = (u64)settings.output_width * settings.output_height;
+
+	for (u64 i = 0; i < pixels; i++)
+	{
+		v3 c = viridis(ffmin((f32)accumulation[i].samples / (f32)settings.num_aa_samples, 0.999f));
+
+		map[i * 4 + 0] = (u8)(255.99f * c.z);
+		map[i * 4 + 1] = (u8)(255.99f * c.y);
+		map[i * 4 + 2] = (u8)(255.99f * c.x);
+		map[i * 4 + 3] = 0;
+
+		total += accumulation[i].samples;
+	}
+
+	char filename[sizeof(path) + 32];
+
+	snprintf(filename, sizeof(filename), "%s%s%i%s", path, "samples_", SEED, ".bmp");
+
+	write_bitmap(filename, map);
+
+	free_aligned(map);
+
+	return total;
+}
+
+// Tests per ray, average path length (the last histogram bucket counted at its lower bound) and
+// the share of paths ending at each material type or in the sky.
+void print_stats(RenderStats* totals)
+{
+	u64 paths = 0;
+	u64 bounces = 0;
+
+	for (u32 i = 0; i < STATS_PATH_LENGTHS; i++)
+	{
+		paths += totals->path_lengths[i];
+		bounces += i * totals->path_lengths[i];
+	}
+
+	if (!totals->rays || !paths) return;
+
+	if (totals->triangle_tests)
+	{
+		printf("%.1f box, %.1f sphere and %.1f triangle tests per ray, %.2f bounces per path, paths ended:", (f64)totals->box_tests / totals->rays, (f64)totals->sphere_tests / totals->rays, (f64)totals->triangle_tests / totals->rays, (f64)bounces / paths);
+	}
+	else
+	{
+		printf("%.1f box and %.1f sphere tests per ray, %.2f bounces per path, paths ended:", (f64)totals->box_tests / totals->rays, (f64)totals->sphere_tests / totals->rays, (f64)bounces / paths);
+	}
+
+	for (u32 i = 0; i <= STATS_ESCAPED; i++)
+	{
+		printf(" %s %.1f%%", (i < STATS_ESCAPED) ? material_names[i] : "sky", 100.0 * totals->path_ends[i] / paths);
+	}
+
+	printf("\n");
+}
+
+// Writes the render time of every pixel as a viridis image next to the render, scaled so the 99th
+// percentile is the top of the palette and a handful of very slow pixels cannot wash it out.
+void write_cost_map(void)
+{
+	u8*	map = alloc_aligned(info_header.image_size, 64);
+	u64	pixels = (u64)settings.output_width * settings.output_height;
+	f64*	sorted = malloc(pixels * sizeof(f64));
+
+	memcpy(sorted, pixel_seconds, pixels * sizeof(f64));
+	qsort(sorted, pixels, sizeof(f64), compare_f64);
+
+	f64 top = sorted[(pixels * 99) / 100];
+
+	for (u64 i = 0; i < pixels; i++)
+	{
+		v3 c = viridis((top > 0.0) ? ffmin((f32)(pixel_seconds[i] / top), 0.999f) : 0.0f);
+
+		map[i * 4 + 0] = (u8)(255.99f * c.z);
+		map[i * 4 + 1] = (u8)(255.99f * c.y);
+		map[i * 4 + 2] = (u8)(255.99f * c.x);
+		map[i * 4 + 3] = 0;
+	}
+
+	char filename[sizeof(path) + 32];
+
+	snprintf(filename, sizeof(filename), "%s%s%i%s", path, "cost_", SEED, ".bmp");
+
+	write_bitmap(filename, map);
+
+	free(sorted);
+	free_aligned(map);
+}
+
+// The denoiser's albedo, normal and depth buffers as float PFM images next to the render.
+void write_feature_maps(void)
+{
+	const char*	names[3] = { "albedo_", "normal_", "depth_" };
+	u64		pixels = (u64)settings.output_width * settings.output_height;
+
+	for (u32 map = 0; map < 3; map++)
+	{
+		char	filename[sizeof(path) + 32];
+		u32	channels = (map == 2) ? 1 : 3;
+
+		snprintf(filename, sizeof(filename), "%s%s%i%s", path, names[map], SEED, ".pfm");
+
+		FILE* file = fopen(filename, "wb");
+
+		if (!file) continue;
+
+		fprintf(file, "%s\n%u %u\n-1.0\n", (channels == 3) ? "PF" : "Pf", settings.output_width, settings.output_height);
+
+		for (u64 i = 0; i < pixels; i++)
+		{
+			FeaturePixel* f = denoiser.features + i;
+
+			if (map == 0) fwrite(&f->albedo, sizeof(v3), 1, file);
+			else if (map == 1) fwrite(&f->normal, sizeof(v3), 1, file);
+			else fwrite(&f->depth, sizeof(f32), 1, file);
+		}
+
+		fclose(file);
+	}
+}
+
+void setup_output_directory(void)
+{
+	make_directory(settings.output_path);
+
+	snprintf(path, sizeof(path), "%s%i%s", settings.output_path, SEED, PATH_SEPARATOR);
+
+	make_directory(path);
+}
+
+// Length and distance code tables from RFC 1951.
+u32 deflate_length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+u32 deflate_length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+u32 deflate_distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+u32 deflate_distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+u32 crc_table[256];
+
+u32 reverse_bits(u32 code, u32 length)
+{
+	u32 reversed = 0;
+
+	for (u32 i = 0; i < length; i++) reversed |= ((code >> i) & 1) << (length - 1 - i);
+
+	return reversed;
+}
+
+void deflate_bits(Deflate* d, u32 value, u32 count)
+{
+	d->bits |= (u64)value << d->bit_count;
+	d->bit_count += count;
+
+	while (d->bit_count >= 8)
+	{
+		if (d->out_size == d->out_capacity)
+		{
+			d->out_capacity = d->out_capacity ? d->out_capacity * 2 : 65536;
+			d->out = realloc(d->out, d->out_capacity);
+		}
+
+		d->out[d->out_size++] = (unsigned char)d->bits;
+		d->bits >>= 8;
+		d->bit_count -= 8;
+	}
+}
+
+// Huffman codes go into the stream most significant bit first, everything else least first.
+void deflate_symbol(Deflate* d, u32 symbol)
+{
+	if (symbol < 144)	deflate_bits(d, reverse_bits(0x30 + symbol, 8), 8);
+	else if (symbol < 256)	deflate_bits(d, reverse_bits(0x190 + symbol - 144, 9), 9);
+	else if (symbol < 280)	deflate_bits(d, reverse_bits(symbol - 256, 7), 7);
+	else			deflate_bits(d, reverse_bits(0xC0 + symbol - 280, 8), 8);
+}
+
+void deflate_match(Deflate* d, u32 length, u32 distance)
+{
+	u32 code = 28;
+
+	while (deflate_length_base[code] > length) code--;
+
+	deflate_symbol(d, 257 + code);
+	deflate_bits(d, length - deflate_length_base[code], deflate_length_extra[code]);
+
+	code = 29;
+
+	while (deflate_distance_base[code] > distance) code--;
+
+	deflate_bits(d, reverse_bits(code, 5), 5);
+	deflate_bits(d, distance - deflate_distance_base[code], deflate_distance_extra[code]);
+}
+
+u32 deflate_hash(const unsigned char* p)
+{
+	return (((u32)p[0] << 16 | (u32)p[1] << 8 | p[2]) * 2654435761u) >> 16;
+}
+
+void deflate_begin(Deflate* d)
+{
+	memset(d, 0, sizeof(Deflate));
+
+	d->head = calloc(DEFLATE_HASH_SIZE, sizeof(u64));
+	d->chain = calloc(DEFLATE_WINDOW, sizeof(u64));
+	d->adler_a = 1;
+
+	deflate_bits(d, 0x78, 8);
+	deflate_bits(d, 0x01, 8);
+}
+
+// Compresses size bytes as one fixed-Huffman block. Matches may reach back into earlier blocks,
+// so the last DEFLATE_WINDOW bytes are kept at the front of the buffer for the next call.
+void deflate_block(Deflate* d, const unsigned char* input, u64 size, u32 final)
+{
+	u64 end = d->history + size;
+
+	if (end > d->capacity)
+	{
+		d->capacity = end;
+		d->data = realloc(d->data, d->capacity);
+	}
+
+	if (size) memcpy(d->data + d->history, input, size);
+
+	for (u64 i = 0; i < size;)
+	{
+		u64 run = (size - i < 5552) ? size - i : 5552;
+
+		for (u64 j = 0; j < run; j++, i++)
+		{
+			d->adler_a += input[i];
+			d->adler_b += d->adler_a;
+		}
+
+		d->adler_a %= 65521;
+		d->adler_b %= 65521;
+	}
+
+	deflate_bits(d, final, 1);
+	deflate_bits(d, 1, 2);
+
+	for (u64 i = d->history; i < end;)
+	{
+		u32 best_length = 0;
+		u32 best_distance = 0;
+		u64 absolute = d->position + i;
+
+		if (i + 3 <= end)
+		{
+			u32 limit = (end - i < DEFLATE_MAX_MATCH) ? (u32)(end - i) : DEFLATE_MAX_MATCH;
+			u64 candidate = d->head[deflate_hash(d->data + i)];
+
+			for (u32 depth = 0; candidate && depth < DEFLATE_CHAIN; depth++)
+			{
+				u64			distance = absolute - (candidate - 1);
+				const unsigned char*	a = d->data + i;
+				const unsigned char*	b = a - distance;
+				u32			length = 0;
+
+				if (distance > DEFLATE_WINDOW) break;
+
+				while (length < limit && a[length] == b[length]) length++;
+
+				if (length > best_length)
+				{
+					best_length = length;
+					best_distance = (u32)distance;
+
+					if (length == limit) break;
+				}
+
+				candidate = d->chain[(candidate - 1) % DEFLATE_WINDOW];
+			}
+		}
+
+		if (best_length >= 3) deflate_match(d, best_length, best_distance);
+		else deflate_symbol(d, d->data[i]);
+
+		for (u32 k = 0; k < ((best_length >= 3) ? best_length : 1); k++, i++)
+		{
+			if (i + 3 > end) continue;
+
+			u32 h = deflate_hash(d->data + i);
+
+			d->chain[(d->position + i) % DEFLATE_WINDOW] = d->head[h];
+			d->head[h] = d->position + i + 1;
+		}
+	}
+
+	deflate_symbol(d, 256);
+
+	u64 keep = (end < DEFLATE_WINDOW) ? end : DEFLATE_WINDOW;
+
+	memmove(d->data, d->data + end - keep, keep);
+
+	d->position += end - keep;
+	d->history = keep;
+}
+
+// Ends the stream with an empty final block and the Adler-32 of everything compressed.
+void deflate_finish(Deflate* d)
+{
+	u32 adler = (d->adler_b << 16) | d->adler_a;
+
+	deflate_block(d, NULL, 0, 1);
+
+	if (d->bit_count) deflate_bits(d, 0, 8 - d->bit_count);
+
+	for (s32 shift = 24; shift >= 0; shift -= 8) deflate_bits(d, (adler >> shift) & 0xFF, 8);
+}
+
+void deflate_free(Deflate* d)
+{
+	free(d->data);
+	free(d->head);
+	free(d->chain);
+	free(d->out);
+}
+
+void put_u32_be(unsigned char* p, u32 value)
+{
+	p[0] = (unsigned char)(value >> 24);
+	p[1] = (unsigned char)(value >> 16);
+	p[2] = (unsigned char)(value >> 8);
+	p[3] = (unsigned char)value;
+}
+
+u32 png_crc(u32 crc, const unsigned char* data, u64 size)
+{
+	if (!crc_table[1])
+	{
+		for (u32 n = 0; n < 256; n++)
+		{
+			u32 c = n;
+
+			for (u32 k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+
+			crc_table[n] = c;
+		}
+	}
+
+	for (u64 i = 0; i < size; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+void png_chunk(FILE* file, const char* type, const unsigned char* data, u32 size)
+{
+	unsigned char header[8];
+	unsigned char footer[4];
+
+	put_u32_be(header, size);
+	memcpy(header + 4, type, 4);
+	put_u32_be(footer, png_crc(png_crc(0xFFFFFFFF, header + 4, 4), data, size) ^ 0xFFFFFFFF);
+
+	fwrite(header, 8, 1, file);
+	if (size) fwrite(data, size, 1, file);
+	fwrite(footer, 4, 1, file);
+}
+
+s32 png_paeth(s32 a, s32 b, s32 c)
+{
+	s32 p = a + b - c;
+	s32 pa = abs(p - a);
+	s32 pb = abs(p - b);
+	s32 pc = abs(p - c);
+
+	return (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b : c);
+}
+
+// Tries all five PNG filters on the current line against the one above and keeps whichever has
+// the smallest sum of absolute (signed) residuals, the usual heuristic for what deflates best.
+unsigned char* png_filter(ImageWriter* w, u32 width)
+{
+	u32		stride = 1 + 3 * width;
+	unsigned char*	best = w->filtered;
+	u64		best_sum = ~0ull;
+
+	for (u32 filter = 0; filter < 5; filter++)
+	{
+		unsigned char*	out = w->filtered + filter * stride;
+		u64		sum = 0;
+
+		out[0] = (unsigned char)filter;
+
+		for (u32 i = 0; i < 3 * width; i++)
+		{
+			s32 x = w->line[i];
+			s32 a = (i >= 3) ? w->line[i - 3] : 0;
+			s32 b = w->previous[i];
+			s32 c = (i >= 3) ? w->previous[i - 3] : 0;
+			s32 p = 0;
+
+			switch (filter)
+			{
+			case 1:	p = a;				break;
+			case 2:	p = b;				break;
+			case 3:	p = (a + b) / 2;		break;
+			case 4:	p = png_paeth(a, b, c);		break;
+			}
+
+			out[i + 1] = (unsigned char)(x - p);
+			sum += abs((s8)out[i + 1]);
+		}
+
+		if (sum < best_sum)
+		{
+			best = out;
+			best_sum = sum;
+		}
+	}
+
+	return best;
+}
+
+void exr_attribute(FILE* file, const char* name, const char* type, u32 size, const void* value)
+{
+	fwrite(name, strlen(name) + 1, 1, file);
+	fwrite(type, strlen(type) + 1, 1, file);
+	fwrite(&size, 4, 1, file);
+	fwrite(value, size, 1, file);
+}
+
+// A single-part scanline OpenEXR file with float B, G and R channels and no compression. The
+// renderer's rows run bottom up, so the lines are stored in DECREASING_Y order and every offset in
+// the table is known before the first pixel is written.
+void exr_header(FILE* file, u32 width, u32 height)
+{
+	unsigned char	magic[8] = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+	unsigned char	channels[55];
+	s32		window[4] = { 0, 0, (s32)width - 1, (s32)height - 1 };
+	f32		one = 1.0f;
+	f32		centre[2] = { 0.0f, 0.0f };
+	unsigned char	none = 0;
+	unsigned char	decreasing = 1;
+
+	memset(channels, 0, sizeof(channels));
+
+	for (u32 c = 0; c < 3; c++)
+	{
+		s32 type = 2;
+		s32 sampling = 1;
+
+		channels[c * 18] = "BGR"[c];
+		memcpy(channels + c * 18 + 2, &type, 4);
+		memcpy(channels + c * 18 + 10, &sampling, 4);
+		memcpy(channels + c * 18 + 14, &sampling, 4);
+	}
+
+	fwrite(magic, sizeof(magic), 1, file);
+
+	exr_attribute(file, "channels", "chlist", sizeof(channels), channels);
+	exr_attribute(file, "compression", "compression", 1, &none);
+	exr_attribute(file, "dataWindow", "box2i", 16, window);
+	exr_attribute(file, "displayWindow", "box2i", 16, window);
+	exr_attribute(file, "lineOrder", "lineOrder", 1, &decreasing);
+	exr_attribute(file, "pixelAspectRatio", "float", 4, &one);
+	exr_attribute(file, "screenWindowCenter", "v2f", 8, centre);
+	exr_attribute(file, "screenWindowWidth", "float", 4, &one);
+
+	fwrite(&none, 1, 1, file);
+
+	u64 block_size = 8 + 12 * (u64)width;
+	u64 data_start = (u64)ftell(file) + 8 * (u64)height;
+
+	for (u32 y = 0; y < height; y++)
+	{
+		u64 offset = data_start + (height - 1 - y) * block_size;
+
+		fwrite(&offset, 8, 1, file);
+	}
+}
+
+u32 image_open(ImageWriter* w, const char* filename, ImageFormat format)
+{
+	u32 width = settings.output_width;
+	u32 height = settings.output_height;
+
+	memset(w, 0, sizeof(ImageWriter));
+
+	w->file = fopen(filename, "wb");
+	w->format = format;
+
+	if (!w->file) return 0;
+
+	switch (format)
+	{
+	case FORMAT_PNG:
+	{
+		unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		unsigned char ihdr[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 8, 2, 0, 0, 0 };
+
+		put_u32_be(ihdr, width);
+		put_u32_be(ihdr + 4, height);
+
+		fwrite(signature, sizeof(signature), 1, w->file);
+		png_chunk(w->file, "IHDR", ihdr, sizeof(ihdr));
+
+		w->line = malloc(3 * width);
+		w->previous = calloc(3 * width, 1);
+		w->filtered = malloc(5 * (1 + 3 * width));
+
+		deflate_begin(&w->deflate);
+	}
+	break;
+	case FORMAT_PFM:
+		fprintf(w->file, "PF\n%u %u\n-1.0\n", width, height);
+		w->floats = malloc(3 * width * sizeof(f32));
+		break;
+	case FORMAT_EXR:
+		exr_header(w->file, width, height);
+		w->floats = malloc(3 * width * sizeof(f32));
+		break;
+	case FORMAT_BMP:
+	default:
+		fwrite(&file_header, sizeof(BitmapFileHeader), 1, w->file);
+		fwrite(&info_header, sizeof(BitmapInfoHeader), 1, w->file);
+		break;
+	}
+
+	return 1;
+}
+
+// Writes rows y0 to y1 of the render. BMP rows come straight from the bitmap and PNG lines are
+// filtered and deflated as they go, while the float formats average the accumulation records.
+void image_write_rows(ImageWriter* w, u32 y0, u32 y1)
+{
+	u32 width = settings.output_width;
+
+	switch (w->format)
+	{
+	case FORMAT_PNG:
+	{
+		for (u32 y = y1; y-- > y0;)
+		{
+			unsigned char* pixel = (unsigned char*)bitmap_image_data + (u64)y * width * 4;
+
+			for (u32 x = 0; x < width; x++)
+			{
+				w->line[x * 3 + 0] = pixel[x * 4 + 2];
+				w->line[x * 3 + 1] = pixel[x * 4 + 1];
+				w->line[x * 3 + 2] = pixel[x * 4 + 0];
+			}
+
+			deflate_block(&w->deflate, png_filter(w, width), 1 + 3 * width, 0);
+
+			unsigned char* swap = w->previous;
+			w->previous = w->line;
+			w->line = swap;
+		}
+
+		png_chunk(w->file, "IDAT", w->deflate.out, (u32)w->deflate.out_size);
+		w->deflate.out_size = 0;
+	}
+	break;
+	case FORMAT_PFM:
+	case FORMAT_EXR:
+	{
+		for (u32 y = y0; y < y1; y++)
+		{
+			AccumPixel* row = accumulation + (u64)y * width;
+
+			for (u32 x = 0; x < width; x++)
+			{
+				f32 scale = row[x].samples ? 1.0f / row[x].samples : 0.0f;
+				f32 rgb[3] = { row[x].r * scale, row[x].g * scale, row[x].b * scale };
+
+				for (u32 c = 0; c < 3; c++)
+				{
+					if (w->format == FORMAT_PFM) w->floats[x * 3 + c] = rgb[c];
+					else w->floats[(2 - c) * width + x] = rgb[c];
+				}
+			}
+
+			if (w->format == FORMAT_EXR)
+			{
+				s32 line[2] = { (s32)(settings.output_height - 1 - y), (s32)(12 * width) };
+
+				fwrite(line, sizeof(line), 1, w->file);
+			}
+
+			fwrite(w->floats, 3 * width * sizeof(f32), 1, w->file);
+		}
+	}
+	break;
+	case FORMAT_BMP:
+	default:
+		fwrite(bitmap_image_data + (u64)y0 * width * 4, (u64)(y1 - y0) * width * 4, 1, w->file);
+		break;
+	}
+}
+
+u32 image_close(ImageWriter* w)
+{
+	if (w->format == FORMAT_PNG)
+	{
+		deflate_finish(&w->deflate);
+
+		png_chunk(w->file, "IDAT", w->deflate.out, (u32)w->deflate.out_size);
+		png_chunk(w->file, "IEND", NULL, 0);
+
+		deflate_free(&w->deflate);
+	}
+
+	u32 ok = !ferror(w->file);
+
+	ok &= !fclose(w->file);
+
+	free(w->line);
+	free(w->previous);
+	free(w->filtered);
+	free(w->floats);
+
+	return ok;
+}
+
+u32 write_image(const char* filename)
+{
+	ImageWriter writer;
+
+	if (!image_open(&writer, filename, settings.image_format)) return 0;
+
+	image_write_rows(&writer, 0, settings.output_height);
+
+	return image_close(&writer);
+}
+
+// Bands complete in whatever order the workers finish them, but a file has to be written in order,
+// so each wake-up writes as many bands as are ready from where the file left off.
+thread_result THREAD_CALL ImageStreamWriter(void* data)
+{
+	u32 tile_size = settings.tile_size;
+	u32 top_down = (image_stream.writer.format == FORMAT_PNG);
+
+	for (u32 written = 0; written < image_stream.band_count;)
+	{
+		semaphore_wait(&image_stream.ready);
+
+		while (written < image_stream.band_count)
+		{
+			u32 band = top_down ? image_stream.band_count - 1 - written : written;
+			u32 y1 = (band + 1) * tile_size;
+
+			if (!image_stream.band_done[band]) break;
+
+			image_write_rows(&image_stream.writer, band * tile_size, (y1 < settings.output_height) ? y1 : settings.output_height);
+			written++;
+		}
+	}
+
+	image_stream.ok = image_close(&image_stream.writer);
+
+	return 0;
+}
+
+// Opens the image file and starts the writer thread ahead of the final pass, so finished bands
+// are on disk before the last tile is.
+u32 image_stream_begin(void)
+{
+	u32 tiles_x = (settings.output_width + settings.tile_size - 1) / settings.tile_size;
+
+	setup_output_directory();
+
+	if (settings.image_path) snprintf(image_stream.filename, sizeof(image_stream.filename), "%s", settings.image_path);
+	else snprintf(image_stream.filename, sizeof(image_stream.filename), "%srender_%i.%s", path, SEED, format_names[settings.image_format]);
+
+	if (!image_open(&image_stream.writer, image_stream.filename, settings.image_format))
+	{
+		printf("Could not write image %s\n", image_stream.filename);
+		return 0;
+	}
+
+	image_stream.band_count = (settings.output_height + settings.tile_size - 1) / settings.tile_size;
+	image_stream.tiles_left = malloc(image_stream.band_count * sizeof(u32));
+	image_stream.band_done = calloc(image_stream.band_count, sizeof(u32));
+
+	for (u32 band = 0; band < image_stream.band_count; band++) image_stream.tiles_left[band] = tiles_x;
+
+	semaphore_init(&image_stream.ready);
+
+	image_stream.ok = 0;
+	image_stream.active = 1;
+	image_stream.thread = thread_create(ImageStreamWriter, NULL);
+
+	return 1;
+}
+
+void image_stream_tile(Tile* tile)
+{
+	u32 band = tile->y0 / settings.tile_size;
+
+	if (!image_stream.active) return;
+
+	if (atomic_dec_u32(image_stream.tiles_left + band) == 0)
+	{
+		image_stream.band_done[band] = 1;
+		semaphore_post(&image_stream.ready, 1);
+	}
+}
+
+// Waits for the writer to finish the file. A render that never streamed (a windowed one, say) is
+// written here in one go through the same path. Returns 0 if the file could not be written.
+u32 image_stream_finish(void)
+{
+	f64 start = get_time();
+
+	if (!image_stream.active)
+	{
+		if (!image_stream_begin()) return 0;
+
+		for (u32 band = 0; band < image_stream.band_count; band++)
+		{
+			image_stream.band_done[band] = 1;
+			semaphore_post(&image_stream.ready, 1);
+		}
+	}
+
+	thread_join(image_stream.thread);
+	semaphore_destroy(&image_stream.ready);
+
+	free((void*)image_stream.tiles_left);
+	free((void*)image_stream.band_done);
+
+	image_stream.active = 0;
+	image_stream.wait = get_time() - start;
+
+	return image_stream.ok;
+}
+
+// Animation frames go next to the log as frame_0000.bmp, frame_0001.bmp and so on, or with the
+// extension of the chosen image format.
+void save_frame(u32 frame)
+{
+	char filepath_and_name[sizeof(path) + 32];
+
+	setup_output_directory();
+
+	snprintf(filepath_and_name, sizeof(filepath_and_name), "%sframe_%04u.%s", path, frame, format_names[settings.image_format]);
+
+	write_image(filepath_and_name);
+}
+
+// Without a window the preview goes to disk instead: every preview stage and refinement pass is
+// written as preview_<seed>_00.bmp, preview_<seed>_01.bmp and so on, with a log line giving the
+// time since the render started and how many tiles changed.
+void save_preview(u32 index, f64 elapsed)
+{
+	char filepath_and_name[sizeof(path) + 32];
+
+	setup_output_directory();
+
+	snprintf(filepath_and_name, sizeof(filepath_and_name), "%spreview_%i_%02u.bmp", path, SEED, index);
+
+	if (!write_bitmap(filepath_and_name, bitmap_image_data)) printf("Could not write preview %s\n", filepath_and_name);
+
+	if (preview_block) printf("Preview 1/%u resolution after %f s, %u tiles\n", preview_block, elapsed, scheduler.tiles_dirty);
+	else printf("Preview %u samples after %f s, %u tiles\n", (pass_target < settings.num_aa_samples) ? pass_target : settings.num_aa_samples, elapsed, scheduler.tiles_dirty);
+
+	scheduler.tiles_dirty = 0;
+}
+
+void save_file(void)
+{
+	setup_output_directory();
+
+	if (!settings.frames && !image_stream_finish())
+	{
+		printf("Could not write image %s\n", image_stream.filename);
+		return;
+	}
+
+	u64 total_samples = (u64)settings.num_aa_samples * settings.output_width * settings.output_height;
+
+	if (settings.noise_threshold > 0.0f || settings.checkpoint_path)
+	{
+		total_samples = write_sample_map();
+	}
+
+	if (pixel_seconds) write_cost_map();
+
+	if (denoiser.features) write_feature_maps();
+
+	char log_filename_and_path[sizeof(path) + 32];
+
+	snprintf(log_filename_and_path, sizeof(log_filename_and_path), "%s%s%i%s", path, "data_", SEED, ".txt");
+
+	FILE* log;
+
+	log = fopen(log_filename_and_path, "w");
+
+	if (!log) return;
+
+	fprintf(log, "SEED			%i\n\n", SEED);
+	fprintf(log, "NUM_COLOURS		%i\n", NUM_COLOURS);
+	fprintf(log, "NUM_SPHERES:		%u\n", settings.num_spheres);
+	fprintf(log, "NUM_AA_SAMPLES: 		%u\n", settings.num_aa_samples);
+	fprintf(log, "NOISE_THRESHOLD:	%f\n", settings.noise_threshold);
+	fprintf(log, "AVERAGE_SAMPLES:	%f\n", (f64)total_samples / ((f64)settings.output_width * settings.output_height));
+	fprintf(log, "OUTPUT_WIDTH:		%u\n", settings.output_width);
+	fprintf(log, "OUTPUT_HEIGHT:		%u\n", settings.output_height);
+	fprintf(log, "ASPECT:			%f\n", (f32)settings.output_width / (f32)settings.output_height);
+	fprintf(log, "V_FOV:			%f\n", settings.v_fov);
+	fprintf(log, "SCENE:			%s\n", settings.scene_path ? settings.scene_path : "procedural");
+	fprintf(log, "RENDER_TIME:		%f s\n", render_time);
+	fprintf(log, "IMAGE:			%s\n", settings.frames ? "frames" : image_stream.filename);
+	fprintf(log, "IMAGE_WAIT:		%f s\n", image_stream.wait);
+	fprintf(log, "TONE_MAP:		%s\n", tone_map_names[settings.tone_map]);
+	fprintf(log, "SAMPLER:		%s\n", sampler_names[settings.sampler]);
+	fprintf(log, "EXPOSURE:		%f\n", settings.exposure);
+	fprintf(log, "DENOISE:		%u\n", settings.denoise);
+	fprintf(log, "PREVIEW:		%u\n", settings.preview);
+	fprintf(log, "RAYS:			%llu\n", (unsigned long long)scheduler.stats.rays);
+	fprintf(log, "MRAYS_PER_SECOND:	%f\n", (render_time > 0.0) ? scheduler.stats.rays / render_time / 1000000.0 : 0.0);
+	fprintf(log, "BOX_TESTS:		%llu\n", (unsigned long long)scheduler.stats.box_tests);
+	fprintf(log, "SPHERE_TESTS:		%llu\n", (unsigned long long)scheduler.stats.sphere_tests);
+	fprintf(log, "TRIANGLE_TESTS:		%llu\n", (unsigned long long)scheduler.stats.triangle_tests);
+	fprintf(log, "PATH_ENDS:		");
+	for (u32 i = 0; i <= STATS_ESCAPED; i++) fprintf(log, "%s %llu%s", (i < STATS_ESCAPED) ? material_names[i] : "sky", (unsigned long long)scheduler.stats.path_ends[i], (i < STATS_ESCAPED) ? ", " : "\n");
+	fprintf(log, "PATH_LENGTHS:		");
+	for (u32 i = 0; i < STATS_PATH_LENGTHS; i++) fprintf(log, "%llu%s", (unsigned long long)scheduler.stats.path_lengths[i], (i < STATS_PATH_LENGTHS - 1) ? " " : "\n");
+	fprintf(log, "IMAGE_HASH:		%016llx\n", (unsigned long long)image_hash());
+	fprintf(log, "MAX_BOUNCES:		%u\n", settings.max_bounces);
+	fprintf(log, "ROULETTE_DEPTH:		%u\n", settings.roulette_depth);
+	fprintf(log, "THREADS:		%u\n", settings.thread_count);
+	fprintf(log, "WAVEFRONT:		%u\n", settings.wavefront);
+	fprintf(log, "NEE:			%u\n", settings.nee);
+	fprintf(log, "FRAMES:			%u\n", settings.frames);
+	fprintf(log, "TILES:			%u\n", scheduler.tile_count);
+	fprintf(log, "TILE_P50:		%f ms\n", scheduler.tile_p50 * 1000.0);
+	fprintf(log, "TILE_P99:		%f ms\n", scheduler.tile_p99 * 1000.0);
+	fprintf(log, "TILE_MAX:		%f ms\n", scheduler.tile_max * 1000.0);
+	fprintf(log, "TAIL_LATENCY:		%f s\n", scheduler.tail_latency);
+	fprintf(log, "CAM_POS_X:		%f\n", settings.cam_position.x);
+	fprintf(log, "CAM_POS_Y:		%f\n", settings.cam_position.y);
+	fprintf(log, "CAM_POS_Z:		%f\n", settings.cam_position.z);
+	fprintf(log, "CAM_TARGET_X:		%f\n", settings.cam_target.x);
+	fprintf(log, "CAM_TARGET_Y:		%f\n", settings.cam_target.y);
+	fprintf(log, "CAM_TARGET_Z:		%f\n", settings.cam_target.z);
+	fprintf(log, "CAM_APERTURE:		%f\n", settings.cam_aperture);
+
+	fclose(log);
+}
+
+v3 random_unit_sphere(void)
+{
+	while (1)
+	{
+		v3 pos = vec3(nrand(), nrand(), nrand());
+		v3 point = v3_mulf(pos, 2.0f);
+		v3 unit = vec3(1.0f, 1.0f, 1.0f);
+		v3 final = v3_sub(point, unit);
+
+		if (v3_squared_length(final) < 1.0f)
+		{
+			return final;
+		}
+	}
+}
+
+// Rays that start inside a sphere never hit it. Nothing in the scene refracts, so the only rays
+// this rejects are bounces re-hitting the surface they have just left.
+u32 intersection(Ray* r, const Sphere* s, Hit* h, float t_min, float t_max)
+{
+	v3	i = v3_sub(r->origin, s->position);
+	f32	a = v3_dot(r->direction, r->direction);
+	f32	b = v3_dot(i, r->direction);
+	f32	c = v3_dot(i, i) - s->radius * s->radius;
+	f32	d = b * b - a * c;
+
+	if (c > 0.0f && d >= 0.0f)
+	{
+		f32 root = sqrtf(d);
+		f32 temp = (-b - root) / a;
+
+		if (!(temp < t_max && temp > t_min)) temp = (-b + root) / a;
 
 		if (temp < t_max && temp > t_min)
 		{
-			h->t = temp;
-			h->point = point_at_parameter(*r, temp);
+			h->t = temp;
+			h->point = point_at_parameter(*r, temp);
+
+			v3 dir = v3_sub(h->point, s->position);
+			h->normal = v3_div(dir, s->radius);
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void update_sphere_soa(u32* order);
+
+void setup_sphere_soa(u32* order)
+{
+	u32 padded = ((settings.num_spheres + 7) & ~7) + 8;
+
+	sphere_soa.x = alloc_aligned(padded * sizeof(f32), 64);
+	sphere_soa.y = alloc_aligned(padded * sizeof(f32), 64);
+	sphere_soa.z = alloc_aligned(padded * sizeof(f32), 64);
+	sphere_soa.radius2 = alloc_aligned(padded * sizeof(f32), 64);
+	sphere_soa.ids = alloc_aligned(padded * sizeof(u32), 64);
+	sphere_soa.count = settings.num_spheres;
+
+	update_sphere_soa(order);
+}
+
+void update_sphere_soa(u32* order)
+{
+	u32 padded = ((settings.num_spheres + 7) & ~7) + 8;
+
+	for (u32 i = 0; i < padded; i++)
+	{
+		Sphere* sphere = spheres + ((i < settings.num_spheres) ? order[i] : 0);
+
+		sphere_soa.x[i] = sphere->position.x;
+		sphere_soa.y[i] = sphere->position.y;
+		sphere_soa.z[i] = sphere->position.z;
+		sphere_soa.radius2[i] = sphere->radius * sphere->radius;
+		sphere_soa.ids[i] = (i < settings.num_spheres) ? order[i] : 0;
+	}
+}
+
+// Tests one ray against spheres [first, first + count) of the SoA arrays, four or eight at a time,
+// with the same acceptance rules as intersection(). Returns the slot of the closest hit, or -1,
+// and lowers *t_max to its distance. Reads up to eight slots past the range, which the padding
+// in setup_sphere_soa covers; those lanes are masked out.
+s32 intersect_spheres(const SphereSoA* soa, u32 first, u32 count, Ray* r, f32 t_min, f32* t_max)
+{
+	v3	o = r->origin;
+	v3	d = r->direction;
+	f32	a = v3_dot(d, d);
+	s32	best = -1;
+	f32	closest = *t_max;
+	u32	end = first + count;
+	u32	i = first;
+
+#ifdef SIMD_AVX2
+	if (count > 4)
+	{
+		__m256	ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+		__m256	dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+		__m256	va = _mm256_set1_ps(a);
+		__m256	vt_min = _mm256_set1_ps(t_min);
+		__m256	zero = _mm256_setzero_ps();
+		__m256	best_t = _mm256_set1_ps(closest);
+		__m256i	best_slot = _mm256_set1_epi32(-1);
+		__m256i	slot = _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		__m256i	vend = _mm256_set1_epi32(end);
+
+		for (; i < end; i += 8)
+		{
+			__m256 ix = _mm256_sub_ps(ox, _mm256_loadu_ps(soa->x + i));
+			__m256 iy = _mm256_sub_ps(oy, _mm256_loadu_ps(soa->y + i));
+			__m256 iz = _mm256_sub_ps(oz, _mm256_loadu_ps(soa->z + i));
+			__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ix, dx), _mm256_mul_ps(iy, dy)), _mm256_mul_ps(iz, dz));
+			__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ix, ix), _mm256_mul_ps(iy, iy)), _mm256_mul_ps(iz, iz)), _mm256_loadu_ps(soa->radius2 + i));
+			__m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(va, c));
+			__m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+			__m256 neg_b = _mm256_sub_ps(zero, b);
+			__m256 t0 = _mm256_div_ps(_mm256_sub_ps(neg_b, root), va);
+			__m256 t1 = _mm256_div_ps(_mm256_add_ps(neg_b, root), va);
+			__m256 t0_ok = _mm256_and_ps(_mm256_cmp_ps(t0, vt_min, _CMP_GT_OQ), _mm256_cmp_ps(t0, best_t, _CMP_LT_OQ));
+			__m256 t1_ok = _mm256_and_ps(_mm256_cmp_ps(t1, vt_min, _CMP_GT_OQ), _mm256_cmp_ps(t1, best_t, _CMP_LT_OQ));
+			__m256 in_range = _mm256_castsi256_ps(_mm256_cmpgt_epi32(vend, slot));
+			__m256 valid = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(c, zero, _CMP_GT_OQ), _mm256_cmp_ps(disc, zero, _CMP_GE_OQ)), in_range);
+			__m256 hit = _mm256_and_ps(valid, _mm256_or_ps(t0_ok, t1_ok));
+			__m256 t = _mm256_blendv_ps(t1, t0, t0_ok);
+
+			best_t = _mm256_blendv_ps(best_t, t, hit);
+			best_slot = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_slot), _mm256_castsi256_ps(slot), hit));
+			slot = _mm256_add_epi32(slot, _mm256_set1_epi32(8));
+		}
+
+		f32 lane_t[8];
+		s32 lane_slot[8];
+
+		_mm256_storeu_ps(lane_t, best_t);
+		_mm256_storeu_si256((__m256i*)lane_slot, best_slot);
+
+		for (u32 lane = 0; lane < 8; lane++)
+		{
+			if (lane_slot[lane] >= 0 && lane_t[lane] < closest)
+			{
+				closest = lane_t[lane];
+				best = lane_slot[lane];
+			}
+		}
+	}
+#endif // SIMD_AVX2
+
+#ifdef SIMD_SSE
+	if (i < end)
+	{
+		__m128	ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+		__m128	dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+		__m128	va = _mm_set1_ps(a);
+		__m128	vt_min = _mm_set1_ps(t_min);
+		__m128	zero = _mm_setzero_ps();
+		__m128	best_t = _mm_set1_ps(closest);
+		__m128i	best_slot = _mm_set1_epi32(-1);
+		__m128i	slot = _mm_add_epi32(_mm_set1_epi32(i), _mm_setr_epi32(0, 1, 2, 3));
+		__m128i	vend = _mm_set1_epi32(end);
+
+		for (; i < end; i += 4)
+		{
+			__m128 ix = _mm_sub_ps(ox, _mm_loadu_ps(soa->x + i));
+			__m128 iy = _mm_sub_ps(oy, _mm_loadu_ps(soa->y + i));
+			__m128 iz = _mm_sub_ps(oz, _mm_loadu_ps(soa->z + i));
+			__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ix, dx), _mm_mul_ps(iy, dy)), _mm_mul_ps(iz, dz));
+			__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ix, ix), _mm_mul_ps(iy, iy)), _mm_mul_ps(iz, iz)), _mm_loadu_ps(soa->radius2 + i));
+			__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+			__m128 root = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+			__m128 neg_b = _mm_sub_ps(zero, b);
+			__m128 t0 = _mm_div_ps(_mm_sub_ps(neg_b, root), va);
+			__m128 t1 = _mm_div_ps(_mm_add_ps(neg_b, root), va);
+			__m128 t0_ok = _mm_and_ps(_mm_cmpgt_ps(t0, vt_min), _mm_cmplt_ps(t0, best_t));
+			__m128 t1_ok = _mm_and_ps(_mm_cmpgt_ps(t1, vt_min), _mm_cmplt_ps(t1, best_t));
+			__m128 in_range = _mm_castsi128_ps(_mm_cmplt_epi32(slot, vend));
+			__m128 valid = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(c, zero), _mm_cmpge_ps(disc, zero)), in_range);
+			__m128 hit = _mm_and_ps(valid, _mm_or_ps(t0_ok, t1_ok));
+			__m128 t = _mm_or_ps(_mm_and_ps(t0_ok, t0), _mm_andnot_ps(t0_ok, t1));
+
+			best_t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, best_t));
+			best_slot = _mm_or_si128(_mm_and_si128(_mm_castps_si128(hit), slot), _mm_andnot_si128(_mm_castps_si128(hit), best_slot));
+			slot = _mm_add_epi32(slot, _mm_set1_epi32(4));
+		}
+
+		f32 lane_t[4];
+		s32 lane_slot[4];
+
+		_mm_storeu_ps(lane_t, best_t);
+		_mm_storeu_si128((__m128i*)lane_slot, best_slot);
+
+		for (u32 lane = 0; lane < 4; lane++)
+		{
+			if (lane_slot[lane] >= 0 && lane_t[lane] < closest)
+			{
+				closest = lane_t[lane];
+				best = lane_slot[lane];
+			}
+		}
+	}
+#else
+	for (; i < end; i++)
+	{
+		v3	ic = vec3(o.x - soa->x[i], o.y - soa->y[i], o.z - soa->z[i]);
+		f32	b = v3_dot(ic, d);
+		f32	c = v3_dot(ic, ic) - soa->radius2[i];
+		f32	disc = b * b - a * c;
+
+		if (c > 0.0f && disc >= 0.0f)
+		{
+			f32 root = sqrtf(disc);
+			f32 t = (-b - root) / a;
+
+			if (!(t < closest && t > t_min)) t = (-b + root) / a;
+
+			if (t < closest && t > t_min)
+			{
+				closest = t;
+				best = i;
+			}
+		}
+	}
+#endif // SIMD_SSE
+
+	*t_max = closest;
+
+	return best;
+}
+
+void set_sphere_hit(Ray* r, Hit* h, f32 t, u32 id)
+{
+	Sphere* sphere = spheres + id;
+
+	h->t = t;
+	h->point = point_at_parameter(*r, t);
+	h->normal = v3_div(v3_sub(h->point, sphere->position), sphere->radius);
+	h->material = materials[sphere->material];
+	h->object = id;
+}
+
+u32 intersects_all(Ray r, Hit* h, float t_min, float t_max)
+{
+	f32 closest = t_max;
+	s32 slot = intersect_spheres(&sphere_soa, 0, sphere_soa.count, &r, t_min, &closest);
+
+	if (slot < 0) return 0;
+
+	set_sphere_hit(&r, h, closest, sphere_soa.ids[slot]);
+
+	return 1;
+}
+
+u32 intersects_scalar(Ray r, Hit* h, float t_min, float t_max, Sphere* first, s32 count)
+{
+	Hit		temp;
+	u32		hit_something = 0;
+	f32		closest = t_max;
+
+	Sphere* sphere_end = (first + count);
+
+	for (Sphere* sphere = first; sphere != sphere_end; sphere++)
+	{
+		if (intersection(&r, sphere, &temp, t_min, closest))
+		{
+			hit_something = 1;
+			closest = temp.t;
+
+			h->t = temp.t;
+			h->point = temp.point;
+			h->normal = temp.normal;
+			h->material = materials[sphere->material];
+			h->object = (u32)(sphere - first);
+		}
+	}
+
+	return hit_something;
+}
+
+v3 v3_min(v3 a, v3 b)
+{
+	return vec3(ffmin(a.x, b.x), ffmin(a.y, b.y), ffmin(a.z, b.z));
+}
+
+v3 v3_max(v3 a, v3 b)
+{
+	return vec3(ffmax(a.x, b.x), ffmax(a.y, b.y), ffmax(a.z, b.z));
+}
+
+f32 v3_axis(v3 a, u32 axis)
+{
+	return (axis == 0) ? a.x : ((axis == 1) ? a.y : a.z);
+}
+
+f32 bounds_area(v3 bounds_min, v3 bounds_max)
+{
+	v3 e = v3_sub(bounds_max, bounds_min);
+
+	if (e.x < 0.0f || e.y < 0.0f || e.z < 0.0f) return 0.0f;
+
+	return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+// Takes the node slots for a child over count primitives: one, or every slot its subtree could
+// need when it is going to be left as a task.
+u32 bvh_reserve(BVHBuild* build, u32 count)
+{
+	u32 index = build->next_node;
+
+	build->next_node += (build->tasks && count < build->task_size) ? 2 * count - 1 : 1;
+
+	return index;
+}
+
+// Binned SAH build straight into the flat node array. Nodes are laid out depth first: the
+// left child of an interior node always follows it, and offset holds the right child. For
+// leaves offset is the first entry in bvh->indices and count the number of primitives.
+// Past half the traversal stack depth splits fall back to the median so the stack can't overflow.
+// A parallel build stops at ranges smaller than build->task_size and queues them as tasks instead.
+void build_bvh_node(BVHBuild* build, u32 node_index, u32 first, u32 count, u32 depth)
+{
+	BVH*		bvh = build->bvh;
+	BVHPrimitive*	primitives = build->primitives;
+	BVHNode*	node = bvh->nodes + node_index;
+	u32*		indices = bvh->indices;
+
+	if (build->tasks && count < build->task_size)
+	{
+		if (build->task_count == build->task_capacity)
+		{
+			build->task_capacity *= 2;
+			build->tasks = realloc(build->tasks, build->task_capacity * sizeof(BVHTask));
+		}
+
+		BVHTask* task = build->tasks + build->task_count++;
+
+		task->node = node_index;
+		task->first = first;
+		task->count = count;
+		task->depth = depth;
+		return;
+	}
+
+	v3		bounds_min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	v3		bounds_max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	v3		centroid_min = bounds_min;
+	v3		centroid_max = bounds_max;
+
+	for (u32 i = first; i < first + count; i++)
+	{
+		BVHPrimitive* p = primitives + indices[i];
+
+		bounds_min = v3_min(bounds_min, p->bounds_min);
+		bounds_max = v3_max(bounds_max, p->bounds_max);
+		centroid_min = v3_min(centroid_min, p->centroid);
+		centroid_max = v3_max(centroid_max, p->centroid);
+	}
+
+	node->bounds_min = bounds_min;
+	node->bounds_max = bounds_max;
+	node->offset = first;
+	node->count = count;
+
+	if (count <= 2) return;
+
+	f32	best_cost = FLT_MAX;
+	u32	best_axis = 0;
+	u32	best_split = 0;
+
+	for (u32 axis = 0; axis < 3 && depth < BVH_STACK_SIZE / 2; axis++)
+	{
+		f32 lo = v3_axis(centroid_min, axis);
+		f32 extent = v3_axis(centroid_max, axis) - lo;
+
+		if (extent <= 0.0f) continue;
+
+		v3	bin_min[BVH_BINS];
+		v3	bin_max[BVH_BINS];
+		u32	bin_count[BVH_BINS];
+		f32	scale = BVH_BINS / extent;
+
+		for (u32 b = 0; b < BVH_BINS; b++)
+		{
+			bin_min[b] = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+			bin_max[b] = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			bin_count[b] = 0;
+		}
+
+		for (u32 i = first; i < first + count; i++)
+		{
+			BVHPrimitive* p = primitives + indices[i];
+			u32 b = (u32)((v3_axis(p->centroid, axis) - lo) * scale);
+
+			if (b >= BVH_BINS) b = BVH_BINS - 1;
+
+			bin_min[b] = v3_min(bin_min[b], p->bounds_min);
+			bin_max[b] = v3_max(bin_max[b], p->bounds_max);
+			bin_count[b]++;
+		}
+
+		f32	right_area[BVH_BINS];
+		u32	right_count[BVH_BINS];
+		v3	sweep_min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		v3	sweep_max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		u32	sweep_count = 0;
+
+		for (u32 b = BVH_BINS - 1; b > 0; b--)
+		{
+			sweep_min = v3_min(sweep_min, bin_min[b]);
+			sweep_max = v3_max(sweep_max, bin_max[b]);
+			sweep_count += bin_count[b];
+			right_area[b] = bounds_area(sweep_min, sweep_max);
+			right_count[b] = sweep_count;
+		}
+
+		sweep_min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		sweep_max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		sweep_count = 0;
+
+		for (u32 b = 0; b < BVH_BINS - 1; b++)
+		{
+			sweep_min = v3_min(sweep_min, bin_min[b]);
+			sweep_max = v3_max(sweep_max, bin_max[b]);
+			sweep_count += bin_count[b];
+
+			if (sweep_count == 0 || right_count[b + 1] == 0) continue;
+
+			f32 cost = sweep_count * bounds_area(sweep_min, sweep_max) + right_count[b + 1] * right_area[b + 1];
+
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b + 1;
+			}
+		}
+	}
+
+	f32 leaf_cost = count * bounds_area(bounds_min, bounds_max);
+	u32 mid = first;
+
+	if (best_cost < FLT_MAX)
+	{
+		if (best_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE) return;
+
+		f32 lo = v3_axis(centroid_min, best_axis);
+		f32 scale = BVH_BINS / (v3_axis(centroid_max, best_axis) - lo);
+		u32 left = first;
+		u32 right = first + count;
+
+		while (left < right)
+		{
+			u32 b = (u32)((v3_axis(primitives[indices[left]].centroid, best_axis) - lo) * scale);
+
+			if (b >= BVH_BINS) b = BVH_BINS - 1;
+
+			if (b < best_split)
+			{
+				left++;
+			}
+			else
+			{
+				u32 swap = indices[left];
+				indices[left] = indices[--right];
+				indices[right] = swap;
+			}
+		}
+
+		mid = left;
+	}
+
+	if (mid == first || mid == first + count)
+	{
+		if (count <= BVH_MAX_LEAF_SIZE) return;
+
+		mid = first + count / 2;
+	}
+
+	u32 left_index = bvh_reserve(build, mid - first);
+	build_bvh_node(build, left_index, first, mid - first, depth + 1);
+
+	u32 right_index = bvh_reserve(build, first + count - mid);
+	build_bvh_node(build, right_index, mid, first + count - mid, depth + 1);
+
+	node = bvh->nodes + node_index;
+	node->offset = right_index;
+	node->count = 0;
+}
+
+void build_bvh(BVH* bvh, BVHPrimitive* primitives, u32 count)
+{
+	BVHBuild build = { bvh, primitives, 1, 0, NULL, 0, 0 };
+
+	bvh->nodes = alloc_aligned((2 * count) * sizeof(BVHNode), 64);
+	bvh->indices = malloc(count * sizeof(u32));
+
+	for (u32 i = 0; i < count; i++) bvh->indices[i] = i;
+
+	build_bvh_node(&build, 0, 0, count, 0);
+
+	bvh->node_count = build.next_node;
+}
+
+static BVHBuild parallel_build;
+
+void build_bvh_task(u32 index)
+{
+	BVHTask*	task = parallel_build.tasks + index;
+	BVHBuild	build = { parallel_build.bvh, parallel_build.primitives, task->node + 1, 0, NULL, 0, 0 };
+
+	build_bvh_node(&build, task->node, task->first, task->count, task->depth);
+}
+
+s32 compare_bvh_tasks(const void* a, const void* b)
+{
+	u32 ca = ((const BVHTask*)a)->count;
+	u32 cb = ((const BVHTask*)b)->count;
+
+	return (ca < cb) - (ca > cb);
+}
+
+// The same binned SAH build spread over every thread. The top of the tree is split on one thread
+// until the ranges left are small enough to give each thread several, then those subtrees are
+// built in parallel, largest first. Each subtree fills the node slots reserved for it, so the
+// layout is the one a serial build would give apart from unused slots after some subtrees.
+void build_bvh_parallel(BVH* bvh, BVHPrimitive* primitives, u32 count)
+{
+	u32 task_size = count / (settings.thread_count * BVH_TASKS_PER_THREAD);
+
+	if (settings.thread_count <= 1 || task_size < BVH_MIN_TASK_SIZE)
+	{
+		build_bvh(bvh, primitives, count);
+		return;
+	}
+
+	BVHBuild build = { bvh, primitives, 1, task_size, malloc(64 * sizeof(BVHTask)), 0, 64 };
+
+	bvh->nodes = alloc_aligned((2 * count) * sizeof(BVHNode), 64);
+	bvh->indices = malloc(count * sizeof(u32));
+
+	for (u32 i = 0; i < count; i++) bvh->indices[i] = i;
+
+	build_bvh_node(&build, 0, 0, count, 0);
+
+	qsort(build.tasks, build.task_count, sizeof(BVHTask), compare_bvh_tasks);
+
+	parallel_build = build;
+	parallel_for(build_bvh_task, build.task_count);
+
+	bvh->node_count = build.next_node;
+
+	free(build.tasks);
+}
+
+void sphere_bounds(Sphere* sphere, v3* bounds_min, v3* bounds_max)
+{
+	f32	r = sphere->radius * 1.0001f;
+	v3	extent = vec3(r, r, r);
+
+	*bounds_min = v3_sub(sphere->position, extent);
+	*bounds_max = v3_add(sphere->position, extent);
+}
+
+void build_sphere_bvh(BVH* bvh, Sphere* first)
+{
+	BVHPrimitive* primitives = malloc(settings.num_spheres * sizeof(BVHPrimitive));
+
+	for (u32 i = 0; i < settings.num_spheres; i++)
+	{
+		sphere_bounds(first + i, &primitives[i].bounds_min, &primitives[i].bounds_max);
+		primitives[i].centroid = first[i].position;
+	}
+
+	build_bvh(bvh, primitives, settings.num_spheres);
+
+	free(primitives);
+}
+
+void setup_bvh(void)
+{
+	build_sphere_bvh(&scene_bvh, spheres);
+	setup_sphere_soa(scene_bvh.indices);
+}
+
+// Recomputes the bounds of every node after spheres have moved, keeping the tree as it was built.
+// Children always come after their parent in the node array, so a single sweep from the back sees
+// both children of a node before the node itself. The tree gets looser as spheres wander from
+// where it was built, but refitting costs a fraction of a rebuild.
+void refit_bvh(BVH* bvh)
+{
+	update_sphere_soa(bvh->indices);
+
+	for (s32 i = (s32)bvh->node_count - 1; i >= 0; i--)
+	{
+		BVHNode* node = bvh->nodes + i;
+
+		if (node->count)
+		{
+			sphere_bounds(spheres + bvh->indices[node->offset], &node->bounds_min, &node->bounds_max);
+
+			for (u32 j = 1; j < node->count; j++)
+			{
+				v3 bounds_min, bounds_max;
+
+				sphere_bounds(spheres + bvh->indices[node->offset + j], &bounds_min, &bounds_max);
+
+				node->bounds_min = v3_min(node->bounds_min, bounds_min);
+				node->bounds_max = v3_max(node->bounds_max, bounds_max);
+			}
+		}
+		else
+		{
+			BVHNode* left = node + 1;
+			BVHNode* right = bvh->nodes + node->offset;
+
+			node->bounds_min = v3_min(left->bounds_min, right->bounds_min);
+			node->bounds_max = v3_max(left->bounds_max, right->bounds_max);
+		}
+	}
+}
+
+f32 bvh_node_distance(BVHNode* node, v3 origin, v3 inv_dir, f32 t_max)
+{
+	f32 tx1 = (node->bounds_min.x - origin.x) * inv_dir.x;
+	f32 tx2 = (node->bounds_max.x - origin.x) * inv_dir.x;
+	f32 ty1 = (node->bounds_min.y - origin.y) * inv_dir.y;
+	f32 ty2 = (node->bounds_max.y - origin.y) * inv_dir.y;
+	f32 tz1 = (node->bounds_min.z - origin.z) * inv_dir.z;
+	f32 tz2 = (node->bounds_max.z - origin.z) * inv_dir.z;
+
+	f32 t_near = ffmax(ffmax(ffmin(tx1, tx2), ffmin(ty1, ty2)), ffmin(tz1, tz2));
+	f32 t_far = ffmin(ffmin(ffmax(tx1, tx2), ffmax(ty1, ty2)), ffmax(tz1, tz2));
+
+	return (t_far >= t_near && t_far > 0.0f && t_near < t_max) ? t_near : FLT_MAX;
+}
+
+// Closest hit against the scene spheres. Leaves index the sphere SoA arrays directly, which
+// setup_bvh lays out in BVH order.
+u32 intersects_bvh(Ray r, Hit* h, float t_min, float t_max, BVH* bvh)
+{
+	s32		hit_slot = -1;
+	f32		closest = t_max;
+	u32		stack[BVH_STACK_SIZE];
+	f32		stack_t[BVH_STACK_SIZE];
+	u32		stack_size = 0;
+	v3		inv_dir = vec3(1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z);
+	BVHNode*	node = bvh->nodes;
+
+	stats.rays++;
+	stats.box_tests++;
+
+	if (bvh_node_distance(node, r.origin, inv_dir, closest) == FLT_MAX) return 0;
+
+	while (1)
+	{
+		if (node->count)
+		{
+			stats.sphere_tests += node->count;
+
+			s32 slot = intersect_spheres(&sphere_soa, node->offset, node->count, &r, t_min, &closest);
+
+			if (slot >= 0) hit_slot = slot;
+		}
+		else
+		{
+			u32 near_index = (u32)(node - bvh->nodes) + 1;
+			u32 far_index = node->offset;
+			f32 near_t = bvh_node_distance(bvh->nodes + near_index, r.origin, inv_dir, closest);
+			f32 far_t = bvh_node_distance(bvh->nodes + far_index, r.origin, inv_dir, closest);
+
+			stats.box_tests += 2;
+
+			if (far_t < near_t)
+			{
+				u32 swap_index = near_index;
+				near_index = far_index;
+				far_index = swap_index;
+
+				f32 swap_t = near_t;
+				near_t = far_t;
+				far_t = swap_t;
+			}
+
+			if (near_t != FLT_MAX)
+			{
+				if (far_t != FLT_MAX)
+				{
+					stack[stack_size] = far_index;
+					stack_t[stack_size] = far_t;
+					stack_size++;
+				}
+
+				node = bvh->nodes + near_index;
+				continue;
+			}
+		}
+
+		while (stack_size > 0 && stack_t[stack_size - 1] >= closest) stack_size--;
+
+		if (stack_size == 0) break;
+
+		node = bvh->nodes + stack[--stack_size];
+	}
+
+	if (hit_slot < 0) return 0;
+
+	set_sphere_hit(&r, h, closest, sphere_soa.ids[hit_slot]);
+
+	return 1;
+}
+
+// Moves one coordinate of a hit point a number of float steps along the normal rather than a
+// fixed distance, so the gap stays just above the rounding of the point however far it is from
+// the origin. Close to zero, where those steps get tiny, a small fixed offset is used instead.
+// From Waechter and Binder, "A Fast and Robust Method for Avoiding Self-Intersection".
+f32 offset_coordinate(f32 p, f32 n)
+{
+	s32 bits;
+	s32 steps = (s32)(RAY_OFFSET_INT * n);
+
+	if (fabsf(p) < RAY_OFFSET_ORIGIN) return p + RAY_OFFSET_FLOAT * n;
+
+	memcpy(&bits, &p, sizeof(bits));
+	bits += (p < 0.0f) ? -steps : steps;
+	memcpy(&p, &bits, sizeof(p));
+
+	return p;
+}
+
+// Lifts a hit point off a surface with no inside for a bounce to start from, on the side of
+// normal, so the next ray can't hit the same surface again at t_min.
+v3 offset_ray(v3 point, v3 normal)
+{
+	return vec3(offset_coordinate(point.x, normal.x), offset_coordinate(point.y, normal.y), offset_coordinate(point.z, normal.z));
+}
+
+void set_plane_hit(Ray* r, Hit* h, f32 t, u32 id)
+{
+	Plane*	plane = planes + id;
+	v3	normal = (v3_dot(plane->normal, r->direction) > 0.0f) ? v3_mulf(plane->normal, -1.0f) : plane->normal;
+
+	h->t = t;
+	h->point = offset_ray(point_at_parameter(*r, t), normal);
+	h->normal = normal;
+	h->material = materials[plane->material];
+	h->object = settings.num_spheres + mesh.triangle_count + id;
+}
+
+// Closest plane or disk hit nearer than t_max. There are only ever a handful, so they are tested
+// in turn without a tree; the ground is one division and a dot product.
+u32 intersects_planes(Ray* r, Hit* h, f32 t_min, f32 t_max)
+{
+	s32 best = -1;
+	f32 closest = t_max;
+
+	for (u32 i = 0; i < plane_count; i++)
+	{
+		Plane*	plane = planes + i;
+		f32	facing = v3_dot(plane->normal, r->direction);
+		f32	t = v3_dot(plane->normal, v3_sub(plane->centre, r->origin)) / facing;
+
+		if (!(t > t_min && t < closest)) continue;
+
+		if (plane->radius > 0.0f)
+		{
+			v3 offset = v3_sub(point_at_parameter(*r, t), plane->centre);
+
+			if (v3_dot(offset, offset) > plane->radius * plane->radius) continue;
+		}
+
+		closest = t;
+		best = (s32)i;
+	}
+
+	if (best < 0) return 0;
+
+	set_plane_hit(r, h, closest, (u32)best);
+
+	return 1;
+}
+
+void triangle_ray_setup(Ray* r, TriangleRay* tr)
+{
+	f32 d[3] = { r->direction.x, r->direction.y, r->direction.z };
+	u32 kz = (fabsf(d[0]) > fabsf(d[1])) ? ((fabsf(d[0]) > fabsf(d[2])) ? 0 : 2) : ((fabsf(d[1]) > fabsf(d[2])) ? 1 : 2);
+	u32 kx = (kz + 1) % 3;
+	u32 ky = (kx + 1) % 3;
+
+	if (d[kz] < 0.0f)
+	{
+		u32 swap = kx;
+		kx = ky;
+		ky = swap;
+	}
+
+	tr->origin[0] = r->origin.x;
+	tr->origin[1] = r->origin.y;
+	tr->origin[2] = r->origin.z;
+	tr->k[0] = kx;
+	tr->k[1] = ky;
+	tr->k[2] = kz;
+	tr->shear[0] = d[kx] / d[kz];
+	tr->shear[1] = d[ky] / d[kz];
+	tr->shear[2] = 1.0f / d[kz];
+}
+
+// Distance along the ray to triangle abc, or FLT_MAX if it misses or lies outside (t_min, t_max).
+// The edge functions u, v and w are evaluated in the ray's sheared space, where an edge shared by
+// two triangles gives both of them the same value, so no ray can slip through the gap between
+// them; when one comes out exactly zero it is redone in double precision, as the paper does.
+f32 intersect_triangle(TriangleRay* tr, const f32* a, const f32* b, const f32* c, f32 t_min, f32 t_max)
+{
+	u32 kx = tr->k[0];
+	u32 ky = tr->k[1];
+	u32 kz = tr->k[2];
+	f32 az = a[kz] - tr->origin[kz];
+	f32 bz = b[kz] - tr->origin[kz];
+	f32 cz = c[kz] - tr->origin[kz];
+	f32 ax = a[kx] - tr->origin[kx] - tr->shear[0] * az;
+	f32 ay = a[ky] - tr->origin[ky] - tr->shear[1] * az;
+	f32 bx = b[kx] - tr->origin[kx] - tr->shear[0] * bz;
+	f32 by = b[ky] - tr->origin[ky] - tr->shear[1] * bz;
+	f32 cx = c[kx] - tr->origin[kx] - tr->shear[0] * cz;
+	f32 cy = c[ky] - tr->origin[ky] - tr->shear[1] * cz;
+	f32 u = cx * by - cy * bx;
+	f32 v = ax * cy - ay * cx;
+	f32 w = bx * ay - by * ax;
+
+	if (u == 0.0f || v == 0.0f || w == 0.0f)
+	{
+		u = (f32)((f64)cx * by - (f64)cy * bx);
+		v = (f32)((f64)ax * cy - (f64)ay * cx);
+		w = (f32)((f64)bx * ay - (f64)by * ax);
+	}
+
+	if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) return FLT_MAX;
+
+	f32 det = u + v + w;
+
+	if (det == 0.0f) return FLT_MAX;
+
+	f32 t = (u * az + v * bz + w * cz) * tr->shear[2] / det;
+
+	return (t > t_min && t < t_max) ? t : FLT_MAX;
+}
+
+// Tests one ray against triangles [first, first + count) of the SoA arrays, four at a time, with
+// the same arithmetic as intersect_triangle(). Returns the slot of the closest hit, or -1, and
+// lowers *t_max to its distance. Lanes with an edge function of exactly zero are handed to
+// intersect_triangle() for its double precision retry.
+s32 intersect_triangles(const TriangleSoA* soa, u32 first, u32 count, TriangleRay* tr, f32 t_min, f32* t_max)
+{
+	s32	best = -1;
+	f32	closest = *t_max;
+	u32	end = first + count;
+	u32	i = first;
+	u32	kx = tr->k[0];
+	u32	ky = tr->k[1];
+	u32	kz = tr->k[2];
+
+#ifdef SIMD_SSE
+	__m128	ox = _mm_set1_ps(tr->origin[kx]), oy = _mm_set1_ps(tr->origin[ky]), oz = _mm_set1_ps(tr->origin[kz]);
+	__m128	sx = _mm_set1_ps(tr->shear[0]), sy = _mm_set1_ps(tr->shear[1]), sz = _mm_set1_ps(tr->shear[2]);
+	__m128	vt_min = _mm_set1_ps(t_min);
+	__m128	zero = _mm_setzero_ps();
+	__m128	best_t = _mm_set1_ps(closest);
+	__m128i	best_slot = _mm_set1_epi32(-1);
+	__m128i	slot = _mm_add_epi32(_mm_set1_epi32(i), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i	vend = _mm_set1_epi32(end);
+
+	for (; i < end; i += 4)
+	{
+		__m128 az = _mm_sub_ps(_mm_loadu_ps(soa->a[kz] + i), oz);
+		__m128 bz = _mm_sub_ps(_mm_loadu_ps(soa->b[kz] + i), oz);
+		__m128 cz = _mm_sub_ps(_mm_loadu_ps(soa->c[kz] + i), oz);
+		__m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(soa->a[kx] + i), ox), _mm_mul_ps(sx, az));
+		__m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(soa->a[ky] + i), oy), _mm_mul_ps(sy, az));
+		__m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(soa->b[kx] + i), ox), _mm_mul_ps(sx, bz));
+		__m128 by = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(soa->b[ky] + i), oy), _mm_mul_ps(sy, bz));
+		__m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(soa->c[kx] + i), ox), _mm_mul_ps(sx, cz));
+		__m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(soa->c[ky] + i), oy), _mm_mul_ps(sy, cz));
+		__m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+		__m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+		__m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+		__m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+		__m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+		__m128 on_edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+		__m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+		__m128 t = _mm_div_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz)), sz), det);
+		__m128 in_range = _mm_castsi128_ps(_mm_cmplt_epi32(slot, vend));
+		__m128 inside = _mm_andnot_ps(_mm_or_ps(_mm_and_ps(negative, positive), on_edge), _mm_cmpneq_ps(det, zero));
+		__m128 hit = _mm_and_ps(_mm_and_ps(inside, in_range), _mm_and_ps(_mm_cmpgt_ps(t, vt_min), _mm_cmplt_ps(t, best_t)));
+
+		best_t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, best_t));
+		best_slot = _mm_or_si128(_mm_and_si128(_mm_castps_si128(hit), slot), _mm_andnot_si128(_mm_castps_si128(hit), best_slot));
+		slot = _mm_add_epi32(slot, _mm_set1_epi32(4));
+
+		s32 retry = _mm_movemask_ps(_mm_and_ps(on_edge, in_range));
+
+		if (retry)
+		{
+			f32 lane_t[4];
+			s32 lane_slot[4];
+
+			_mm_storeu_ps(lane_t, best_t);
+			_mm_storeu_si128((__m128i*)lane_slot, best_slot);
+
+			for (u32 lane = 0; lane < 4; lane++)
+			{
+				if (!(retry & (1 << lane))) continue;
+
+				u32 j = i + lane;
+				f32 a[3] = { soa->a[0][j], soa->a[1][j], soa->a[2][j] };
+				f32 b[3] = { soa->b[0][j], soa->b[1][j], soa->b[2][j] };
+				f32 c[3] = { soa->c[0][j], soa->c[1][j], soa->c[2][j] };
+				f32 lane_hit = intersect_triangle(tr, a, b, c, t_min, lane_t[lane]);
+
+				if (lane_hit < lane_t[lane])
+				{
+					lane_t[lane] = lane_hit;
+					lane_slot[lane] = j;
+				}
+			}
+
+			best_t = _mm_loadu_ps(lane_t);
+			best_slot = _mm_loadu_si128((__m128i*)lane_slot);
+		}
+	}
+
+	f32 lane_t[4];
+	s32 lane_slot[4];
+
+	_mm_storeu_ps(lane_t, best_t);
+	_mm_storeu_si128((__m128i*)lane_slot, best_slot);
+
+	for (u32 lane = 0; lane < 4; lane++)
+	{
+		if (lane_slot[lane] >= 0 && lane_t[lane] < closest)
+		{
+			closest = lane_t[lane];
+			best = lane_slot[lane];
+		}
+	}
+#else
+	for (; i < end; i++)
+	{
+		f32 a[3] = { soa->a[0][i], soa->a[1][i], soa->a[2][i] };
+		f32 b[3] = { soa->b[0][i], soa->b[1][i], soa->b[2][i] };
+		f32 c[3] = { soa->c[0][i], soa->c[1][i], soa->c[2][i] };
+		f32 t = intersect_triangle(tr, a, b, c, t_min, closest);
+
+		if (t < closest)
+		{
+			closest = t;
+			best = i;
+		}
+	}
+#endif // SIMD_SSE
+
+	*t_max = closest;
+
+	return best;
+}
+
+// The normal is turned to face the ray and the hit point lifted off the surface on that side.
+void set_triangle_hit(Ray* r, Hit* h, f32 t, u32 slot)
+{
+	TriangleSoA*	soa = &mesh.soa;
+	v3		a = vec3(soa->a[0][slot], soa->a[1][slot], soa->a[2][slot]);
+	v3		b = vec3(soa->b[0][slot], soa->b[1][slot], soa->b[2][slot]);
+	v3		c = vec3(soa->c[0][slot], soa->c[1][slot], soa->c[2][slot]);
+	v3		normal = v3_normalized(v3_cross(v3_sub(b, a), v3_sub(c, a)));
+	u32		id = soa->ids[slot];
+
+	if (v3_dot(normal, r->direction) > 0.0f) normal = v3_mulf(normal, -1.0f);
+
+	h->t = t;
+	h->point = offset_ray(point_at_parameter(*r, t), normal);
+	h->normal = normal;
+	h->material = materials[mesh.materials[id]];
+	h->object = settings.num_spheres + id;
+}
+
+// Closest triangle hit nearer than t_max. Walks the mesh BVH the way intersects_bvh walks the
+// spheres', testing the triangles of each leaf together; the ray is counted by the sphere walk.
+u32 intersects_mesh(Ray* r, Hit* h, f32 t_min, f32 t_max)
+{
+	s32		hit_slot = -1;
+	f32		closest = t_max;
+	u32		stack[BVH_STACK_SIZE];
+	f32		stack_t[BVH_STACK_SIZE];
+	u32		stack_size = 0;
+	v3		inv_dir = vec3(1.0f / r->direction.x, 1.0f / r->direction.y, 1.0f / r->direction.z);
+	BVH*		bvh = &mesh.bvh;
+	BVHNode*	node = bvh->nodes;
+	TriangleRay	tr;
+
+	stats.box_tests++;
+
+	if (bvh_node_distance(node, r->origin, inv_dir, closest) == FLT_MAX) return 0;
+
+	triangle_ray_setup(r, &tr);
+
+	while (1)
+	{
+		if (node->count)
+		{
+			stats.triangle_tests += node->count;
+
+			s32 slot = intersect_triangles(&mesh.soa, node->offset, node->count, &tr, t_min, &closest);
+
+			if (slot >= 0) hit_slot = slot;
+		}
+		else
+		{
+			u32 near_index = (u32)(node - bvh->nodes) + 1;
+			u32 far_index = node->offset;
+			f32 near_t = bvh_node_distance(bvh->nodes + near_index, r->origin, inv_dir, closest);
+			f32 far_t = bvh_node_distance(bvh->nodes + far_index, r->origin, inv_dir, closest);
+
+			stats.box_tests += 2;
+
+			if (far_t < near_t)
+			{
+				u32 swap_index = near_index;
+				near_index = far_index;
+				far_index = swap_index;
+
+				f32 swap_t = near_t;
+				near_t = far_t;
+				far_t = swap_t;
+			}
+
+			if (near_t != FLT_MAX)
+			{
+				if (far_t != FLT_MAX)
+				{
+					stack[stack_size] = far_index;
+					stack_t[stack_size] = far_t;
+					stack_size++;
+				}
+
+				node = bvh->nodes + near_index;
+				continue;
+			}
+		}
+
+		while (stack_size > 0 && stack_t[stack_size - 1] >= closest) stack_size--;
+
+		if (stack_size == 0) break;
+
+		node = bvh->nodes + stack[--stack_size];
+	}
+
+	if (hit_slot < 0) return 0;
+
+	set_triangle_hit(r, h, closest, hit_slot);
+
+	return 1;
+}
+
+// The closest hit in the scene, which every path segment and shadow ray goes through: the planes
+// first, as they are cheap and the ground cuts short most of the rays that go down, then the
+// spheres in front of that and any triangle in front of those.
+u32 intersects_scene(Ray r, Hit* h, float t_min, float t_max)
+{
+	u32 hit = plane_count && intersects_planes(&r, h, t_min, t_max);
+
+	if (intersects_bvh(r, h, t_min, hit ? h->t : t_max, &scene_bvh)) hit = 1;
+
+	if (mesh.triangle_count && intersects_mesh(&r, h, t_min, hit ? h->t : t_max)) hit = 1;
+
+	return hit;
+}
+
+void packet_set_ray(RayPacket* p, u32 lane, Ray* r)
+{
+	p->ox[lane] = r->origin.x;
+	p->oy[lane] = r->origin.y;
+	p->oz[lane] = r->origin.z;
+	p->dx[lane] = r->direction.x;
+	p->dy[lane] = r->direction.y;
+	p->dz[lane] = r->direction.z;
+	p->inv_x[lane] = 1.0f / r->direction.x;
+	p->inv_y[lane] = 1.0f / r->direction.y;
+	p->inv_z[lane] = 1.0f / r->direction.z;
+	p->a[lane] = v3_dot(r->direction, r->direction);
+}
+
+// Pads the packet out to a whole number of SIMD groups with copies of lane 0 whose t is already
+// zero, so they can never accept a node or a sphere and the lane loops need no masking.
+void packet_begin(RayPacket* p, u32 count, f32 t_max)
+{
+	p->count = (count + 3) & ~3;
+
+	stats.rays += count;
+
+	for (u32 lane = 0; lane < p->count; lane++)
+	{
+		if (lane >= count)
+		{
+			p->ox[lane] = p->ox[0]; p->oy[lane] = p->oy[0]; p->oz[lane] = p->oz[0];
+			p->dx[lane] = p->dx[0]; p->dy[lane] = p->dy[0]; p->dz[lane] = p->dz[0];
+			p->inv_x[lane] = p->inv_x[0]; p->inv_y[lane] = p->inv_y[0]; p->inv_z[lane] = p->inv_z[0];
+			p->a[lane] = p->a[0];
+		}
+
+		p->t[lane] = (lane < count) ? t_max : 0.0f;
+		p->slot[lane] = -1;
+	}
+}
+
+// Returns the nearest entry distance of any ray in the packet that overlaps the node before its
+// current closest hit, or FLT_MAX if none does, in which case the node is culled for all of them.
+f32 packet_node_distance(BVHNode* node, RayPacket* p)
+{
+	f32 entry = FLT_MAX;
+
+#ifdef SIMD_SSE
+	__m128 min_x = _mm_set1_ps(node->bounds_min.x), max_x = _mm_set1_ps(node->bounds_max.x);
+	__m128 min_y = _mm_set1_ps(node->bounds_min.y), max_y = _mm_set1_ps(node->bounds_max.y);
+	__m128 min_z = _mm_set1_ps(node->bounds_min.z), max_z = _mm_set1_ps(node->bounds_max.z);
+	__m128 zero = _mm_setzero_ps();
+	__m128 nearest = _mm_set1_ps(FLT_MAX);
+
+	for (u32 lane = 0; lane < p->count; lane += 4)
+	{
+		__m128 ox = _mm_loadu_ps(p->ox + lane), ix = _mm_loadu_ps(p->inv_x + lane);
+		__m128 oy = _mm_loadu_ps(p->oy + lane), iy = _mm_loadu_ps(p->inv_y + lane);
+		__m128 oz = _mm_loadu_ps(p->oz + lane), iz = _mm_loadu_ps(p->inv_z + lane);
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(min_x, ox), ix), tx2 = _mm_mul_ps(_mm_sub_ps(max_x, ox), ix);
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(min_y, oy), iy), ty2 = _mm_mul_ps(_mm_sub_ps(max_y, oy), iy);
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(min_z, oz), iz), tz2 = _mm_mul_ps(_mm_sub_ps(max_z, oz), iz);
+		__m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+		__m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+		__m128 overlap = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(t_far, t_near), _mm_cmpgt_ps(t_far, zero)), _mm_cmplt_ps(t_near, _mm_loadu_ps(p->t + lane)));
+
+		nearest = _mm_min_ps(nearest, _mm_or_ps(_mm_and_ps(overlap, t_near), _mm_andnot_ps(overlap, _mm_set1_ps(FLT_MAX))));
+	}
+
+	f32 lanes[4];
+	_mm_storeu_ps(lanes, nearest);
+
+	entry = ffmin(ffmin(lanes[0], lanes[1]), ffmin(lanes[2], lanes[3]));
+#else
+	for (u32 lane = 0; lane < p->count; lane++)
+	{
+		v3 origin = vec3(p->ox[lane], p->oy[lane], p->oz[lane]);
+		v3 inv_dir = vec3(p->inv_x[lane], p->inv_y[lane], p->inv_z[lane]);
+
+		entry = ffmin(entry, bvh_node_distance(node, origin, inv_dir, p->t[lane]));
+	}
+#endif // SIMD_SSE
+
+	return entry;
+}
+
+// One sphere against every ray in the packet, four rays per instruction. Same acceptance rules
+// as intersect_spheres().
+void packet_intersect_sphere(RayPacket* p, const SphereSoA* soa, u32 slot, f32 t_min)
+{
+#ifdef SIMD_SSE
+	__m128	cx = _mm_set1_ps(soa->x[slot]), cy = _mm_set1_ps(soa->y[slot]), cz = _mm_set1_ps(soa->z[slot]);
+	__m128	r2 = _mm_set1_ps(soa->radius2[slot]);
+	__m128	vt_min = _mm_set1_ps(t_min);
+	__m128	zero = _mm_setzero_ps();
+	__m128i	vslot = _mm_set1_epi32(slot);
+
+	for (u32 lane = 0; lane < p->count; lane += 4)
+	{
+		__m128 dx = _mm_loadu_ps(p->dx + lane), dy = _mm_loadu_ps(p->dy + lane), dz = _mm_loadu_ps(p->dz + lane);
+		__m128 ix = _mm_sub_ps(_mm_loadu_ps(p->ox + lane), cx);
+		__m128 iy = _mm_sub_ps(_mm_loadu_ps(p->oy + lane), cy);
+		__m128 iz = _mm_sub_ps(_mm_loadu_ps(p->oz + lane), cz);
+		__m128 a = _mm_loadu_ps(p->a + lane);
+		__m128 t_max = _mm_loadu_ps(p->t + lane);
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ix, dx), _mm_mul_ps(iy, dy)), _mm_mul_ps(iz, dz));
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ix, ix), _mm_mul_ps(iy, iy)), _mm_mul_ps(iz, iz)), r2);
+		__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+		__m128 root = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+		__m128 neg_b = _mm_sub_ps(zero, b);
+		__m128 t0 = _mm_div_ps(_mm_sub_ps(neg_b, root), a);
+		__m128 t1 = _mm_div_ps(_mm_add_ps(neg_b, root), a);
+		__m128 t0_ok = _mm_and_ps(_mm_cmpgt_ps(t0, vt_min), _mm_cmplt_ps(t0, t_max));
+		__m128 t1_ok = _mm_and_ps(_mm_cmpgt_ps(t1, vt_min), _mm_cmplt_ps(t1, t_max));
+		__m128 valid = _mm_and_ps(_mm_cmpgt_ps(c, zero), _mm_cmpge_ps(disc, zero));
+		__m128 hit = _mm_and_ps(valid, _mm_or_ps(t0_ok, t1_ok));
+		__m128 t = _mm_or_ps(_mm_and_ps(t0_ok, t0), _mm_andnot_ps(t0_ok, t1));
+		__m128i old_slot = _mm_loadu_si128((__m128i*)(p->slot + lane));
+
+		_mm_storeu_ps(p->t + lane, _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, t_max)));
+		_mm_storeu_si128((__m128i*)(p->slot + lane), _mm_or_si128(_mm_and_si128(_mm_castps_si128(hit), vslot), _mm_andnot_si128(_mm_castps_si128(hit), old_slot)));
+	}
+#else
+	for (u32 lane = 0; lane < p->count; lane++)
+	{
+		Ray r;
+		r.origin = vec3(p->ox[lane], p->oy[lane], p->oz[lane]);
+		r.direction = vec3(p->dx[lane], p->dy[lane], p->dz[lane]);
+
+		if (intersect_spheres(soa, slot, 1, &r, t_min, p->t + lane) >= 0) p->slot[lane] = slot;
+	}
+#endif // SIMD_SSE
+}
+
+// Closest hits for a whole packet of rays in one traversal. Every ray shares the node visits, so
+// the BVH is walked once per packet rather than once per ray; a node is only skipped once no ray
+// in the packet can still find a closer hit inside it.
+void intersects_packet(RayPacket* p, f32 t_min, BVH* bvh)
+{
+	u32		stack[BVH_STACK_SIZE];
+	u32		stack_size = 0;
+	BVHNode*	node = bvh->nodes;
+
+	stats.box_tests += p->count;
+
+	if (packet_node_distance(node, p) == FLT_MAX) return;
+
+	while (1)
+	{
+		if (node->count)
+		{
+			stats.sphere_tests += (u64)node->count * p->count;
+
+			for (u32 i = node->offset; i < node->offset + node->count; i++)
+			{
+				packet_intersect_sphere(p, &sphere_soa, i, t_min);
+			}
+		}
+		else
+		{
+			u32 near_index = (u32)(node - bvh->nodes) + 1;
+			u32 far_index = node->offset;
+			f32 near_t = packet_node_distance(bvh->nodes + near_index, p);
+			f32 far_t = packet_node_distance(bvh->nodes + far_index, p);
+
+			stats.box_tests += 2 * p->count;
+
+			if (far_t < near_t)
+			{
+				u32 swap_index = near_index;
+				near_index = far_index;
+				far_index = swap_index;
+
+				f32 swap_t = near_t;
+				near_t = far_t;
+				far_t = swap_t;
+			}
+
+			if (near_t != FLT_MAX)
+			{
+				if (far_t != FLT_MAX) stack[stack_size++] = far_index;
+
+				node = bvh->nodes + near_index;
+				continue;
+			}
+		}
+
+		if (stack_size == 0) break;
+
+		node = bvh->nodes + stack[--stack_size];
+	}
+}
+
+// A packet lane's closest hit: the sphere it found, unless a plane or triangle is closer along the
+// same ray. Only the spheres are traced as a packet; the rest are tested ray by ray.
+u32 packet_hit(RayPacket* p, u32 lane, Ray* r, Hit* h)
+{
+	u32 hit = p->slot[lane] >= 0;
+
+	if (hit) set_sphere_hit(r, h, p->t[lane], sphere_soa.ids[p->slot[lane]]);
+
+	if (plane_count && intersects_planes(r, h, 0.000000001f, hit ? p->t[lane] : FLT_MAX)) hit = 1;
+
+	if (mesh.triangle_count && intersects_mesh(r, h, 0.000000001f, hit ? h->t : FLT_MAX)) hit = 1;
+
+	return hit;
+}
+
+u32 hits_match(u32 hit_a, Hit* a, u32 hit_b, Hit* b)
+{
+	if (hit_a != hit_b) return 0;
+	if (!hit_a) return 1;
+
+	return a->object == b->object && fabsf(a->t - b->t) <= 0.0001f * fabsf(a->t);
+}
+
+f64 time_intersections(Ray* rays, u32 count, u32 method, u32* hits, Hit* results)
+{
+	f64 start = get_time();
+
+	for (u32 i = 0; i < count; i++)
+	{
+		switch (method)
+		{
+		case 0: hits[i] = intersects_scalar(rays[i], results + i, 0.000000001f, FLT_MAX, spheres, settings.num_spheres); break;
+		case 1: hits[i] = intersects_all(rays[i], results + i, 0.000000001f, FLT_MAX); break;
+		case 2: hits[i] = intersects_bvh(rays[i], results + i, 0.000000001f, FLT_MAX, &scene_bvh); break;
+		case 3:
+		{
+			RayPacket	packet;
+			u32		lanes = (count - i < PACKET_SIZE) ? count - i : PACKET_SIZE;
+
+			for (u32 lane = 0; lane < lanes; lane++) packet_set_ray(&packet, lane, rays + i + lane);
+
+			packet_begin(&packet, lanes, FLT_MAX);
+			intersects_packet(&packet, 0.000000001f, &scene_bvh);
+
+			for (u32 lane = 0; lane < lanes; lane++)
+			{
+				hits[i + lane] = packet.slot[lane] >= 0;
+
+				if (hits[i + lane]) set_sphere_hit(rays + i + lane, results + i + lane, packet.t[lane], sphere_soa.ids[packet.slot[lane]]);
+			}
+
+			i += lanes - 1;
+		}
+		break;
+		}
+	}
+
+	return get_time() - start;
+}
+
+// Checks the mesh BVH and the SSE triangle test against intersect_triangle() run on every triangle
+// in turn, for as many of the rays as keeps the brute force to about VERIFY_TRIANGLE_TESTS tests.
+u32 verify_mesh(Ray* rays, u32 count)
+{
+	u32	checked = (u32)((VERIFY_TRIANGLE_TESTS / mesh.triangle_count < count) ? VERIFY_TRIANGLE_TESTS / mesh.triangle_count : count);
+	u32	mismatches = 0;
+	f64	brute_seconds = 0.0;
+	f64	bvh_seconds = 0.0;
+
+	if (checked == 0) checked = 1;
+
+	for (u32 i = 0; i < checked; i++)
+	{
+		TriangleRay	tr;
+		Hit		h;
+		f32		closest = FLT_MAX;
+		s32		best = -1;
+		f64		start = get_time();
+
+		triangle_ray_setup(rays + i, &tr);
+
+		for (u32 j = 0; j < mesh.triangle_count; j++)
+		{
+			f32 a[3] = { mesh.soa.a[0][j], mesh.soa.a[1][j], mesh.soa.a[2][j] };
+			f32 b[3] = { mesh.soa.b[0][j], mesh.soa.b[1][j], mesh.soa.b[2][j] };
+			f32 c[3] = { mesh.soa.c[0][j], mesh.soa.c[1][j], mesh.soa.c[2][j] };
+			f32 t = intersect_triangle(&tr, a, b, c, 0.000000001f, closest);
+
+			if (t < closest)
+			{
+				closest = t;
+				best = j;
+			}
+		}
+
+		f64 middle = get_time();
+		u32 hit = intersects_mesh(rays + i, &h, 0.000000001f, FLT_MAX);
+
+		bvh_seconds += get_time() - middle;
+		brute_seconds += middle - start;
+
+		if (hit != (best >= 0) || (hit && (h.object != settings.num_spheres + mesh.soa.ids[best] || fabsf(h.t - closest) > 0.0001f * closest))) mismatches++;
+	}
+
+	printf("%-8s %u rays against %u triangles, %f s brute force, %f s bvh (%.2f Mrays/s), %u mismatched\n", "mesh", checked, mesh.triangle_count, brute_seconds, bvh_seconds, checked / (bvh_seconds * 1000000.0), mismatches);
+
+	return mismatches;
+}
+
+// Fires camera rays, plus one bounce from each camera hit, through the scalar loop, the SIMD
+// brute force kernel, the BVH and BVH packets. Reports throughput for each and returns the number of rays
+// whose closest hits disagree with the scalar reference.
+u32 verify_intersections(u32 ray_count)
+{
+	const char*	names[4] = { "scalar", "simd", "bvh", "packet" };
+	Ray*		rays = malloc(2 * ray_count * sizeof(Ray));
+	u32*		hits[4];
+	Hit*		results[4];
+	u32		count = 0;
+	u32		mismatches = 0;
+
+	rng_seed(&rng, SEED, RNG_STREAM_VERIFY, 0);
+
+	for (u32 i = 0; i < ray_count; i++)
+	{
+		Hit h;
+		Ray r = get_ray(&camera, nrand(), nrand());
+
+		rays[count++] = r;
+
+		if (intersects_scalar(r, &h, 0.000000001f, FLT_MAX, spheres, settings.num_spheres))
+		{
+			r.origin = h.point;
+			r.direction = v3_add(h.normal, random_unit_sphere());
+			rays[count++] = r;
+		}
+	}
+
+	for (u32 method = 0; method < 4; method++)
+	{
+		hits[method] = malloc(count * sizeof(u32));
+		results[method] = malloc(count * sizeof(Hit));
+
+		f64 seconds = time_intersections(rays, count, method, hits[method], results[method]);
+		u32 method_mismatches = 0;
+
+		for (u32 i = 0; method > 0 && i < count; i++)
+		{
+			if (!hits_match(hits[0][i], results[0] + i, hits[method][i], results[method] + i)) method_mismatches++;
+		}
+
+		printf("%-8s %u rays in %f s (%.2f Mrays/s), %u mismatched\n", names[method], count, seconds, count / (seconds * 1000000.0), method_mismatches);
+
+		mismatches += method_mismatches;
+	}
+
+	printf("BVH: %u nodes over %u spheres\n", scene_bvh.node_count, settings.num_spheres);
+
+	if (mesh.triangle_count) mismatches += verify_mesh(rays, count);
+
+	for (u32 method = 0; method < 4; method++)
+	{
+		free(hits[method]);
+		free(results[method]);
+	}
+
+	free(rays);
+
+	return mismatches;
+}
+
+#ifdef WINDOWED
+
+void paint(void)
+{
+	PAINTSTRUCT ps;
+	HDC dc = BeginPaint(hwnd, &ps);
+	s32 x = ps.rcPaint.left;
+	s32 y = ps.rcPaint.top;
+	s32 w = ps.rcPaint.right - ps.rcPaint.left;
+	s32 h = ps.rcPaint.bottom - ps.rcPaint.top;
+
+	// The bitmap is stored bottom up, so the source rectangle is measured from the bottom row.
+	StretchDIBits(dc, x, y, w, h, x, settings.output_height - (y + h), w, h, (void*)bitmap_image_data, (BITMAPINFO*)&info_header, DIB_RGB_COLORS, SRCCOPY);
+
+	EndPaint(hwnd, &ps);
+}
+
+LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM w_param, LPARAM l_param)
+{
+	switch (msg)
+	{
+	case WM_PAINT:
+	{
+		paint();
+	}
+	break;
+	case WM_CLOSE:
+		DestroyWindow(hwnd);
+		break;
+	case WM_DESTROY:
+		PostQuitMessage(0);
+		break;
+	default:
+		return DefWindowProc(hwnd, msg, w_param, l_param);
+		break;
+	}
+	return 0;
+}
+
+#endif // WINDOWED
+
+void setup_camera(Camera* camera, v3 pos, v3 target, v3 up, f32 vertical_fov, f32 aspect, f32 aperture, f32 focus_distance)
+{
+	camera->lens_radius = aperture / 2.0f;
+
+	f32 theta = vertical_fov * (3.14159265358979323846f / 180.0f);
+	f32 half_height = tan(theta / 2.0f);
+	f32 half_width = aspect * half_height;
+
+	camera->position = pos;
+
+	v3	dir = v3_sub(pos, target);
+	camera->w = v3_normalized(dir);
+
+	v3	cp_dir = v3_cross(up, camera->w);
+	camera->u = v3_normalized(cp_dir);
+
+	camera->v = v3_cross(camera->w, camera->u);
+
+	v3	hwu = v3_mulf(camera->u, half_width*focus_distance);
+	v3	hhv = v3_mulf(camera->v, half_height*focus_distance);
+	v3	ht = v3_add(hwu, hhv);
+	v3  fdw = v3_mulf(camera->w, focus_distance);
+	v3	total = v3_add(ht, fdw);
+
+	camera->bottom_left = v3_sub(pos, total);
+	camera->horizontal = v3_mulf(camera->u, 2.0f*focus_distance*half_width);
+	camera->vertical = v3_mulf(camera->v, 2.0f*focus_distance*half_height);
+}
+
+v3 sky(v3 direction)
+{
+	v3 dir_n = v3_normalized(direction);
+
+	f32 t = 0.5f * (dir_n.y + 1.0f);
+
+	v3 lower = vec3(1.0f, 1.0f, 1.0f);
+	v3 upper = vec3(0.5f, 0.7f, 1.0f);
+
+#ifdef NIGHT
+
+	lower = vec3(0.270f, 0.211f, 0.184f);
+	upper = vec3(0.020f, 0.020f, 0.020f);
+
+#endif // NIGHT
+
+	v3 white_component = v3_mulf(lower, 1.0f - t);
+	v3 blue_component = v3_mulf(upper, t);
+	v3 gradient = v3_add(white_component, blue_component);
+
+	return gradient;
+}
+
+f32 luminance(v3 c)
+{
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+f32 light_power(Sphere* sphere)
+{
+	return luminance(materials[sphere->material].albedo) * sphere->radius * sphere->radius;
+}
+
+void setup_lights(void)
+{
+	free(lights.ids);
+	free(lights.cdf);
+
+	lights.ids = malloc(settings.num_spheres * sizeof(u32));
+	lights.cdf = malloc(settings.num_spheres * sizeof(f32));
+	lights.count = 0;
+	lights.power = 0.0f;
+
+	for (u32 i = 0; i < settings.num_spheres; i++)
+	{
+		if (materials[spheres[i].material].type != LIGHT || light_power(spheres + i) <= 0.0f) continue;
+
+		lights.power += light_power(spheres + i);
+		lights.ids[lights.count] = i;
+		lights.cdf[lights.count] = lights.power;
+		lights.count++;
+	}
+
+	for (u32 i = 0; i < lights.count; i++) lights.cdf[i] /= lights.power;
+}
+
+// Solid angle density of picking a light and then a direction in the cone it subtends from point.
+// The cone's 1 - cos(theta_max) is computed from sin^2 so small, distant lights keep precision.
+f32 light_pdf(u32 id, v3 point, f32* one_minus_cos)
+{
+	Sphere*	sphere = spheres + id;
+	v3	to_light = v3_sub(sphere->position, point);
+	f32	distance_squared = v3_dot(to_light, to_light);
+	f32	sin_squared = (sphere->radius * sphere->radius) / distance_squared;
+
+	if (sin_squared >= 1.0f || lights.power <= 0.0f) return 0.0f;
+
+	*one_minus_cos = sin_squared / (1.0f + sqrtf(1.0f - sin_squared));
+
+	return (light_power(sphere) / lights.power) / (2.0f * PI * *one_minus_cos);
+}
+
+// Picks a light by power, samples a direction uniformly inside the cone of its visible cap and
+// traces a shadow ray. The result is weighted against the diffuse bounce with the power heuristic,
+// which is why a bounce that later finds the same light is weighted by light_weight().
+v3 sample_direct_light(Hit* h, v3 albedo)
+{
+	f32 u = sample_dimension(SAMPLE_LIGHT + 2);
+	f32 u1 = sample_dimension(SAMPLE_LIGHT);
+	f32 u2 = sample_dimension(SAMPLE_LIGHT + 1);
+
+	if (lights.count == 0) return vec3(0.0f, 0.0f, 0.0f);
+
+	u32 low = 0;
+	u32 high = lights.count - 1;
+
+	while (low < high)
+	{
+		u32 middle = (low + high) / 2;
+
+		if (lights.cdf[middle] <= u) low = middle + 1;
+		else high = middle;
+	}
+
+	u32	id = lights.ids[low];
+	f32	one_minus_cos;
+	f32	pdf = light_pdf(id, h->point, &one_minus_cos);
+
+	if (pdf <= 0.0f) return vec3(0.0f, 0.0f, 0.0f);
+
+	v3	w = v3_normalized(v3_sub(spheres[id].position, h->point));
+	v3	a = (fabsf(w.x) > 0.9f) ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f);
+	v3	v = v3_normalized(v3_cross(w, a));
+	v3	uu = v3_cross(v, w);
+	f32	cos_theta = 1.0f - u1 * one_minus_cos;
+	f32	sin_theta = sqrtf(ffmax(0.0f, 1.0f - cos_theta * cos_theta));
+	f32	phi = 2.0f * PI * u2;
+	v3	direction = v3_add(v3_add(v3_mulf(uu, cosf(phi) * sin_theta), v3_mulf(v, sinf(phi) * sin_theta)), v3_mulf(w, cos_theta));
+	f32	cos_surface = v3_dot(direction, h->normal);
+
+	if (cos_surface <= 0.0f) return vec3(0.0f, 0.0f, 0.0f);
+
+	Ray	shadow = { h->point, direction, 0 };
+	Hit	blocker;
+
+	if (!intersects_scene(shadow, &blocker, 0.000000001f, FLT_MAX) || blocker.object != id) return vec3(0.0f, 0.0f, 0.0f);
+
+	f32 bsdf_pdf = cos_surface / PI;
+	f32 weight = (pdf * pdf) / (pdf * pdf + bsdf_pdf * bsdf_pdf);
+
+	return v3_mulf(v3_mulv(albedo, blocker.material.albedo), (cos_surface / PI) * weight / pdf);
+}
+
+f32 light_weight(PathState* path, Hit* h)
+{
+	f32 one_minus_cos;
+
+	// Emissive triangles are never sampled directly, so a bounce is the only way to find them.
+	if (path->bsdf_pdf <= 0.0f || h->object >= settings.num_spheres) return 1.0f;
+
+	f32 pdf = light_pdf(h->object, path->last_point, &one_minus_cos);
+
+	return (path->bsdf_pdf * path->bsdf_pdf) / (path->bsdf_pdf * path->bsdf_pdf + pdf * pdf);
+}
+
+v3 checker_albedo(v3 point)
+{
+	f32 sines = (sin(10.0f*point.x) * sin(10.0f*point.y) * sin(10.0f*point.z) + 1.0f);
+	u8  trunc = sines;
+	v3  check_1 = vec3(0.1f, 0.1f, 0.1f);
+	v3  check_2 = vec3(0.9f, 0.9, 0.9f);
+
+	return trunc ? check_1 : check_2;
+}
+
+// Diffuse bounces add a random point in the unit ball to the normal, which leans slightly away
+// from a true cosine lobe. Next-event estimation needs to know the density its bounces were drawn
+// with, so it takes a point on the surface of the ball instead, which is exactly cosine weighted.
+v3 diffuse_direction(Hit* h)
+{
+	return v3_add(h->normal, sample_ball(SAMPLE_DIRECTION, settings.nee));
+}
+
+// Each scattering material picks the direction a path leaves a hit in and how much of the light
+// coming back along it reaches the previous vertex, returning 0 if the path is absorbed instead.
+u32 scatter_metal(Ray* r, Hit* h, v3* attenuation, v3* direction)
+{
+	v3 ray_dir_n = v3_normalized(r->direction);
+	v3 reflected = v3_reflect(ray_dir_n, h->normal);
+	v3 rnd_fuzz = v3_mulf(sample_ball(SAMPLE_DIRECTION, 0), h->material.fuzz);
+
+	*direction = v3_add(reflected, rnd_fuzz);
+	*attenuation = h->material.albedo;
+
+	return v3_dot(*direction, h->normal) > 0.0f;
+}
+
+u32 scatter_checker(Hit* h, v3* attenuation, v3* direction)
+{
+	*direction = diffuse_direction(h);
+	*attenuation = checker_albedo(h->point);
+
+	return 1;
+}
+
+u32 scatter_lambert(Hit* h, v3* attenuation, v3* direction)
+{
+	*direction = diffuse_direction(h);
+	*attenuation = h->material.albedo;
+
+	return 1;
+}
+
+// Moves a path on to its next segment. From settings.roulette_depth bounces on a path survives
+// with probability equal to its brightest throughput channel and is reweighted by the inverse, so
+// dim paths stop early without biasing the estimate.
+u32 continue_path(Ray* r, Hit* h, v3* throughput, v3 attenuation, v3 direction)
+{
+	*throughput = v3_mulv(*throughput, attenuation);
+
+	r->origin = h->point;
+	r->direction = direction;
+	r->bounces++;
+
+	if (settings.roulette_depth && r->bounces >= settings.roulette_depth)
+	{
+		f32 survive = ffmin(ffmax(throughput->x, ffmax(throughput->y, throughput->z)), 0.95f);
+
+		if (sample_dimension(SAMPLE_ROULETTE) >= survive) return 0;
+
+		*throughput = v3_div(*throughput, survive);
+	}
+
+	return 1;
+}
+
+void path_begin(PathState* path)
+{
+	path->radiance = vec3(0.0f, 0.0f, 0.0f);
+	path->throughput = vec3(1.0f, 1.0f, 1.0f);
+	path->last_point = vec3(0.0f, 0.0f, 0.0f);
+	path->bsdf_pdf = 0.0f;
+
+	memset(path->material_bounces, 0, sizeof(path->material_bounces));
+}
+
+// Handles one hit of a path: lights end it, and scattering surfaces pick the next direction
+// (sampling a light directly first when next-event estimation is on). Returns 0 once the path is
+// finished, with everything it gathered in path->radiance. The wavefront renderer calls this for
+// a whole queue of one material type, so the switch is taken the same way every time.
+u32 shade_hit(Ray* r, Hit* h, PathState* path, MaterialType type)
+{
+	Material*	m = &h->material;
+	v3		attenuation;
+	v3		direction;
+	u32		alive = 0;
+
+	if (r->bounces >= settings.max_bounces) return 0;
+
+	if (type == LIGHT)
+	{
+		path->radiance = v3_add(path->radiance, v3_mulf(v3_mulv(path->throughput, m->albedo), light_weight(path, h)));
+		return 0;
+	}
+
+	if (path->material_bounces[type]++ >= settings.material_bounces[type]) return 0;
+
+	sampler_bounce(r->bounces);
+
+	// The bounce balanced against the light sample only counts a light it reaches if it is not the
+	// last one, so at the last bounce neither strategy may add direct light.
+	if (settings.nee && type != METAL && r->bounces + 1 < settings.max_bounces)
+	{
+		v3 albedo = (type == CHECKER) ? checker_albedo(h->point) : m->albedo;
+
+		path->radiance = v3_add(path->radiance, v3_mulv(path->throughput, sample_direct_light(h, albedo)));
+	}
+
+	switch (type)
+	{
+	case METAL:	alive = scatter_metal(r, h, &attenuation, &direction);		break;
+	case CHECKER:	alive = scatter_checker(h, &attenuation, &direction);		break;
+	case LAMBERT:
+	default:	alive = scatter_lambert(h, &attenuation, &direction);		break;
+	}
+
+	if (!alive) return 0;
+
+	path->bsdf_pdf = (settings.nee && type != METAL) ? ffmax(v3_dot(v3_normalized(direction), h->normal), 0.0f) / PI : 0.0f;
+	path->last_point = h->point;
+
+	return continue_path(r, h, &path->throughput, attenuation, direction);
+}
+
+void path_end(Ray* r, u32 where)
+{
+	stats.path_lengths[(r->bounces < STATS_PATH_LENGTHS - 1) ? r->bounces : STATS_PATH_LENGTHS - 1]++;
+	stats.path_ends[where]++;
+}
+
+// Follows a path from its first hit until it escapes to the sky, reaches a light or runs out of
+// bounces, carrying the product of every surface colour so far as its throughput. Each scattering
+// material type also has its own bounce budget.
+v3 trace_path(Ray* r, u32 hit, Hit* h)
+{
+	PathState path;
+
+	path_begin(&path);
+
+	while (hit)
+	{
+		if (!shade_hit(r, h, &path, h->material.type))
+		{
+			path_end(r, h->material.type);
+			return path.radiance;
+		}
+
+		hit = intersects_scene(*r, h, 0.000000001f, FLT_MAX);
+	}
+
+	path_end(r, STATS_ESCAPED);
+
+	return v3_add(path.radiance, v3_mulv(path.throughput, sky(r->direction)));
+}
+
+v3 colour(Ray r)
+{
+	Hit h;
+	u32 hit = intersects_scene(r, &h, 0.000000001f, FLT_MAX);
+
+	return trace_path(&r, hit, &h);
+}
+
+void setup_pallete(void)
+{
+	palette = malloc(NUM_COLOURS * sizeof(v3));
+
+	*(palette + 0) = vec3(255.0f / 255.0f, 107.0f / 255.0f, 107.0f / 255.0f);
+	*(palette + 1) = vec3(85.0f / 255.0f, 98.0f / 255.0f, 112.0f / 255.0f);
+	*(palette + 2) = vec3(78.0f / 255.0f, 205.0f / 255.0f, 198.0f / 255.0f);
+	*(palette + 3) = vec3(198.0f / 255.0f, 77.0f / 255.0f, 88.0f / 255.0f);
+	*(palette + 4) = vec3(199.0f / 255.0f, 244.0f / 255.0f, 100.0f / 255.0f);
+
+	return;
+}
+
+v3 get_random_colour_in_pallete(void)
+{
+	u32 index = (u32)(nrand() * NUM_COLOURS);
+
+	return palette[index];
+}
+
+void scene_grid_cell(SceneGrid* grid, v3 position, s32* column, s32* row)
+{
+	*column = (s32)((position.x - grid->min_x) / grid->cell_size);
+	*row = (s32)((position.z - grid->min_z) / grid->cell_size);
+	*column = *column < 0 ? 0 : (*column >= (s32)grid->columns ? (s32)grid->columns - 1 : *column);
+	*row = *row < 0 ? 0 : (*row >= (s32)grid->rows ? (s32)grid->rows - 1 : *row);
+}
+
+// Every sphere sits on the ground, so a grid over x and z with cells as wide as the largest
+// sphere is enough for an overlap only ever to involve the 3x3 cells around a candidate.
+u32 scene_grid_overlaps(SceneGrid* grid, Sphere* first, Sphere* sphere)
+{
+	s32 column, row;
+
+	scene_grid_cell(grid, sphere->position, &column, &row);
+
+	for (s32 y = row - 1; y <= row + 1; y++)
+	{
+		if (y < 0 || y >= (s32)grid->rows) continue;
+
+		for (s32 x = column - 1; x <= column + 1; x++)
+		{
+			if (x < 0 || x >= (s32)grid->columns) continue;
+
+			for (u32 i = grid->heads[y * grid->columns + x]; i != SCENE_GRID_EMPTY; i = grid->next[i])
+			{
+				v3  dir = v3_sub(sphere->position, (first + i)->position);
+				f32 dis = v3_mag(dir);
+
+				if (dis < (sphere->radius + (first + i)->radius)) return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void scene_grid_insert(SceneGrid* grid, u32 index, v3 position)
+{
+	s32 column, row;
+
+	scene_grid_cell(grid, position, &column, &row);
+
+	grid->next[index] = grid->heads[row * grid->columns + column];
+	grid->heads[row * grid->columns + column] = index;
+}
+
+// Fills one region by rejection sampling. A run of SCENE_MAX_RETRIES rejections shrinks the
+// spheres still to come, so a crowded region always finishes.
+void setup_scene_region(u32 region_index)
+{
+	SceneRegion*	region = scene_builder.regions + region_index;
+	Sphere*		first = scene_builder.spheres + region->first;
+	f32		radius_scale = scene_builder.radius_scale;
+	f32		max_radius = 0.30f * radius_scale;
+	SceneGrid	grid;
+
+	if (region->count == 0) return;
+
+	rng_seed(&rng, scene_builder.seed, RNG_STREAM_SCENE, region_index);
+
+	grid.min_x = region->min_x;
+	grid.min_z = 0.0f;
+	grid.cell_size = 2.0f * max_radius;
+	grid.columns = (u32)ceilf((region->max_x - region->min_x) / grid.cell_size) + 1;
+	grid.rows = (u32)ceilf(2.5f / grid.cell_size) + 1;
+	grid.heads = malloc(grid.columns * grid.rows * sizeof(u32));
+	grid.next = malloc(region->count * sizeof(u32));
+
+	memset(grid.heads, 0xFF, grid.columns * grid.rows * sizeof(u32));
+
+	u32 sphere_count = 0;
+	u32 retries = 0;
+
+	while (1)
+	{
+		if (sphere_count == region->count) break;
+
+		Sphere*		sphere = first + sphere_count;
+		Material*	material = scene_builder.materials + 1 + region->first + sphere_count;
+		f32		xpos = (nrand() * (region->max_x - region->min_x)) + region->min_x;
+
+		sphere->radius = ((nrand() * 0.25f) + 0.05f) * radius_scale;
+		sphere->position.x = xpos;
+		sphere->position.y = sphere->radius;
+		sphere->position.z = (nrand() * 2.5f);
+		sphere->material = 1 + region->first + sphere_count;
+		material->type = (nrand() > 0.60f) ? ((nrand() > 0.35f) ? LIGHT : METAL) : LAMBERT;
+		material->intensity = nrand();
+
+		f32 brightness = 1.0f;
+
+		material->albedo = material->type == METAL ? vec3(brightness, brightness, brightness) : viridis((xpos + 2.5) / 5.0f);
+		material->fuzz = nrand() * 0.25;
+
+		int dismiss = 0;
+
+		f32 inner = 0.00f;
+		f32 outer = 4.05f;
+
+		v3  dir_to_sphere = v3_sub(sphere->position, camera.position);
+		f32 distance_to_cam = v3_mag(dir_to_sphere);
+
+		if (distance_to_cam < inner || distance_to_cam > outer) dismiss = 1;
+
+		// Spheres may not cross into a neighbouring region, which is filled independently.
+		if (scene_builder.region_count > 1 && (xpos - sphere->radius < region->min_x || xpos + sphere->radius > region->max_x)) dismiss = 1;
+
+		if (!dismiss) dismiss = scene_grid_overlaps(&grid, first, sphere);
+
+		if (dismiss == 0)
+		{
+			scene_grid_insert(&grid, sphere_count, sphere->position);
+			sphere_count++;
+			retries = 0;
+		}
+		else if (++retries == SCENE_MAX_RETRIES)
+		{
+			radius_scale *= 0.9f;
+			retries = 0;
+		}
+	}
+
+	free(grid.heads);
+	free(grid.next);
+}
+
+thread_result THREAD_CALL SceneWorker(void* data)
+{
+	while (1)
+	{
+		u32 region = atomic_inc_u32(&scene_builder.next_region) - 1;
+
+		if (region >= scene_builder.region_count) break;
+
+		setup_scene_region(region);
+	}
+
+	return 0;
+}
+
+// Places the ground plane and then the spheres for variant->seed in arrays of the variant's own.
+// The spheres are scaled down once there are more than SCENE_FILL_SPHERES of them so the same
+// patch of ground can hold them. Past SCENE_REGION_SPHERES the patch is split into strips, each
+// given a share of the spheres proportional to how much of it is in range of the camera.
+void generate_scene(SceneVariant* variant)
+{
+	u32 count = settings.num_spheres;
+	u32 region_count = (count + SCENE_REGION_SPHERES - 1) / SCENE_REGION_SPHERES;
+	u64 area_total = 0;
+
+	variant->spheres = malloc(settings.num_spheres * sizeof(Sphere));
+	variant->planes = malloc(sizeof(Plane));
+	variant->materials = malloc((settings.num_spheres + 1) * sizeof(Material));
+
+	variant->planes->normal = vec3(0.0f, 1.0f, 0.0f);
+	variant->planes->centre = vec3(0.0f, GROUND_HEIGHT, 0.0f);
+	variant->planes->radius = 0.0f;
+	variant->planes->material = 0;
+	variant->materials->type = LAMBERT;
+	variant->materials->albedo = vec3(0.2f, 0.2f, 0.2f);
+	variant->materials->intensity = 0.0f;
+	variant->materials->fuzz = 0.0f;
+
+	if (region_count == 0) return;
+
+	scene_builder.seed = variant->seed;
+	scene_builder.spheres = variant->spheres;
+	scene_builder.materials = variant->materials;
+	scene_builder.region_count = region_count;
+	scene_builder.regions = malloc(region_count * sizeof(SceneRegion));
+	scene_builder.next_region = 0;
+	scene_builder.radius_scale = count > SCENE_FILL_SPHERES ? sqrtf((f32)SCENE_FILL_SPHERES / (f32)count) : 1.0f;
+
+	for (u32 i = 0; i < region_count; i++)
+	{
+		SceneRegion* region = scene_builder.regions + i;
+
+		region->min_x = -2.5f + (5.0f * i) / region_count;
+		region->max_x = -2.5f + (5.0f * (i + 1)) / region_count;
+		region->count = 0;
+
+		for (u32 z = 0; z < 64; z++)
+		{
+			for (u32 x = 0; x < 64; x++)
+			{
+				v3 point = vec3(region->min_x + (region->max_x - region->min_x) * (x + 0.5f) / 64.0f, 0.15f, 2.5f * (z + 0.5f) / 64.0f);
+
+				if (v3_mag(v3_sub(point, camera.position)) <= 4.05f) region->count++;
+			}
+		}
+
+		area_total += region->count;
+	}
+
+	u64 area_before = 0;
+
+	for (u32 i = 0; i < region_count; i++)
+	{
+		SceneRegion* region = scene_builder.regions + i;
+		u64 area = region->count;
+
+		region->first = (u32)((count * area_before) / area_total);
+		region->count = (u32)((count * (area_before + area)) / area_total) - region->first;
+		area_before += area;
+	}
+
+	u32 workers = region_count < settings.thread_count ? region_count : settings.thread_count;
+
+	if (workers <= 1)
+	{
+		SceneWorker(NULL);
+	}
+	else
+	{
+		thread_handle* threads = malloc(workers * sizeof(thread_handle));
+
+		for (u32 i = 0; i < workers; i++) threads[i] = thread_create(SceneWorker, NULL);
+		for (u32 i = 0; i < workers; i++) thread_join(threads[i]);
+
+		free(threads);
+	}
+
+	free(scene_builder.regions);
+}
+
+void setup_scene(void)
+{
+	SceneVariant variant;
+
+	variant.seed = SEED;
+	generate_scene(&variant);
+
+	spheres = variant.spheres;
+	planes = variant.planes;
+	materials = variant.materials;
+	material_count = settings.num_spheres + 1;
+	plane_count = 1;
+}
+
+
+u32 has_extension(const char* filename, const char* extension)
+{
+	size_t length = strlen(filename);
+	size_t extension_length = strlen(extension);
+
+	return length >= extension_length && !strcmp(filename + length - extension_length, extension);
+}
+
+void add_mesh_file(const char* path, u32 material, v3 offset, f32 scale)
+{
+	mesh_files = realloc(mesh_files, (mesh_file_count + 1) * sizeof(MeshFile));
+
+	MeshFile* source = mesh_files + mesh_file_count++;
+
+	source->path = path;
+	source->material = material;
+	source->offset = offset;
+	source->scale = scale;
+}
+
+void mesh_reserve(u32 count)
+{
+	if (mesh.triangle_count + count <= mesh.capacity) return;
+
+	while (mesh.triangle_count + count > mesh.capacity) mesh.capacity = mesh.capacity ? mesh.capacity * 2 : 1024;
+
+	mesh.corners = realloc(mesh.corners, (u64)mesh.capacity * 3 * sizeof(v3));
+	mesh.materials = realloc(mesh.materials, (u64)mesh.capacity * sizeof(u32));
+}
+
+void mesh_add_triangle(MeshFile* source, v3 a, v3 b, v3 c)
+{
+	mesh_reserve(1);
+
+	v3* corners = mesh.corners + (u64)mesh.triangle_count * 3;
+
+	corners[0] = v3_add(v3_mulf(a, source->scale), source->offset);
+	corners[1] = v3_add(v3_mulf(b, source->scale), source->offset);
+	corners[2] = v3_add(v3_mulf(c, source->scale), source->offset);
+
+	mesh.materials[mesh.triangle_count++] = source->material;
+}
+
+// Maps a binary mesh and copies its triangles out through the index buffer.
+u32 load_mesh_binary(MeshFile* source)
+{
+	u64	size = 0;
+	u8*	data = map_file_private(source->path, &size);
+	u32	valid = 0;
+
+	if (!data) return 0;
+
+	MeshHeader* header = (MeshHeader*)data;
+
+	if (size >= sizeof(MeshHeader) && header->magic == MESH_MAGIC && header->version == MESH_VERSION &&
+		header->vertex_offset + (u64)header->vertex_count * sizeof(v3) <= size && header->index_offset + (u64)header->triangle_count * 3 * sizeof(u32) <= size)
+	{
+		v3*	vertices = (v3*)(data + header->vertex_offset);
+		u32*	indices = (u32*)(data + header->index_offset);
+
+		mesh_reserve(header->triangle_count);
+
+		valid = 1;
+
+		for (u32 i = 0; valid && i < header->triangle_count; i++, indices += 3)
+		{
+			valid = indices[0] < header->vertex_count && indices[1] < header->vertex_count && indices[2] < header->vertex_count;
+
+			if (valid) mesh_add_triangle(source, vertices[indices[0]], vertices[indices[1]], vertices[indices[2]]);
+		}
+	}
+
+	unmap_file(data, size);
+
+	return valid;
+}
+
+// Reads the v and f lines of a mapped OBJ file and skips everything else. Faces may use the
+// v/vt/vn forms and negative indices, and polygons are split into a fan of triangles.
+u32 load_mesh_obj(MeshFile* source)
+{
+	u64	size = 0;
+	u8*	data = map_file_private(source->path, &size);
+	u64	position = 0;
+	u32	line_number = 0;
+	u32	vertex_capacity = 1024;
+	u32	vertex_count = 0;
+	v3*	vertices;
+	u32	valid = 1;
+	char	line[512];
+
+	if (!data) return 0;
+
+	vertices = malloc(vertex_capacity * sizeof(v3));
+
+	while (valid && position < size)
+	{
+		u64 length = 0;
+
+		while (position + length < size && data[position + length] != '\n') length++;
+
+		u64 copy = (length < sizeof(line) - 1) ? length : sizeof(line) - 1;
+
+		memcpy(line, data + position, copy);
+		line[copy] = 0;
+		position += length + 1;
+		line_number++;
+
+		if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t'))
+		{
+			if (vertex_count == vertex_capacity)
+			{
+				vertex_capacity *= 2;
+				vertices = realloc(vertices, vertex_capacity * sizeof(v3));
+			}
+
+			v3* v = vertices + vertex_count++;
+
+			valid = sscanf(line + 1, "%f %f %f", &v->x, &v->y, &v->z) == 3;
+		}
+		else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t'))
+		{
+			char*	cursor = line + 1;
+			u32	corners = 0;
+			u32	first = 0;
+			u32	previous = 0;
+
+			while (valid)
+			{
+				char*	end;
+				long	index = strtol(cursor, &end, 10);
+
+				if (end == cursor) break;
+
+				for (cursor = end; *cursor && *cursor != ' ' && *cursor != '\t' && *cursor != '\r'; cursor++);
+
+				index = (index < 0) ? (long)vertex_count + index : index - 1;
+				valid = index >= 0 && index < (long)vertex_count;
+
+				if (!valid) break;
+
+				if (corners == 0) first = (u32)index;
+				else if (corners >= 2) mesh_add_triangle(source, vertices[first], vertices[previous], vertices[index]);
+
+				previous = (u32)index;
+				corners++;
+			}
+
+			valid = valid && corners >= 3;
+		}
+	}
+
+	if (!valid) printf("%s:%u: could not read '%c' line\n", source->path, line_number, line[0]);
+
+	free(vertices);
+	unmap_file(data, size);
+
+	return valid;
+}
+
+void mesh_bounds_chunk(u32 chunk)
+{
+	u32 end = (chunk + 1) * MESH_CHUNK;
+
+	for (u32 i = chunk * MESH_CHUNK; i < end && i < mesh.triangle_count; i++)
+	{
+		v3*		c = mesh.corners + (u64)i * 3;
+		BVHPrimitive*	p = mesh.primitives + i;
+
+		p->bounds_min = v3_min(c[0], v3_min(c[1], c[2]));
+		p->bounds_max = v3_max(c[0], v3_max(c[1], c[2]));
+		p->centroid = v3_mulf(v3_add(c[0], v3_add(c[1], c[2])), 1.0f / 3.0f);
+	}
+}
+
+void mesh_soa_chunk(u32 chunk)
+{
+	TriangleSoA*	soa = &mesh.soa;
+	u32		padded = ((mesh.triangle_count + 3) & ~3) + 4;
+	u32		end = (chunk + 1) * MESH_CHUNK;
+
+	for (u32 i = chunk * MESH_CHUNK; i < end && i < padded; i++)
+	{
+		u32	id = mesh.bvh.indices[(i < mesh.triangle_count) ? i : 0];
+		v3*	c = mesh.corners + (u64)id * 3;
+
+		soa->a[0][i] = c[0].x; soa->a[1][i] = c[0].y; soa->a[2][i] = c[0].z;
+		soa->b[0][i] = c[1].x; soa->b[1][i] = c[1].y; soa->b[2][i] = c[1].z;
+		soa->c[0][i] = c[2].x; soa->c[1][i] = c[2].y; soa->c[2][i] = c[2].z;
+		soa->ids[i] = id;
+	}
+}
+
+// Loads every mesh file into the triangle soup, builds its BVH on all threads and lays the
+// triangles out in BVH order. The bounds and the SoA copy are split into chunks across the
+// threads as well, so only the top few levels of the tree are built on one thread.
+u32 setup_meshes(void)
+{
+	if (mesh_file_count == 0) return 1;
+
+	f64 start = get_time();
+
+	for (u32 i = 0; i < mesh_file_count; i++)
+	{
+		MeshFile* source = mesh_files + i;
+
+		if (source->material >= material_count)
+		{
+			printf("Mesh %s uses missing material %u\n", source->path, source->material);
+			return 0;
+		}
+
+		if (!(has_extension(source->path, ".obj") ? load_mesh_obj(source) : load_mesh_binary(source)))
+		{
+			printf("Could not load mesh %s\n", source->path);
+			return 0;
+		}
+	}
+
+	if (mesh.triangle_count == 0) return 1;
+
+	f64	loaded = get_time();
+	u32	count = mesh.triangle_count;
+	u32	padded = ((count + 3) & ~3) + 4;
+	u32	chunks = (padded + MESH_CHUNK - 1) / MESH_CHUNK;
+
+	mesh.primitives = malloc((u64)count * sizeof(BVHPrimitive));
+
+	parallel_for(mesh_bounds_chunk, chunks);
+	build_bvh_parallel(&mesh.bvh, mesh.primitives, count);
+
+	for (u32 axis = 0; axis < 3; axis++)
+	{
+		mesh.soa.a[axis] = alloc_aligned((u64)padded * sizeof(f32), 64);
+		mesh.soa.b[axis] = alloc_aligned((u64)padded * sizeof(f32), 64);
+		mesh.soa.c[axis] = alloc_aligned((u64)padded * sizeof(f32), 64);
+	}
+
+	mesh.soa.ids = alloc_aligned((u64)padded * sizeof(u32), 64);
+	mesh.soa.count = count;
+
+	parallel_for(mesh_soa_chunk, chunks);
+
+	free(mesh.primitives);
+	free(mesh.corners);
+	mesh.primitives = NULL;
+	mesh.corners = NULL;
+
+	printf("%u triangles loaded in %f s, BVH of %u nodes built in %f s\n", count, loaded - start, mesh.bvh.node_count, get_time() - loaded);
+
+	return 1;
+}
+
+// Mesh paths in a scene file are taken relative to the directory the scene file is in.
+const char* scene_relative_path(const char* scene, const char* file)
+{
+	const char*	slash = strrchr(scene, '/');
+	const char*	backslash = strrchr(scene, '\\');
+
+	if (backslash > slash) slash = backslash;
+
+	u64	directory = (slash && file[0] != '/' && file[0] != '\\' && !(file[0] && file[1] == ':')) ? (u64)(slash - scene) + 1 : 0;
+	char*	joined = malloc(directory + strlen(file) + 1);
+
+	memcpy(joined, scene, directory);
+	strcpy(joined + directory, file);
+
+	return joined;
+}
+
+// Reads the text scene format, one element per line:
+//
+//	camera <px> <py> <pz> <tx> <ty> <tz> <v_fov> <aperture>
+//	material <metal|lambert|checker|light> <r> <g> <b> <fuzz> <intensity>
+//	sphere <x> <y> <z> <radius> <material index>
+//	mesh <file.obj or binary mesh> <material index> [<x> <y> <z> <scale>]
+//
+// Blank lines and lines starting with # are skipped.
+u32 load_scene_text(const char* filename, SceneHeader* header)
+{
+	FILE* file = fopen(filename, "r");
+
+	if (!file) return 0;
+
+	u32	sphere_capacity = 1024;
+	u32	material_capacity = 64;
+	u32	plane_capacity = 4;
+	u32	line_number = 0;
+	char	line[512];
+
+	spheres = malloc(sphere_capacity * sizeof(Sphere));
+	materials = malloc(material_capacity * sizeof(Material));
+	planes = malloc(plane_capacity * sizeof(Plane));
+	header->sphere_count = 0;
+	header->material_count = 0;
+	header->plane_count = 0;
+
+	while (fgets(line, sizeof(line), file))
+	{
+		char	keyword[32];
+		char	type[32];
+		u32	valid = 1;
+
+		line_number++;
+
+		if (sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#') continue;
+
+		if (!strcmp(keyword, "camera"))
+		{
+			valid = sscanf(line, "%*s %f %f %f %f %f %f %f %f", &header->cam_position.x, &header->cam_position.y, &header->cam_position.z, &header->cam_target.x, &header->cam_target.y, &header->cam_target.z, &header->v_fov, &header->cam_aperture) == 8;
+		}
+		else if (!strcmp(keyword, "material"))
+		{
+			if (header->material_count == material_capacity)
+			{
+				material_capacity *= 2;
+				materials = realloc(materials, material_capacity * sizeof(Material));
+			}
+
+			Material* m = materials + header->material_count;
+
+			valid = sscanf(line, "%*s %31s %f %f %f %f %f", type, &m->albedo.x, &m->albedo.y, &m->albedo.z, &m->fuzz, &m->intensity) == 6;
+
+			m->type = LAMBERT;
+
+			for (u32 t = 0; t < 4; t++)
+			{
+				if (!strcmp(type, material_names[t])) m->type = (MaterialType)t;
+			}
+
+			header->material_count++;
+		}
+		else if (!strcmp(keyword, "sphere"))
+		{
+			if (header->sphere_count == sphere_capacity)
+			{
+				sphere_capacity *= 2;
+				spheres = realloc(spheres, sphere_capacity * sizeof(Sphere));
+			}
+
+			Sphere* sphere = spheres + header->sphere_count;
+
+			valid = sscanf(line, "%*s %f %f %f %f %u", &sphere->position.x, &sphere->position.y, &sphere->position.z, &sphere->radius, &sphere->material) == 5;
+
+			header->sphere_count++;
+		}
+		else if (!strcmp(keyword, "plane"))
+		{
+			if (header->plane_count == plane_capacity)
+			{
+				plane_capacity *= 2;
+				planes = realloc(planes, plane_capacity * sizeof(Plane));
+			}
+
+			Plane*	plane = planes + header->plane_count;
+			s32	read;
+
+			plane->radius = 0.0f;
+			read = sscanf(line, "%*s %f %f %f %f %f %f %u %f", &plane->normal.x, &plane->normal.y, &plane->normal.z, &plane->centre.x, &plane->centre.y, &plane->centre.z, &plane->material, &plane->radius);
+
+			valid = (read == 7 || read == 8) && v3_dot(plane->normal, plane->normal) > 0.0f;
+
+			if (valid) plane->normal = v3_normalized(plane->normal);
+
+			header->plane_count++;
+		}
+		else if (!strcmp(keyword, "mesh"))
+		{
+			char	mesh_path[256];
+			u32	material = 0;
+			v3	offset = vec3(0.0f, 0.0f, 0.0f);
+			f32	scale = 1.0f;
+			s32	read = sscanf(line, "%*s %255s %u %f %f %f %f", mesh_path, &material, &offset.x, &offset.y, &offset.z, &scale);
+
+			valid = read == 2 || read == 6;
+
+			if (valid) add_mesh_file(scene_relative_path(filename, mesh_path), material, offset, scale);
+		}
+		else
+		{
+			valid = 0;
+		}
+
+		if (!valid)
+		{
+			printf("%s:%u: could not read '%s'\n", filename, line_number, keyword);
+			fclose(file);
+			return 0;
+		}
+	}
+
+	fclose(file);
+
+	return 1;
+}
+
+// Maps a binary scene copy-on-write and points the sphere, plane and material arrays straight
+// into it. Version 1 scenes predate planes, and their header ends where the plane fields start.
+u32 load_scene_binary(const char* filename, SceneHeader* header)
+{
+	u64		size = 0;
+	u8*		data = map_file_private(filename, &size);
+
+	if (!data || size < sizeof(SceneHeader)) return 0;
+
+	*header = *(SceneHeader*)data;
+
+	if (header->magic != SCENE_MAGIC || (header->version != SCENE_VERSION && header->version != 1)) return 0;
+
+	if (header->version == 1)
+	{
+		header->plane_count = 0;
+		header->plane_offset = 0;
+	}
+
+	if (header->material_offset + (u64)header->material_count * sizeof(Material) > size) return 0;
+	if (header->sphere_offset + (u64)header->sphere_count * sizeof(Sphere) > size) return 0;
+	if (header->plane_offset + (u64)header->plane_count * sizeof(Plane) > size) return 0;
+
+	materials = (Material*)(data + header->material_offset);
+	spheres = (Sphere*)(data + header->sphere_offset);
+	planes = (Plane*)(data + header->plane_offset);
+
+	return 1;
+}
+
+u32 load_scene(const char* filename)
+{
+	SceneHeader	header;
+	u32		loaded;
+
+	memset(&header, 0, sizeof(header));
+
+	header.cam_position = settings.cam_position;
+	header.cam_target = settings.cam_target;
+	header.cam_aperture = settings.cam_aperture;
+	header.v_fov = settings.v_fov;
+
+	loaded = has_extension(filename, ".txt") ? load_scene_text(filename, &header) : load_scene_binary(filename, &header);
+
+	if (!loaded || header.sphere_count == 0)
+	{
+		printf("Could not load scene %s\n", filename);
+		return 0;
+	}
+
+	for (u32 i = 0; i < header.sphere_count; i++)
+	{
+		if (spheres[i].material >= header.material_count)
+		{
+			printf("Sphere %u in %s uses missing material %u\n", i, filename, spheres[i].material);
+			return 0;
+		}
+	}
+
+	for (u32 i = 0; i < header.plane_count; i++)
+	{
+		if (planes[i].material >= header.material_count)
+		{
+			printf("Plane %u in %s uses missing material %u\n", i, filename, planes[i].material);
+			return 0;
+		}
+	}
+
+	settings.num_spheres = header.sphere_count;
+	plane_count = header.plane_count;
+	material_count = header.material_count;
+
+	// The scene's camera applies except where the command line set a value explicitly.
+	if (!(settings.camera_from_args & 1)) settings.cam_position = header.cam_position;
+	if (!(settings.camera_from_args & 2)) settings.cam_target = header.cam_target;
+	if (!(settings.camera_from_args & 4)) settings.cam_aperture = header.cam_aperture;
+	if (!(settings.camera_from_args & 8)) settings.v_fov = header.v_fov;
+
+	return 1;
+}
+
+// Writes the scene in memory, either as text or, for any other extension, in the binary format
+// load_scene_binary maps.
+u32 export_scene(const char* filename)
+{
+	FILE* file = fopen(filename, has_extension(filename, ".txt") ? "w" : "wb");
+
+	if (!file) return 0;
+
+	if (has_extension(filename, ".txt"))
+	{
+		fprintf(file, "# Horus scene, seed %i\n", SEED);
+		fprintf(file, "camera %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", settings.cam_position.x, settings.cam_position.y, settings.cam_position.z, settings.cam_target.x, settings.cam_target.y, settings.cam_target.z, settings.v_fov, settings.cam_aperture);
+
+		for (u32 i = 0; i < material_count; i++)
+		{
+			Material* m = materials + i;
+
+			fprintf(file, "material %s %.9g %.9g %.9g %.9g %.9g\n", material_names[m->type], m->albedo.x, m->albedo.y, m->albedo.z, m->fuzz, m->intensity);
+		}
+
+		for (u32 i = 0; i < plane_count; i++)
+		{
+			Plane* plane = planes + i;
+
+			fprintf(file, "plane %.9g %.9g %.9g %.9g %.9g %.9g %u %.9g\n", plane->normal.x, plane->normal.y, plane->normal.z, plane->centre.x, plane->centre.y, plane->centre.z, plane->material, plane->radius);
+		}
+
+		for (u32 i = 0; i < settings.num_spheres; i++)
+		{
+			Sphere* sphere = spheres + i;
+
+			fprintf(file, "sphere %.9g %.9g %.9g %.9g %u\n", sphere->position.x, sphere->position.y, sphere->position.z, sphere->radius, sphere->material);
+		}
+
+		for (u32 i = 0; i < mesh_file_count; i++)
+		{
+			// Written as a full path, as a relative one would be read relative to the scene file.
+			MeshFile*	source = mesh_files + i;
+#ifdef _WIN32
+			char*		path = _fullpath(NULL, source->path, 0);
+#else
+			char*		path = realpath(source->path, NULL);
+#endif // _WIN32
+
+			fprintf(file, "mesh %s %u %.9g %.9g %.9g %.9g\n", path ? path : source->path, source->material, source->offset.x, source->offset.y, source->offset.z, source->scale);
+			free(path);
+		}
+	}
+	else
+	{
+		SceneHeader	header;
+		u8		padding[64];
+
+		memset(&header, 0, sizeof(header));
+		memset(padding, 0, sizeof(padding));
+
+		header.magic = SCENE_MAGIC;
+		header.version = SCENE_VERSION;
+		header.sphere_count = settings.num_spheres;
+		header.material_count = material_count;
+		header.material_offset = (sizeof(SceneHeader) + 63) & ~63ull;
+		header.sphere_offset = (header.material_offset + (u64)material_count * sizeof(Material) + 63) & ~63ull;
+		header.plane_count = plane_count;
+		header.plane_offset = (header.sphere_offset + (u64)settings.num_spheres * sizeof(Sphere) + 63) & ~63ull;
+		header.cam_position = settings.cam_position;
+		header.cam_target = settings.cam_target;
+		header.cam_aperture = settings.cam_aperture;
+		header.v_fov = settings.v_fov;
+
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(padding, header.material_offset - sizeof(header), 1, file);
+		fwrite(materials, sizeof(Material), material_count, file);
+		fwrite(padding, header.sphere_offset - header.material_offset - (u64)material_count * sizeof(Material), 1, file);
+		fwrite(spheres, sizeof(Sphere), settings.num_spheres, file);
+		fwrite(padding, header.plane_offset - header.sphere_offset - (u64)settings.num_spheres * sizeof(Sphere), 1, file);
+		fwrite(planes, sizeof(Plane), plane_count, file);
+
+		if (mesh_file_count) printf("Binary scenes hold spheres only; export to .txt to keep the meshes\n");
+	}
+
+	fclose(file);
+
+	return 1;
+}
+
+s32 intersects(f32 rect_x, f32 rect_y, f32 rect_width, f32 rect_height, f32 circle_x, f32 circle_y, f32 circle_radius)
+{
+	f32 delta_x = circle_x - ffmax(rect_x, ffmin(circle_x, rect_x + rect_width));
+	f32 delta_y = circle_y - ffmax(rect_y, ffmin(circle_y, rect_y + rect_height));
+
+	return ((delta_x * delta_x + delta_y * delta_y) < (circle_radius * circle_radius)) ? 1 : 0;
+}
+
+void setup_bitmap(void)
+{
+	u32 row_size = settings.output_width * 4;
+
+	file_header.type = 0x4d42;
+	file_header.size = (row_size * settings.output_height) + sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+	file_header.res_1 = 0;
+	file_header.res_2 = 0;
+	file_header.offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+
+#ifdef WINDOWED
+	device_context = CreateCompatibleDC(0);
+	bitmap_handle = CreateDIBSection(device_context, (BITMAPINFO*)&file_header, DIB_RGB_COLORS, (void**)&bitmap_image_data, 0, 0);
+#endif // WINDOWED
+
+	info_header.size = sizeof(BitmapInfoHeader);
+	info_header.width = settings.output_width;
+	info_header.height = settings.output_height;
+	info_header.planes = 1;
+	info_header.bits = 32;
+	info_header.compression = 0;
+	info_header.image_size = row_size * settings.output_height;
+	info_header.x_resolution = 0;
+	info_header.y_resolution = 0;
+	info_header.colours = 0;
+	info_header.colours_important = 0;
+
+	bitmap_image_data = alloc_aligned(info_header.image_size, 64);
+}
+
+// Camera rays for a pixel are traced together in packets for their first hit; every bounce after
+// that goes through trace_path() one ray at a time.
+void trace_packet(u32 x, u32 y, u32 first_sample, u32 count, v3* out)
+{
+	RayPacket	packet;
+	Ray		rays[PACKET_MAX];
+	Rng		lane_rng[PACKET_MAX];
+	u64		pixel = ((u64)y * settings.output_width) + x;
+
+	for (u32 lane = 0; lane < count; lane++)
+	{
+		sampler_begin(pixel, first_sample + lane);
+
+		f32 u = (x + sample_dimension(SAMPLE_PIXEL)) / (f32)settings.output_width;
+		f32 v = (y + sample_dimension(SAMPLE_PIXEL + 1)) / (f32)settings.output_height;
+
+		rays[lane] = get_ray(&camera, u, v);
+		packet_set_ray(&packet, lane, rays + lane);
+		lane_rng[lane] = rng;
+	}
+
+	packet_begin(&packet, count, FLT_MAX);
+	intersects_packet(&packet, 0.000000001f, &scene_bvh);
+
+	for (u32 lane = 0; lane < count; lane++)
+	{
+		Hit h;
+		u32 hit = packet_hit(&packet, lane, rays + lane, &h);
+
+		rng = lane_rng[lane];
+		out[lane] = trace_path(rays + lane, hit, &h);
+	}
+}
+
+// Traces samples [first_sample, first_sample + count) of a pixel, at most PACKET_MAX at a time.
+void trace_samples(u32 x, u32 y, u32 first_sample, u32 count, v3* out)
+{
+	if (settings.packet_size)
+	{
+		trace_packet(x, y, first_sample, count, out);
+		return;
+	}
+
+	u64 pixel = ((u64)y * settings.output_width) + x;
+
+	for (u32 i = 0; i < count; i++)
+	{
+		sampler_begin(pixel, first_sample + i);
+
+		f32 u = (x + sample_dimension(SAMPLE_PIXEL)) / (f32)settings.output_width;
+		f32 v = (y + sample_dimension(SAMPLE_PIXEL + 1)) / (f32)settings.output_height;
+
+		Ray r = get_ray(&camera, u, v);
+
+		out[i] = colour(r);
+	}
+}
+
+// Adaptive sampling stops a pixel once the 95% confidence interval of its mean luminance, carried
+// through the gamma 2 display curve, is narrower than the noise threshold. Mean and variance are
+// tracked online with Welford's method.
+u32 pixel_converged(u32 n, f32 mean, f32 m2)
+{
+	if (n < 2) return 0;
+
+	f32 interval = 1.96f * sqrtf((m2 / (n - 1)) / n);
+
+	return interval <= settings.noise_threshold * 2.0f * sqrtf(ffmax(mean, 0.0001f));
+}
+
+// Returns how many samples a pixel should take next: a batch towards the current pass target (or
+// the sample cap), or none once it is there or adaptive sampling has found it converged.
+u32 next_batch(AccumPixel* acc, u32 batch_size)
+{
+	u32 target = (pass_target < settings.num_aa_samples) ? pass_target : settings.num_aa_samples;
+
+	if (acc->samples >= target) return 0;
+
+	if (settings.noise_threshold > 0.0f && acc->samples >= settings.min_samples && pixel_converged(acc->samples, acc->mean, acc->m2)) return 0;
+
+	u32 remaining = target - acc->samples;
+
+	return (remaining < batch_size) ? remaining : batch_size;
+}
+
+void accumulate_samples(AccumPixel* acc, v3* batch, u32 count)
+{
+	for (u32 i = 0; i < count; i++)
+	{
+		v3 c = batch[i];
+		acc->r += c.x;
+		acc->g += c.y;
+		acc->b += c.z;
+
+		if (settings.noise_threshold > 0.0f || settings.denoise)
+		{
+			f32 l = luminance(c);
+			f32 delta = l - acc->mean;
+
+			acc->mean += delta / (acc->samples + i + 1);
+			acc->m2 += delta * (l - acc->mean);
+		}
+	}
+
+	acc->samples += count;
+}
+
+// The sRGB encoding of every 16-bit step of [0, 1], so the curve costs one table read per channel.
+void setup_tone_map(void)
+{
+	if (!tone_lut) tone_lut = malloc(TONE_LUT_SIZE);
+
+	for (u32 i = 0; i < TONE_LUT_SIZE; i++)
+	{
+		f64 x = (f64)i / (TONE_LUT_SIZE - 1);
+		f64 y = (x <= 0.0031308) ? 12.92 * x : 1.055 * pow(x, 1.0 / 2.4) - 0.055;
+
+		tone_lut[i] = (unsigned char)(255.0 * y + 0.5);
+	}
+}
+
+f32 tone_curve(f32 x)
+{
+	switch (settings.tone_map)
+	{
+	case TONE_REINHARD:	return x / (1.0f + x);
+	case TONE_ACES:		return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+	default:		return x;
+	}
+}
+
+u32 tone_encode(f32 x)
+{
+	x = ffmin(ffmax(x, 0.0f), 1.0f);
+
+	if (settings.tone_map == TONE_GAMMA) return (u32)(255.99 * sqrt(x));
+
+	return (unsigned char)tone_lut[(u32)(x * (TONE_LUT_SIZE - 1) + 0.5f)];
+}
+
+void tone_map_pixel(AccumPixel* acc, unsigned char* out, f32 scale)
+{
+	v3 col = vec3(acc->r, acc->g, acc->b);
+	v3 final = (acc->samples > 0) ? v3_div(col, (f32)acc->samples) : col;
+
+	if (scale != 1.0f) final = v3_mulf(final, scale);
+
+	out[0] = (unsigned char)tone_encode(tone_curve(final.z));
+	out[1] = (unsigned char)tone_encode(tone_curve(final.y));
+	out[2] = (unsigned char)tone_encode(tone_curve(final.x));
+	out[3] = 0;
+}
+
+// Turns a tile of the float framebuffer into bitmap pixels, four at a time: the records are
+// transposed into channel vectors, averaged, exposed, put through the curve and clamped. Gamma
+// keeps the old double-precision square root so images match what earlier builds wrote; the
+// other operators look their encoding up in tone_lut. Values above 1 clamp instead of wrapping.
+void tone_map_tile(Tile* tile)
+{
+	u32 width = settings.output_width;
+	f32 scale = powf(2.0f, settings.exposure);
+
+	for (u32 y = tile->y0; y < tile->y1; y++)
+	{
+		AccumPixel*	acc = accumulation + (u64)y * width;
+		unsigned char*	out = (unsigned char*)bitmap_image_data + (u64)y * width * 4;
+		u32		x = tile->x0;
+
+#ifdef SIMD_SSE
+		__m128 zero = _mm_setzero_ps();
+		__m128 one = _mm_set1_ps(1.0f);
+		__m128 exposure = _mm_set1_ps(scale);
+
+		for (; x + 4 <= tile->x1; x += 4)
+		{
+			__m128 r = _mm_loadu_ps(&acc[x + 0].r);
+			__m128 g = _mm_loadu_ps(&acc[x + 1].r);
+			__m128 b = _mm_loadu_ps(&acc[x + 2].r);
+			__m128 n = _mm_loadu_ps(&acc[x + 3].r);
+
+			_MM_TRANSPOSE4_PS(r, g, b, n);
+
+			__m128	samples = _mm_cvtepi32_ps(_mm_castps_si128(n));
+			__m128	some = _mm_cmpgt_ps(samples, zero);
+			__m128	channel[3] = { b, g, r };
+			s32	code[3][4];
+
+			for (u32 c = 0; c < 3; c++)
+			{
+				__m128 v = _mm_or_ps(_mm_and_ps(some, _mm_div_ps(channel[c], samples)), _mm_andnot_ps(some, channel[c]));
+
+				if (scale != 1.0f) v = _mm_mul_ps(v, exposure);
+
+				if (settings.tone_map == TONE_REINHARD)
+				{
+					v = _mm_div_ps(v, _mm_add_ps(one, v));
+				}
+				else if (settings.tone_map == TONE_ACES)
+				{
+					__m128 top = _mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), v), _mm_set1_ps(0.03f)));
+					__m128 bottom = _mm_add_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), v), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+
+					v = _mm_div_ps(top, bottom);
+				}
+
+				v = _mm_min_ps(_mm_max_ps(v, zero), one);
+
+				if (settings.tone_map == TONE_GAMMA)
+				{
+					__m128d scale_255 = _mm_set1_pd(255.99);
+					__m128i low = _mm_cvttpd_epi32(_mm_mul_pd(scale_255, _mm_sqrt_pd(_mm_cvtps_pd(v))));
+					__m128i high = _mm_cvttpd_epi32(_mm_mul_pd(scale_255, _mm_sqrt_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)))));
+
+					_mm_storeu_si128((__m128i*)code[c], _mm_unpacklo_epi64(low, high));
+				}
+				else
+				{
+					s32 index[4];
+
+					_mm_storeu_si128((__m128i*)index, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(TONE_LUT_SIZE - 1)), _mm_set1_ps(0.5f))));
+
+					for (u32 i = 0; i < 4; i++) code[c][i] = (unsigned char)tone_lut[index[i]];
+				}
+			}
+
+			for (u32 i = 0; i < 4; i++)
+			{
+				out[(x + i) * 4 + 0] = (unsigned char)code[0][i];
+				out[(x + i) * 4 + 1] = (unsigned char)code[1][i];
+				out[(x + i) * 4 + 2] = (unsigned char)code[2][i];
+				out[(x + i) * 4 + 3] = 0;
+			}
+		}
+#endif // SIMD_SSE
+
+		for (; x < tile->x1; x++) tone_map_pixel(acc + x, out + x * 4, scale);
+	}
+}
+
+// Adds samples to a pixel's accumulation record until next_batch() says stop. Sample indices
+// carry on from the record, so a pixel rendered over several passes or resumed from a checkpoint
+// sees exactly the samples it would have in one go.
+void render_pixel(u32 x, u32 y)
+{
+	u64		pixel = ((u64)y * settings.output_width) + x;
+	AccumPixel	acc = accumulation[pixel];
+	v3		batch[PACKET_MAX];
+	u32		batch_size = settings.packet_size ? settings.packet_size : 1;
+	u32		count;
+	f64		start = pixel_seconds ? get_time() : 0.0;
+
+	while ((count = next_batch(&acc, batch_size)))
+	{
+		trace_samples(x, y, acc.samples, count, batch);
+		accumulate_samples(&acc, batch, count);
+	}
+
+	accumulation[pixel] = acc;
+
+	if (pixel_seconds) pixel_seconds[pixel] += get_time() - start;
+}
+
+// Intersects every active path, in packets when packets are on. Escaped paths pick up the sky and
+// finish; the rest are counting-sorted by material type into the queue, and the start of each
+// type's run is returned in queue_start.
+u32 wavefront_intersect(Wavefront* wf, u32 active_count, u32* queue_start)
+{
+	u32 counts[4] = { 0, 0, 0, 0 };
+	u32 hit_count = 0;
+	u32 batch_size = settings.packet_size ? settings.packet_size : 1;
+
+	for (u32 first = 0; first < active_count; first += batch_size)
+	{
+		u32 count = (active_count - first < batch_size) ? active_count - first : batch_size;
+		RayPacket packet;
+
+		if (settings.packet_size)
+		{
+			for (u32 lane = 0; lane < count; lane++) packet_set_ray(&packet, lane, &wf->paths[wf->active[first + lane]].ray);
+
+			packet_begin(&packet, count, FLT_MAX);
+			intersects_packet(&packet, 0.000000001f, &scene_bvh);
+		}
+
+		for (u32 lane = 0; lane < count; lane++)
+		{
+			u32		index = wf->active[first + lane];
+			WavefrontPath*	path = wf->paths + index;
+			u32		hit;
+
+			if (settings.packet_size)
+			{
+				hit = packet_hit(&packet, lane, &path->ray, &path->hit);
+			}
+			else
+			{
+				hit = intersects_scene(path->ray, &path->hit, 0.000000001f, FLT_MAX);
+			}
+
+			if (!hit)
+			{
+				path_end(&path->ray, STATS_ESCAPED);
+				wf->results[index] = v3_add(path->state.radiance, v3_mulv(path->state.throughput, sky(path->ray.direction)));
+			}
+			else
+			{
+				counts[path->hit.material.type]++;
+				wf->active[hit_count++] = index;
+			}
+		}
+	}
+
+	queue_start[0] = 0;
+
+	for (u32 type = 0; type < 4; type++) queue_start[type + 1] = queue_start[type] + counts[type];
+
+	u32 fill[4] = { queue_start[0], queue_start[1], queue_start[2], queue_start[3] };
+
+	for (u32 i = 0; i < hit_count; i++)
+	{
+		u32 index = wf->active[i];
+
+		wf->queue[fill[wf->paths[index].hit.material.type]++] = index;
+	}
+
+	return hit_count;
+}
+
+// Shades one material queue in a tight loop, appending the paths that carry on to the active list
+// for the next bounce. Each path brings its own random stream, so it draws exactly the numbers it
+// would have drawn in trace_path().
+u32 wavefront_shade(Wavefront* wf, MaterialType type, u32 first, u32 last, u32 active_count)
+{
+	for (u32 i = first; i < last; i++)
+	{
+		u32		index = wf->queue[i];
+		WavefrontPath*	path = wf->paths + index;
+
+		rng = path->rng;
+
+		if (shade_hit(&path->ray, &path->hit, &path->state, type))
+		{
+			wf->active[active_count++] = index;
+		}
+		else
+		{
+			path_end(&path->ray, type);
+			wf->results[index] = path->state.radiance;
+		}
+
+		path->rng = rng;
+	}
+
+	return active_count;
+}
+
+// Wavefront mode renders a tile in rounds. Each round takes one batch of samples from every pixel
+// still short of its target and traces them together a bounce at a time: intersect every live
+// path, sort the hits by material, shade each material's queue, repeat. The switch over material
+// types runs once per queue rather than once per hit, and the image is bit-identical to the
+// one-path-at-a-time renderer.
+void render_tile_wavefront(Tile* tile)
+{
+	u32		tile_width = tile->x1 - tile->x0;
+	u32		pixel_count = tile_width * (tile->y1 - tile->y0);
+	u32		batch_size = settings.packet_size ? settings.packet_size : 1;
+	Wavefront	wf;
+
+	wf.capacity = pixel_count * batch_size;
+	wf.paths = malloc(wf.capacity * sizeof(WavefrontPath));
+	wf.results = malloc(wf.capacity * sizeof(v3));
+	wf.active = malloc(wf.capacity * sizeof(u32));
+	wf.queue = malloc(wf.capacity * sizeof(u32));
+	wf.pixel_first = malloc(pixel_count * sizeof(u32));
+	wf.pixel_count = malloc(pixel_count * sizeof(u32));
+
+	while (1)
+	{
+		u32 path_count = 0;
+
+		for (u32 p = 0; p < pixel_count; p++)
+		{
+			u32		x = tile->x0 + (p % tile_width);
+			u32		y = tile->y0 + (p / tile_width);
+			u64		pixel = ((u64)y * settings.output_width) + x;
+			AccumPixel*	acc = accumulation + pixel;
+			u32		count = next_batch(acc, batch_size);
+
+			wf.pixel_first[p] = path_count;
+			wf.pixel_count[p] = count;
+
+			for (u32 i = 0; i < count; i++)
+			{
+				WavefrontPath* path = wf.paths + path_count;
+
+				sampler_begin(pixel, acc->samples + i);
+
+				f32 u = (x + sample_dimension(SAMPLE_PIXEL)) / (f32)settings.output_width;
+				f32 v = (y + sample_dimension(SAMPLE_PIXEL + 1)) / (f32)settings.output_height;
+
+				path->ray = get_ray(&camera, u, v);
+				path->rng = rng;
+				path_begin(&path->state);
+
+				wf.active[path_count] = path_count;
+				path_count++;
+			}
+		}
+
+		if (path_count == 0) break;
+
+		u32 active_count = path_count;
+
+		while (active_count)
+		{
+			u32 queue_start[5];
+
+			wavefront_intersect(&wf, active_count, queue_start);
+
+			active_count = 0;
+
+			for (u32 type = 0; type < 4; type++)
+			{
+				active_count = wavefront_shade(&wf, (MaterialType)type, queue_start[type], queue_start[type + 1], active_count);
+			}
+		}
+
+		for (u32 p = 0; p < pixel_count; p++)
+		{
+			u64 pixel = ((u64)(tile->y0 + (p / tile_width)) * settings.output_width) + tile->x0 + (p % tile_width);
+
+			accumulate_samples(accumulation + pixel, wf.results + wf.pixel_first[p], wf.pixel_count[p]);
+		}
+	}
+
+	free(wf.paths);
+	free(wf.results);
+	free(wf.active);
+	free(wf.queue);
+	free(wf.pixel_first);
+	free(wf.pixel_count);
+}
+
+void parallel_rows(void (*row)(u32 y))
+{
+	parallel_for(row, settings.output_height);
+}
+
+void tone_map_row(u32 y)
+{
+	Tile row = { 0, y, settings.output_width, y + 1, 0 };
+
+	tone_map_tile(&row);
+}
+
+// Retraces the first camera rays of every pixel, seeded exactly as its colour samples were, so the
+// features line up with the samples they guide. Lights and the sky count as white albedo, which
+// leaves their colour undivided.
+void denoise_features_row(u32 y)
+{
+	for (u32 x = 0; x < settings.output_width; x++)
+	{
+		u64		pixel = ((u64)y * settings.output_width) + x;
+		FeaturePixel	f = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, 0.0f, 0.0f };
+
+		for (u32 i = 0; i < DENOISE_FEATURE_SAMPLES; i++)
+		{
+			sampler_begin(pixel, i);
+
+			f32	u = (x + sample_dimension(SAMPLE_PIXEL)) / (f32)settings.output_width;
+			f32	v = (y + sample_dimension(SAMPLE_PIXEL + 1)) / (f32)settings.output_height;
+			Ray	r = get_ray(&camera, u, v);
+			Hit	h;
+			v3	albedo = vec3(1.0f, 1.0f, 1.0f);
+
+			if (intersects_scene(r, &h, 0.000000001f, FLT_MAX))
+			{
+				if (h.material.type == CHECKER) albedo = checker_albedo(h.point);
+				else if (h.material.type != LIGHT) albedo = h.material.albedo;
+
+				f.normal = v3_add(f.normal, h.normal);
+				f.depth += h.t * v3_mag(r.direction);
+			}
+
+			f.albedo = v3_add(f.albedo, albedo);
+		}
+
+		f.albedo = v3_div(f.albedo, DENOISE_FEATURE_SAMPLES);
+		f.normal = (v3_mag(f.normal) > 0.0f) ? v3_normalized(f.normal) : f.normal;
+		f.depth /= DENOISE_FEATURE_SAMPLES;
+
+		denoiser.features[pixel] = f;
+
+		AccumPixel*	acc = accumulation + pixel;
+		f32		scale = acc->samples ? 1.0f / acc->samples : 0.0f;
+		f32		albedo = ffmax(luminance(f.albedo), 0.01f);
+
+		denoiser.input[pixel] = vec3(acc->r * scale / ffmax(f.albedo.x, 0.01f), acc->g * scale / ffmax(f.albedo.y, 0.01f), acc->b * scale / ffmax(f.albedo.z, 0.01f));
+		denoiser.variance[pixel] = (acc->samples > 1) ? acc->m2 / ((f32)(acc->samples - 1) * acc->samples) / (albedo * albedo) : 1.0f;
+	}
+}
+
+// One pass of the edge-avoiding a-trous wavelet filter, after SVGF: a 5x5 B3-spline kernel with
+// its taps spread denoiser.step pixels apart, each tap weighted down by how far its normal, depth
+// and albedo are from the centre pixel's and by its luminance difference measured against the
+// centre's noise (the blurred standard deviation of its mean). The variance is filtered with the
+// squared weights, so each pass trusts the colour more than the last; doubling the step every
+// pass covers a wide footprint in a few passes.
+void denoise_filter_row(u32 y)
+{
+	static const f32 kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+	s32 width = settings.output_width;
+	s32 height = settings.output_height;
+	s32 step = denoiser.step;
+
+	for (s32 x = 0; x < width; x++)
+	{
+		u64		pixel = ((u64)y * width) + x;
+		FeaturePixel*	centre = denoiser.features + pixel;
+		f32		l = luminance(denoiser.input[pixel]);
+		f32		blurred = 0.0f;
+		f32		blur_weight = 0.0f;
+		v3		sum = vec3(0.0f, 0.0f, 0.0f);
+		f32		variance = 0.0f;
+		f32		weight_sum = 0.0f;
+
+		for (s32 j = -1; j <= 1; j++)
+		{
+			for (s32 i = -1; i <= 1; i++)
+			{
+				s32 tx = x + i;
+				s32 ty = (s32)y + j;
+
+				if (tx < 0 || tx >= width || ty < 0 || ty >= height) continue;
+
+				f32 w = kernel[2 * i + 2] * kernel[2 * j + 2];
+
+				blurred += w * denoiser.variance[(u64)ty * width + tx];
+				blur_weight += w;
+			}
+		}
+
+		f32 luminance_scale = 1.0f / (DENOISE_SIGMA_LUMINANCE * sqrtf(ffmax(blurred / blur_weight, 0.0f)) + 0.0001f);
+
+		for (s32 j = -2; j <= 2; j++)
+		{
+			s32 ty = (s32)y + j * step;
+
+			if (ty < 0 || ty >= height) continue;
+
+			for (s32 i = -2; i <= 2; i++)
+			{
+				s32 tx = x + i * step;
+
+				if (tx < 0 || tx >= width) continue;
+
+				u64		tap = ((u64)ty * width) + tx;
+				FeaturePixel*	other = denoiser.features + tap;
+				v3		t = denoiser.input[tap];
+				f32		w = kernel[i + 2] * kernel[j + 2];
+
+				if (tap != pixel)
+				{
+					v3  da = v3_sub(centre->albedo, other->albedo);
+					f32 dn = ffmax(v3_dot(centre->normal, other->normal), 0.0f);
+					f32 dz = fabsf(centre->depth - other->depth) / (DENOISE_SIGMA_DEPTH * centre->depth + 0.0001f);
+					f32 dl = fabsf(l - luminance(t)) * luminance_scale;
+
+					w *= expf(-dl - dz - v3_dot(da, da) / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO));
+					w *= (centre->depth > 0.0f) ? powf(dn, DENOISE_SIGMA_NORMAL) : 1.0f;
+				}
+
+				sum = v3_add(sum, v3_mulf(t, w));
+				variance += w * w * denoiser.variance[tap];
+				weight_sum += w;
+			}
+		}
+
+		denoiser.output[pixel] = v3_div(sum, weight_sum);
+		denoiser.variance_out[pixel] = variance / (weight_sum * weight_sum);
+	}
+}
+
+void denoise_result_row(u32 y)
+{
+	for (u32 x = 0; x < settings.output_width; x++)
+	{
+		u64		pixel = ((u64)y * settings.output_width) + x;
+		AccumPixel*	out = denoiser.result + pixel;
+		v3		c = v3_mulv(denoiser.input[pixel], denoiser.features[pixel].albedo);
+
+		*out = accumulation[pixel];
+
+		out->r = c.x * out->samples;
+		out->g = c.y * out->samples;
+		out->b = c.z * out->samples;
+	}
+}
+
+// Denoises the finished render and tone maps the result, every stage spread over the render
+// threads a row at a time. The denoised buffer stays in place of the accumulation until
+// denoise_restore(), so everything that writes the image sees it.
+void denoise_image(void)
+{
+	u64 pixels = (u64)settings.output_width * settings.output_height;
+	f64 start = get_time();
+
+	if (!denoiser.features)
+	{
+		denoiser.features = alloc_aligned(pixels * sizeof(FeaturePixel), 64);
+		denoiser.input = alloc_aligned(pixels * sizeof(v3), 64);
+		denoiser.output = alloc_aligned(pixels * sizeof(v3), 64);
+		denoiser.variance = alloc_aligned(pixels * sizeof(f32), 64);
+		denoiser.variance_out = alloc_aligned(pixels * sizeof(f32), 64);
+		denoiser.result = alloc_aligned(pixels * sizeof(AccumPixel), 64);
+	}
+
+	parallel_rows(denoise_features_row);
+
+	for (u32 i = 0; i < DENOISE_ITERATIONS; i++)
+	{
+		denoiser.step = 1 << i;
+
+		parallel_rows(denoise_filter_row);
+
+		v3* swap = denoiser.input;
+		denoiser.input = denoiser.output;
+		denoiser.output = swap;
+
+		f32* swap_variance = denoiser.variance;
+		denoiser.variance = denoiser.variance_out;
+		denoiser.variance_out = swap_variance;
+	}
+
+	parallel_rows(denoise_result_row);
+
+	denoiser.raw = accumulation;
+	accumulation = denoiser.result;
+
+	parallel_rows(tone_map_row);
+
+	printf("Denoised in %f s\n", get_time() - start);
+}
+
+void denoise_restore(void)
+{
+	if (denoiser.raw) accumulation = denoiser.raw;
+
+	denoiser.raw = NULL;
+}
+
+// A preview pass traces one sample for every preview_block square of pixels, at the centre of the
+// part of the square inside the tile, and fills the whole square with it. The sample is the
+// pixel's first one, but it only goes to the bitmap; the accumulation is left for the real passes.
+void render_tile_preview(Tile* tile)
+{
+	u32	block = preview_block;
+	f32	scale = powf(2.0f, settings.exposure);
+
+	for (u32 y0 = tile->y0; y0 < tile->y1; y0 = (y0 / block + 1) * block)
+	{
+		u32 y1 = ((y0 / block + 1) * block < tile->y1) ? (y0 / block + 1) * block : tile->y1;
+
+		for (u32 x0 = tile->x0; x0 < tile->x1; x0 = (x0 / block + 1) * block)
+		{
+			u32		x1 = ((x0 / block + 1) * block < tile->x1) ? (x0 / block + 1) * block : tile->x1;
+			AccumPixel	acc = { 0 };
+			unsigned char	colour[4];
+			v3		c;
+
+			trace_samples((x0 + x1) / 2, (y0 + y1) / 2, 0, 1, &c);
+
+			acc.r = c.x;
+			acc.g = c.y;
+			acc.b = c.z;
+			acc.samples = 1;
+
+			tone_map_pixel(&acc, colour, scale);
+
+			for (u32 y = y0; y < y1; y++)
+			{
+				unsigned char* out = (unsigned char*)bitmap_image_data + ((u64)y * settings.output_width) * 4;
+
+				for (u32 x = x0; x < x1; x++) memcpy(out + x * 4, colour, 4);
+			}
+		}
+	}
+}
+
+// Samples a tile and tone maps it into the bitmap. With --heatmap every pixel's render time is
+// added to pixel_seconds; a wavefront tile traces all its pixels together, so each of them is
+// charged an equal share of the tile's time instead.
+void render_tile(Tile* tile)
+{
+	if (preview_block)
+	{
+		render_tile_preview(tile);
+		return;
+	}
+
+	if (settings.wavefront)
+	{
+		f64 start = pixel_seconds ? get_time() : 0.0;
+
+		render_tile_wavefront(tile);
+
+		if (pixel_seconds)
+		{
+			f64 share = (get_time() - start) / ((tile->x1 - tile->x0) * (tile->y1 - tile->y0));
+
+			for (u32 y = tile->y0; y < tile->y1; y++)
+			{
+				for (u32 x = tile->x0; x < tile->x1; x++) pixel_seconds[(u64)y * settings.output_width + x] += share;
+			}
+		}
+	}
+	else
+	{
+		for (u32 y = tile->y0; y < tile->y1; y++)
+		{
+			for (u32 x = tile->x0; x < tile->x1; x++)
+			{
+				render_pixel(x, y);
+			}
+		}
+	}
+
+	tone_map_tile(tile);
+}
+
+u32 morton_code(u32 x, u32 y)
+{
+	u32 code = 0;
+
+	for (u32 bit = 0; bit < 16; bit++)
+	{
+		code |= ((x >> bit) & 1) << (2 * bit);
+		code |= ((y >> bit) & 1) << (2 * bit + 1);
+	}
+
+	return code;
+}
+
+s32 compare_tiles(const void* a, const void* b)
+{
+	u32 ma = ((const Tile*)a)->morton;
+	u32 mb = ((const Tile*)b)->morton;
+
+	return (ma > mb) - (ma < mb);
+}
+
+s32 compare_f64(const void* a, const void* b)
+{
+	f64 fa = *(const f64*)a;
+	f64 fb = *(const f64*)b;
+
+	return (fa > fb) - (fa < fb);
+}
+
+s32 tile_pop(TileQueue* queue)
+{
+	while (1)
+	{
+		u64 range = queue->range;
+		u32 top = (u32)range;
+		u32 bottom = (u32)(range >> 32);
+
+		if (top >= bottom) return -1;
+
+		if (atomic_cas_u64(&queue->range, range, ((u64)(bottom - 1) << 32) | top)) return bottom - 1;
+	}
+}
+
+s32 tile_steal(TileQueue* queue)
+{
+	while (1)
+	{
+		u64 range = queue->range;
+		u32 top = (u32)range;
+		u32 bottom = (u32)(range >> 32);
+
+		if (top >= bottom) return -1;
+
+		if (atomic_cas_u64(&queue->range, range, ((u64)bottom << 32) | (top + 1))) return top;
+	}
+}
+
+// Adds a thread's counters into the totals with atomic adds and clears them, so every thread can
+// merge its own without a lock once it has no more tiles.
+void stats_merge(RenderStats* total, RenderStats* local)
+{
+	u64*	from = (u64*)local;
+	u64*	to = (u64*)total;
+
+	for (u32 i = 0; i < sizeof(RenderStats) / sizeof(u64); i++)
+	{
+		if (from[i]) atomic_add_u64(to + i, from[i]);
+	}
+
+	memset(local, 0, sizeof(RenderStats));
+}
+
+// Tells whatever shows the render that a tile of the bitmap has changed. The window invalidates
+// just that rectangle (bitmap rows run bottom up, window rows top down), which WM_PAINT then
+// redraws; headless, the tile is counted for the next preview dump.
+void display_tile(Tile* tile)
+{
+#ifdef WINDOWED
+	RECT rect = { (LONG)tile->x0, (LONG)(settings.output_height - tile->y1), (LONG)tile->x1, (LONG)(settings.output_height - tile->y0) };
+
+	InvalidateRect(hwnd, &rect, FALSE);
+#else
+	(void)tile;
+
+	atomic_inc_u32(&scheduler.tiles_dirty);
+#endif // WINDOWED
+}
+
+thread_result THREAD_CALL TileWorker(void* data)
+{
+	u32 index = *(u32*)data;
+
+	while (1)
+	{
+		semaphore_wait(scheduler.start + index);
+
+		if (scheduler.shutdown) break;
+
+		while (1)
+		{
+			s32 tile = tile_pop(scheduler.queues + index);
+
+			for (u32 i = 1; tile < 0 && i < scheduler.worker_count; i++)
+			{
+				tile = tile_steal(scheduler.queues + (index + i) % scheduler.worker_count);
+			}
+
+			if (tile < 0) break;
+
+			f64 tile_start = get_time();
+			u64 tile_rays = stats.rays;
+
+			render_tile(scheduler.tiles + tile);
+
+			scheduler.tile_seconds[tile] = get_time() - tile_start;
+			scheduler.tile_begin[tile] = tile_start;
+			scheduler.tile_worker[tile] = index;
+			scheduler.tile_rays[tile] = stats.rays - tile_rays;
+			image_stream_tile(scheduler.tiles + tile);
+			atomic_inc_u32(&scheduler.tiles_done);
+			display_tile(scheduler.tiles + tile);
+		}
+
+		scheduler.worker_finish[index] = get_time();
+
+		stats_merge(&scheduler.stats, &stats);
+
+		semaphore_post(&scheduler.finish, 1);
+	}
+
+	return 0;
+}
+
+// Splits the image into tiles in Morton order. PNG files run top down, so for them the order
+// starts from the top of the image and the rows the file needs first are rendered first.
+Tile* build_tiles(u32* count)
+{
+	u32 tile_size = settings.tile_size;
+	u32 tiles_x = (settings.output_width + tile_size - 1) / tile_size;
+	u32 tiles_y = (settings.output_height + tile_size - 1) / tile_size;
+	Tile* tiles = malloc(tiles_x * tiles_y * sizeof(Tile));
+
+	for (u32 ty = 0; ty < tiles_y; ty++)
+	{
+		for (u32 tx = 0; tx < tiles_x; tx++)
+		{
+			Tile* tile = tiles + (ty * tiles_x) + tx;
+
+			tile->x0 = tx * tile_size;
+			tile->y0 = ty * tile_size;
+			tile->x1 = (tile->x0 + tile_size < settings.output_width) ? tile->x0 + tile_size : settings.output_width;
+			tile->y1 = (tile->y0 + tile_size < settings.output_height) ? tile->y0 + tile_size : settings.output_height;
+			tile->morton = morton_code(tx, (settings.image_format == FORMAT_PNG) ? tiles_y - 1 - ty : ty);
+		}
+	}
+
+	qsort(tiles, tiles_x * tiles_y, sizeof(Tile), compare_tiles);
+
+	*count = tiles_x * tiles_y;
+
+	return tiles;
+}
+
+// Builds the tile list once and starts the worker pool.
+void setup_scheduler(void)
+{
+	u32 workers = settings.thread_count;
+
+	scheduler.tiles = build_tiles(&scheduler.tile_count);
+	scheduler.tile_seconds = malloc(scheduler.tile_count * sizeof(f64));
+	scheduler.tile_begin = malloc(scheduler.tile_count * sizeof(f64));
+	scheduler.tile_worker = malloc(scheduler.tile_count * sizeof(u32));
+	scheduler.tile_rays = malloc(scheduler.tile_count * sizeof(u64));
+
+	scheduler.worker_count = workers;
+	scheduler.queues = alloc_aligned(workers * sizeof(TileQueue), 64);
+	scheduler.worker_index = malloc(workers * sizeof(u32));
+	scheduler.worker_finish = malloc(workers * sizeof(f64));
+	scheduler.threads = malloc(workers * sizeof(thread_handle));
+	scheduler.start = malloc(workers * sizeof(Semaphore));
+	scheduler.shutdown = 0;
+
+	semaphore_init(&scheduler.finish);
+
+	for (u32 i = 0; i < workers; i++)
+	{
+		scheduler.worker_index[i] = i;
+		semaphore_init(scheduler.start + i);
+		scheduler.threads[i] = thread_create(TileWorker, scheduler.worker_index + i);
+	}
+}
+
+// Deals each worker a contiguous run of tiles, so neighbouring tiles tend to be rendered by the
+// same thread, and wakes the pool. Workers that run dry steal single tiles from the front of the
+// other queues.
+void render_start(void)
+{
+	u32 workers = settings.thread_count;
+
+	if (!scheduler.threads) setup_scheduler();
+
+	scheduler.tiles_done = 0;
+
+	for (u32 i = 0; i < workers; i++)
+	{
+		u64 top = ((u64)scheduler.tile_count * i) / workers;
+		u64 bottom = ((u64)scheduler.tile_count * (i + 1)) / workers;
+
+		scheduler.queues[i].range = (bottom << 32) | top;
+	}
+
+	scheduler.start_time = get_time();
+
+	for (u32 i = 0; i < workers; i++)
+	{
+		semaphore_post(scheduler.start + i, 1);
+	}
+}
+
+u32 render_done(void)
+{
+	return scheduler.tiles_done == scheduler.tile_count;
+}
+
+// --trace writes a Chrome trace (JSON array format, which chrome://tracing and Perfetto both open)
+// with one track per worker and a span for every tile it rendered, plus a span per pass on a track
+// of its own. The file is flushed after every pass so an interrupted render still leaves a usable
+// trace; trace_close() ends the array.
+void write_trace_pass(void)
+{
+	if (!scheduler.trace)
+	{
+		scheduler.trace = fopen(settings.trace_path, "w");
+
+		if (!scheduler.trace)
+		{
+			printf("Could not write trace %s\n", settings.trace_path);
+			settings.trace_path = NULL;
+			return;
+		}
+
+		scheduler.trace_epoch = scheduler.start_time;
+		scheduler.trace_events = 0;
+
+		fprintf(scheduler.trace, "[\n");
+	}
+
+	FILE*	trace = scheduler.trace;
+	f64	pass_end = scheduler.start_time;
+
+	for (u32 i = 0; i < scheduler.tile_count; i++)
+	{
+		Tile*	tile = scheduler.tiles + i;
+		f64	begin = scheduler.tile_begin[i];
+
+		fprintf(trace, "%s{ \"name\": \"tile %u\", \"cat\": \"tile\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": { \"x0\": %u, \"y0\": %u, \"x1\": %u, \"y1\": %u, \"rays\": %llu } }",
+			scheduler.trace_events++ ? ",\n" : "", i, scheduler.tile_worker[i], (begin - scheduler.trace_epoch) * 1000000.0, scheduler.tile_seconds[i] * 1000000.0,
+			tile->x0, tile->y0, tile->x1, tile->y1, (unsigned long long)scheduler.tile_rays[i]);
+
+		pass_end = (begin + scheduler.tile_seconds[i] > pass_end) ? begin + scheduler.tile_seconds[i] : pass_end;
+	}
+
+	fprintf(trace, ",\n{ \"name\": \"pass\", \"cat\": \"pass\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": { \"samples\": %u } }",
+		scheduler.worker_count, (scheduler.start_time - scheduler.trace_epoch) * 1000000.0, (pass_end - scheduler.start_time) * 1000000.0, pass_target);
+
+	fflush(trace);
+}
+
+void trace_close(void)
+{
+	if (!scheduler.trace) return;
+
+	for (u32 i = 0; i <= scheduler.worker_count; i++)
+	{
+		char name[32];
+
+		if (i < scheduler.worker_count) snprintf(name, sizeof(name), "worker %u", i);
+		else snprintf(name, sizeof(name), "passes");
+
+		fprintf(scheduler.trace, ",\n{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": { \"name\": \"%s\" } }", i, name);
+	}
+
+	fprintf(scheduler.trace, "\n]\n");
+	fclose(scheduler.trace);
+
+	scheduler.trace = NULL;
+}
+
+// Waits for every worker to finish the frame and works out how evenly it was spread: tail latency
+// is the time between the first worker running out of tiles and the last one finishing.
+void render_finish(void)
+{
+	f64 first_finish = FLT_MAX;
+	f64 last_finish = 0.0;
+
+	for (u32 i = 0; i < scheduler.worker_count; i++)
+	{
+		semaphore_wait(&scheduler.finish);
+	}
+
+	for (u32 i = 0; i < scheduler.worker_count; i++)
+	{
+		first_finish = (scheduler.worker_finish[i] < first_finish) ? scheduler.worker_finish[i] : first_finish;
+		last_finish = (scheduler.worker_finish[i] > last_finish) ? scheduler.worker_finish[i] : last_finish;
+	}
+
+	if (settings.trace_path) write_trace_pass();
+
+	qsort(scheduler.tile_seconds, scheduler.tile_count, sizeof(f64), compare_f64);
+
+	scheduler.tail_latency = last_finish - first_finish;
+	scheduler.tile_p50 = scheduler.tile_seconds[scheduler.tile_count / 2];
+	scheduler.tile_p99 = scheduler.tile_seconds[(scheduler.tile_count * 99) / 100];
+	scheduler.tile_max = scheduler.tile_seconds[scheduler.tile_count - 1];
+}
+
+void render_shutdown(void)
+{
+	if (!scheduler.threads) return;
+
+	scheduler.shutdown = 1;
+
+	for (u32 i = 0; i < scheduler.worker_count; i++)
+	{
+		semaphore_post(scheduler.start + i, 1);
+	}
+
+	for (u32 i = 0; i < scheduler.worker_count; i++)
+	{
+		thread_join(scheduler.threads[i]);
+		semaphore_destroy(scheduler.start + i);
+	}
+
+	semaphore_destroy(&scheduler.finish);
+
+	free(scheduler.start);
+	free(scheduler.threads);
+	free(scheduler.worker_finish);
+	free(scheduler.worker_index);
+	free(scheduler.tile_seconds);
+	free(scheduler.tile_begin);
+	free(scheduler.tile_worker);
+	free(scheduler.tile_rays);
+	free(scheduler.tiles);
+
+	free_aligned(scheduler.queues);
+
+	scheduler.threads = NULL;
+}
+
+// Picks the next pass of a still image, returning 0 once it has every sample. A checkpointed
+// render takes --pass samples at a time and anything else takes them all at once. With --preview
+// a 1/16 and then a 1/4 resolution pass come first, and the samples after them double every pass
+// from one, so the picture sharpens quickly and then keeps refining.
+u32 next_pass(void)
+{
+	if (settings.preview && pass_target == 0 && preview_block != PREVIEW_FINE_BLOCK)
+	{
+		preview_block = preview_block ? PREVIEW_FINE_BLOCK : PREVIEW_COARSE_BLOCK;
+		return 1;
+	}
+
+	preview_block = 0;
+
+	if (pass_target >= settings.num_aa_samples) return 0;
+
+	if (settings.preview) pass_target = pass_target ? pass_target * 2 : 1;
+	else pass_target += settings.checkpoint_path ? settings.pass_samples : settings.num_aa_samples;
+
+	return 1;
+}
+
+// Starts the pass next_pass() picked, opening the image stream first when it is the last one.
+u32 start_pass(void)
+{
+	if (!preview_block && pass_target >= settings.num_aa_samples && !settings.denoise && !image_stream_begin()) return 0;
+
+	render_start();
+
+	return 1;
+}
+
+// Hashes everything that decides the image, scene included, apart from the sample count. A
+// checkpoint stores it so that only the render that started it can add samples to it.
+u64 image_fingerprint(void)
+{
+	u64 h = 0xCBF29CE484222325ull;
+	s32 seed = SEED;
+
+	h = fnv1a(&settings.output_width, sizeof(u32), h);
+	h = fnv1a(&settings.output_height, sizeof(u32), h);
+	h = fnv1a(&settings.min_samples, sizeof(u32), h);
+	h = fnv1a(&settings.noise_threshold, sizeof(f32), h);
+	h = fnv1a(&settings.max_bounces, sizeof(u32), h);
+	h = fnv1a(&settings.roulette_depth, sizeof(u32), h);
+	h = fnv1a(settings.material_bounces, sizeof(settings.material_bounces), h);
+	h = fnv1a(&settings.nee, sizeof(u32), h);
+	h = fnv1a(&settings.sampler, sizeof(SamplerType), h);
+	h = fnv1a(&seed, sizeof(s32), h);
+	h = fnv1a(&camera, sizeof(Camera), h);
+	h = fnv1a(spheres, (u64)settings.num_spheres * sizeof(Sphere), h);
+	h = fnv1a(planes, (u64)plane_count * sizeof(Plane), h);
+	h = fnv1a(materials, (u64)material_count * sizeof(Material), h);
+
+	for (u32 axis = 0; axis < 3 && mesh.triangle_count; axis++)
+	{
+		h = fnv1a(mesh.soa.a[axis], (u64)mesh.triangle_count * sizeof(f32), h);
+		h = fnv1a(mesh.soa.b[axis], (u64)mesh.triangle_count * sizeof(f32), h);
+		h = fnv1a(mesh.soa.c[axis], (u64)mesh.triangle_count * sizeof(f32), h);
+	}
+
+	return h;
+}
+
+// Coordinator and workers must render the same thing, so a worker introduces itself with a hash
+// of everything that decides the image, sample count included, and is turned away if it differs.
+// Tiles are handed out by index, so both sides also need the same tile size.
+u64 render_fingerprint(void)
+{
+	u64 h = image_fingerprint();
+
+	h = fnv1a(&settings.num_aa_samples, sizeof(u32), h);
+	h = fnv1a(&settings.tile_size, sizeof(u32), h);
+
+	return h;
+}
+
+u32 net_send_message(socket_handle socket, NetMessageType type, u32 tile, Tile* area)
+{
+	NetMessage message;
+
+	memset(&message, 0, sizeof(message));
+
+	message.magic = NET_MAGIC;
+	message.type = type;
+	message.tile = tile;
+	message.fingerprint = net_fingerprint;
+
+	if (area)
+	{
+		message.x0 = area->x0;
+		message.y0 = area->y0;
+		message.x1 = area->x1;
+		message.y1 = area->y1;
+	}
+
+	return net_send(socket, &message, sizeof(message));
+}
+
+void coordinator_drop(NetConnection* connection, u32* holders, u8* done)
+{
+	if (connection->tile >= 0 && !done[connection->tile]) holders[connection->tile]--;
+
+	net_close(connection->socket);
+
+	connection->socket = INVALID_SOCKET_HANDLE;
+	connection->tile = -1;
+	connection->ready = 0;
+}
+
+// Hands tiles out over sockets and gathers the workers' float accumulation records into the frame.
+// Every connection holds at most one tile. A worker that disconnects gives its tile back; once
+// nothing is left to hand out, idle workers also take a copy of any tile that has been out for
+// NET_SLOW_FACTOR times the average tile time, and whichever copy comes back first is kept. Tiles
+// are rendered deterministically, so the copies are identical anyway. Each result carries the
+// tile's ray and path counters after its pixels, and those of the kept copy go into the totals.
+u32 run_coordinator(void)
+{
+	u32		tile_count;
+	Tile*		tiles = build_tiles(&tile_count);
+	u8*		done = calloc(tile_count, 1);
+	u32*		holders = calloc(tile_count, sizeof(u32));
+	f64*		assigned = calloc(tile_count, sizeof(f64));
+	AccumPixel*	buffer = malloc((u64)settings.tile_size * settings.tile_size * sizeof(AccumPixel));
+	NetConnection	connections[NET_MAX_CONNECTIONS];
+	u32		connection_count = 0;
+	u32		tiles_done = 0;
+	u32		next_tile = 0;
+	u32		reassigned = 0;
+	u32		workers_seen = 0;
+	f64		tile_time_total = 0.0;
+	socket_handle	listener = net_open(settings.coordinator_address, 1);
+
+	if (listener == INVALID_SOCKET_HANDLE)
+	{
+		printf("Could not listen on %s\n", settings.coordinator_address);
+		return 0;
+	}
+
+	net_fingerprint = render_fingerprint();
+
+	printf("Coordinating %u tiles on %s\n", tile_count, settings.coordinator_address);
+
+	while (tiles_done < tile_count)
+	{
+		fd_set		readable;
+		socket_handle	highest = listener;
+		struct timeval	timeout = { 0, 100000 };
+
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+
+		for (u32 i = 0; i < connection_count; i++)
+		{
+			if (connections[i].socket == INVALID_SOCKET_HANDLE) continue;
+
+			FD_SET(connections[i].socket, &readable);
+			highest = (connections[i].socket > highest) ? connections[i].socket : highest;
+		}
+
+		if (select((int)highest + 1, &readable, NULL, NULL, &timeout) < 0) continue;
+
+		if (FD_ISSET(listener, &readable))
+		{
+			socket_handle accepted = accept(listener, NULL, NULL);
+			u32 slot = 0;
+
+			while (slot < connection_count && connections[slot].socket != INVALID_SOCKET_HANDLE) slot++;
+
+			if (accepted != INVALID_SOCKET_HANDLE && slot < NET_MAX_CONNECTIONS)
+			{
+				net_set_timeout(accepted, NET_TIMEOUT);
+
+				connections[slot].socket = accepted;
+				connections[slot].tile = -1;
+				connections[slot].ready = 0;
+
+				if (slot == connection_count) connection_count++;
+			}
+			else if (accepted != INVALID_SOCKET_HANDLE)
+			{
+				net_close(accepted);
+			}
+		}
+
+		for (u32 i = 0; i < connection_count; i++)
+		{
+			NetConnection*	connection = connections + i;
+			NetMessage	message;
+
+			if (connection->socket == INVALID_SOCKET_HANDLE || !FD_ISSET(connection->socket, &readable)) continue;
+
+			if (!net_recv(connection->socket, &message, sizeof(message)) || message.magic != NET_MAGIC)
+			{
+				coordinator_drop(connection, holders, done);
+				continue;
+			}
+
+			if (message.type == NET_HELLO)
+			{
+				if (message.fingerprint != net_fingerprint)
+				{
+					printf("Rejected a worker rendering different settings\n");
+					net_send_message(connection->socket, NET_REJECT, 0, NULL);
+					coordinator_drop(connection, holders, done);
+					continue;
+				}
+
+				connection->ready = 1;
+				workers_seen++;
+			}
+			else if (message.type == NET_RESULT && message.tile < tile_count && (s32)message.tile == connection->tile)
+			{
+				Tile*		tile = tiles + message.tile;
+				u32		width = tile->x1 - tile->x0;
+				u64		size = (u64)width * (tile->y1 - tile->y0) * sizeof(AccumPixel);
+				RenderStats	tile_stats;
+
+				if (!net_recv(connection->socket, buffer, size) || !net_recv(connection->socket, &tile_stats, sizeof(RenderStats)))
+				{
+					coordinator_drop(connection, holders, done);
+					continue;
+				}
+
+				if (!done[message.tile])
+				{
+					for (u32 y = tile->y0; y < tile->y1; y++)
+					{
+						memcpy(accumulation + ((u64)y * settings.output_width) + tile->x0, buffer + (y - tile->y0) * width, width * sizeof(AccumPixel));
+					}
+
+					tone_map_tile(tile);
+					image_stream_tile(tile);
+					display_tile(tile);
+					stats_merge(&scheduler.stats, &tile_stats);
+
+					done[message.tile] = 1;
+					tiles_done++;
+					tile_time_total += get_time() - assigned[message.tile];
+				}
+
+				connection->tile = -1;
+			}
+			else
+			{
+				coordinator_drop(connection, holders, done);
+			}
+		}
+
+		for (u32 i = 0; i < connection_count; i++)
+		{
+			NetConnection*	connection = connections + i;
+			s32		tile = -1;
+
+			if (connection->socket == INVALID_SOCKET_HANDLE || !connection->ready || connection->tile >= 0) continue;
+
+			while (next_tile < tile_count && (done[next_tile] || holders[next_tile])) next_tile++;
+
+			for (u32 t = 0; t < next_tile && tile < 0; t++)
+			{
+				if (!done[t] && !holders[t]) tile = t;
+			}
+
+			if (tile < 0 && next_tile < tile_count) tile = next_tile;
+
+			if (tile < 0 && tiles_done > 0)
+			{
+				f64 slow = NET_SLOW_FACTOR * (tile_time_total / tiles_done);
+				f64 oldest = get_time() - slow;
+
+				for (u32 t = 0; t < tile_count; t++)
+				{
+					if (!done[t] && holders[t] == 1 && assigned[t] < oldest)
+					{
+						tile = t;
+						oldest = assigned[t];
+					}
+				}
+
+				if (tile >= 0) reassigned++;
+			}
+
+			if (tile < 0) continue;
+
+			if (!net_send_message(connection->socket, NET_TILE, tile, tiles + tile))
+			{
+				coordinator_drop(connection, holders, done);
+				continue;
+			}
+
+			if (!holders[tile]) assigned[tile] = get_time();
+
+			holders[tile]++;
+			connection->tile = tile;
+		}
+	}
+
+	for (u32 i = 0; i < connection_count; i++)
+	{
+		if (connections[i].socket == INVALID_SOCKET_HANDLE) continue;
+
+		net_send_message(connections[i].socket, NET_DONE, 0, NULL);
+		net_close(connections[i].socket);
+	}
+
+	net_close(listener);
+
+	printf("%u tiles from %u workers, %u slow tiles sent twice\n", tile_count, workers_seen, reassigned);
+
+	free(buffer);
+	free(assigned);
+	free(holders);
+	free(done);
+	free(tiles);
+
+	return 1;
+}
+
+// Each worker thread keeps its own connection to the coordinator, so a worker process looks like
+// thread_count separate workers and takes that many tiles at a time.
+thread_result THREAD_CALL NetWorker(void* data)
+{
+	socket_handle	connection = INVALID_SOCKET_HANDLE;
+	AccumPixel*	buffer = malloc((u64)settings.tile_size * settings.tile_size * sizeof(AccumPixel));
+	u32*		rendered = data;
+
+	for (u32 attempt = 0; attempt < NET_CONNECT_ATTEMPTS && connection == INVALID_SOCKET_HANDLE; attempt++)
+	{
+		connection = net_open(settings.worker_address, 0);
+
+		if (connection == INVALID_SOCKET_HANDLE) sleep_milliseconds(100);
+	}
+
+	if (connection != INVALID_SOCKET_HANDLE && net_send_message(connection, NET_HELLO, 0, NULL))
+	{
+		NetMessage message;
+
+		memset(&message, 0, sizeof(message));
+
+		while (net_recv(connection, &message, sizeof(message)) && message.magic == NET_MAGIC && message.type == NET_TILE)
+		{
+			Tile	tile = { message.x0, message.y0, message.x1, message.y1, 0 };
+			u32	width = tile.x1 - tile.x0;
+
+			if (tile.x1 > settings.output_width || tile.y1 > settings.output_height || tile.x0 >= tile.x1 || tile.y0 >= tile.y1 || width * (tile.y1 - tile.y0) > settings.tile_size * settings.tile_size) break;
+
+			for (u32 y = tile.y0; y < tile.y1; y++)
+			{
+				memset(accumulation + ((u64)y * settings.output_width) + tile.x0, 0, width * sizeof(AccumPixel));
+			}
+
+			memset(&stats, 0, sizeof(RenderStats));
+
+			render_tile(&tile);
+
+			for (u32 y = tile.y0; y < tile.y1; y++)
+			{
+				memcpy(buffer + (y - tile.y0) * width, accumulation + ((u64)y * settings.output_width) + tile.x0, width * sizeof(AccumPixel));
+			}
+
+			if (!net_send_message(connection, NET_RESULT, message.tile, &tile)) break;
+			if (!net_send(connection, buffer, (u64)width * (tile.y1 - tile.y0) * sizeof(AccumPixel))) break;
+			if (!net_send(connection, &stats, sizeof(RenderStats))) break;
+
+			atomic_inc_u32(rendered);
+		}
+
+		if (message.type == NET_REJECT) printf("Coordinator is rendering different settings\n");
+	}
+
+	if (connection != INVALID_SOCKET_HANDLE) net_close(connection);
+
+	free(buffer);
+
+	return 0;
+}
+
+u32 run_worker(void)
+{
+	thread_handle*	threads = malloc(settings.thread_count * sizeof(thread_handle));
+	volatile u32	rendered = 0;
+
+	pass_target = settings.num_aa_samples;
+	net_fingerprint = render_fingerprint();
+
+	for (u32 i = 0; i < settings.thread_count; i++) threads[i] = thread_create(NetWorker, (void*)&rendered);
+	for (u32 i = 0; i < settings.thread_count; i++) thread_join(threads[i]);
+
+	printf("Rendered %u tiles for %s\n", rendered, settings.worker_address);
+
+	free(threads);
+
+	return rendered > 0;
+}
+
+void setup_default_settings(void)
+{
+#ifndef SEED_OVERRIDE
+	time_t t = time(NULL);
+	struct tm tm = *localtime(&t);
+	SEED = tm.tm_hour * tm.tm_min * tm.tm_sec;
+#else
+	SEED = SEED_OVERRIDE;
+#endif // !SEED_OVERRRIDE
+
+	settings.output_width = OUTPUT_WIDTH;
+	settings.output_height = OUTPUT_HEIGHT;
+	settings.num_aa_samples = NUM_AA_SAMPLES;
+	settings.min_samples = MIN_AA_SAMPLES;
+	settings.pass_samples = PASS_SAMPLES;
+	settings.checkpoint_interval = CHECKPOINT_INTERVAL;
+	settings.max_bounces = MAX_BOUNCES;
+	settings.roulette_depth = ROULETTE_DEPTH;
+	settings.material_bounces[METAL] = MAX_BOUNCES;
+	settings.material_bounces[LAMBERT] = MAX_BOUNCES;
+	settings.material_bounces[CHECKER] = MAX_BOUNCES;
+	settings.material_bounces[LIGHT] = MAX_BOUNCES;
+	settings.num_spheres = NUM_SPHERES;
+	settings.thread_count = 1;
+	settings.cam_position = vec3(CAM_POS_X, CAM_POS_Y, CAM_POS_Z);
+	settings.cam_target = vec3(CAM_TARGET_X, CAM_TARGET_Y, CAM_TARGET_Z);
+	settings.cam_aperture = CAM_APERTURE;
+	settings.v_fov = V_FOV;
+	settings.tolerance = BENCHMARK_TOLERANCE;
+	settings.output_path = OUTPUT_PATH;
+	settings.packet_size = PACKET_SIZE;
+	settings.tile_size = TILE_SIZE;
+
+#ifdef MULTITHREADED
+	settings.thread_count = get_cpu_count();
+#endif // MULTITHREADED
+}
+
+void print_usage(const char* program)
+{
+	printf("usage: %s [options]\n\n", program);
+	printf("  --width <pixels>            output width (%i)\n", OUTPUT_WIDTH);
+	printf("  --height <pixels>           output height (%i)\n", OUTPUT_HEIGHT);
+	printf("  --samples <count>           samples per pixel (%i)\n", NUM_AA_SAMPLES);
+	printf("  --adaptive <threshold>      stop sampling a pixel once its noise is below threshold (0 to 1)\n");
+	printf("  --min-samples <count>       samples every pixel takes in adaptive mode (%i)\n", MIN_AA_SAMPLES);
+	printf("  --checkpoint <file>         accumulate into a resumable checkpoint file\n");
+	printf("  --checkpoint-interval <s>   seconds between checkpoint flushes (%i)\n", CHECKPOINT_INTERVAL);
+	printf("  --pass <samples>            samples per progressive pass when checkpointing (%i)\n", PASS_SAMPLES);
+	printf("  --bounces <count>           maximum bounces per path (%i)\n", MAX_BOUNCES);
+	printf("  --roulette <bounces>        start russian roulette after this many bounces, 0 for off (%i)\n", ROULETTE_DEPTH);
+	printf("  --material-bounces <m> <l> <c>  bounce budget for metal, lambert and checker surfaces\n");
+	printf("  --spheres <count>           spheres in the generated scene (%i)\n", NUM_SPHERES);
+	printf("  --threads <count>           render threads (one per cpu)\n");
+	printf("  --seed <value>              scene and sampling seed\n");
+	printf("  --seeds <list>              render a variant per seed in one process, e.g. 1-100,250,300-310\n");
+	printf("  --camera <x> <y> <z>        camera position\n");
+	printf("  --target <x> <y> <z>        camera target\n");
+	printf("  --aperture <size>           camera aperture (%f)\n", CAM_APERTURE);
+	printf("  --fov <degrees>             vertical field of view (%i)\n", V_FOV);
+	printf("  --scene <file>              render a binary scene, or a .txt scene\n");
+	printf("  --export <file>             write the scene (binary, or text for .txt) and exit\n");
+	printf("  --mesh <file> <material>    add a triangle mesh (.obj or binary) using a scene material\n");
+	printf("  --mesh-transform <x> <y> <z> <scale>  scale and move the last --mesh\n");
+	printf("  --output <directory>        render directory (%s)\n", OUTPUT_PATH);
+	printf("  --image <file>              write the render here instead, format from the extension\n");
+	printf("  --format <type>             bmp, png, pfm or exr (bmp)\n");
+	printf("  --tonemap <operator>        gamma, srgb, reinhard or aces (gamma)\n");
+	printf("  --exposure <stops>          scale the image by 2^stops before tone mapping (0)\n");
+	printf("  --denoise                   filter the finished render guided by albedo, normal and depth\n");
+	printf("  --preview                   show 1/16 and 1/4 resolution previews first, then refine in doubling passes\n");
+	printf("  --packet <size>             camera rays per packet, 4, 8 or 16, 0 for single rays (%i)\n", PACKET_SIZE);
+	printf("  --tile <pixels>             tile edge length for the scheduler (%i)\n", TILE_SIZE);
+	printf("  --nee                       sample lights directly at diffuse hits, combined with MIS\n");
+	printf("  --sampler <type>            random, sobol or bluenoise (random)\n");
+	printf("  --frames <count>            render an animation, orbiting the camera unless keyframed\n");
+	printf("  --animation <file>          camera and sphere keyframes for an animation\n");
+	printf("  --benchmark <file.json>     time the benchmark scenes at 1..threads threads and exit\n");
+	printf("  --baseline <file.json>      flag benchmark runs slower than this earlier result\n");
+	printf("  --tolerance <fraction>      slowdown allowed against the baseline (%.2f)\n", BENCHMARK_TOLERANCE);
+	printf("  --coordinator <address>     hand tiles to workers at port, host:port or unix:<path>\n");
+	printf("  --worker <address>          render tiles for a coordinator, one connection per thread\n");
+	printf("  --wavefront                 trace each tile as a wavefront with per-material shading queues\n");
+	printf("  --trace <file.json>         write per-tile timings as a Chrome trace\n");
+	printf("  --heatmap                   write a map of per-pixel render time next to the render\n");
+	printf("  --wavefront-benchmark       render with and without --wavefront, compare and exit\n");
+	printf("  --verify                    check SIMD and BVH hits against the scalar path and exit\n");
+	printf("  --expect-hash <hex>         fail unless the image hashes to this value\n");
+}
+
+// Reads a comma separated list of seeds and inclusive first-last ranges into settings.seeds.
+u32 parse_seed_list(const char* list)
+{
+	const char* cursor = list;
+
+	while (*cursor)
+	{
+		char*	end;
+		s32	first = (s32)strtol(cursor, &end, 10);
+		s32	last = first;
+
+		if (end == cursor) return 0;
+
+		if (*end == '-')
+		{
+			cursor = end + 1;
+			last = (s32)strtol(cursor, &end, 10);
 
-			v3 dir = v3_sub(h->point, s.position);
-			h->normal = v3_div(dir, s.radius);
+			if (end == cursor || last < first) return 0;
+		}
 
-			return 1;
+		if (*end && *end != ',') return 0;
+
+		for (s32 seed = first; ; seed++)
+		{
+			settings.seeds = realloc(settings.seeds, (settings.seed_count + 1) * sizeof(s32));
+			settings.seeds[settings.seed_count++] = seed;
+
+			if (seed == last) break;
 		}
+
+		cursor = *end ? end + 1 : end;
 	}
 
-	return 0;
+	return settings.seed_count > 0;
 }
 
-u32 intersects_all(Ray r, Hit* h, float t_min, float t_max, Sphere* first, s32 count)
+u32 parse_args(s32 argc, char** argv)
 {
-	Hit		temp;
-	u32		hit_something = 0;
-	f32		closest = t_max;
+	const char* format = NULL;
+	const char* tone_map = NULL;
+	const char* sampler = NULL;
+	const char* seed_list = NULL;
 
-	Sphere* sphere_end = (first + (count - 1));
+	for (s32 i = 1; i < argc; i++)
+	{
+		char*	arg = argv[i];
+		s32	remaining = argc - i - 1;
+
+		if (!strcmp(arg, "--width") && remaining >= 1)			settings.output_width = atoi(argv[++i]);
+		else if (!strcmp(arg, "--height") && remaining >= 1)		settings.output_height = atoi(argv[++i]);
+		else if (!strcmp(arg, "--samples") && remaining >= 1)		settings.num_aa_samples = atoi(argv[++i]);
+		else if (!strcmp(arg, "--adaptive") && remaining >= 1)		settings.noise_threshold = (f32)atof(argv[++i]);
+		else if (!strcmp(arg, "--min-samples") && remaining >= 1)	settings.min_samples = atoi(argv[++i]);
+		else if (!strcmp(arg, "--checkpoint") && remaining >= 1)	settings.checkpoint_path = argv[++i];
+		else if (!strcmp(arg, "--checkpoint-interval") && remaining >= 1)	settings.checkpoint_interval = atof(argv[++i]);
+		else if (!strcmp(arg, "--pass") && remaining >= 1)		settings.pass_samples = atoi(argv[++i]);
+		else if (!strcmp(arg, "--bounces") && remaining >= 1)		settings.max_bounces = atoi(argv[++i]);
+		else if (!strcmp(arg, "--roulette") && remaining >= 1)		settings.roulette_depth = atoi(argv[++i]);
+		else if (!strcmp(arg, "--spheres") && remaining >= 1)		settings.num_spheres = atoi(argv[++i]);
+		else if (!strcmp(arg, "--threads") && remaining >= 1)		settings.thread_count = atoi(argv[++i]);
+		else if (!strcmp(arg, "--seed") && remaining >= 1)		SEED = atoi(argv[++i]);
+		else if (!strcmp(arg, "--seeds") && remaining >= 1)		seed_list = argv[++i];
+		else if (!strcmp(arg, "--aperture") && remaining >= 1)		settings.cam_aperture = (f32)atof(argv[++i]), settings.camera_from_args |= 4;
+		else if (!strcmp(arg, "--fov") && remaining >= 1)		settings.v_fov = (f32)atof(argv[++i]), settings.camera_from_args |= 8;
+		else if (!strcmp(arg, "--scene") && remaining >= 1)		settings.scene_path = argv[++i];
+		else if (!strcmp(arg, "--export") && remaining >= 1)		settings.export_path = argv[++i];
+		else if (!strcmp(arg, "--output") && remaining >= 1)		settings.output_path = argv[++i];
+		else if (!strcmp(arg, "--image") && remaining >= 1)		settings.image_path = argv[++i];
+		else if (!strcmp(arg, "--format") && remaining >= 1)		format = argv[++i];
+		else if (!strcmp(arg, "--tonemap") && remaining >= 1)		tone_map = argv[++i];
+		else if (!strcmp(arg, "--sampler") && remaining >= 1)		sampler = argv[++i];
+		else if (!strcmp(arg, "--exposure") && remaining >= 1)		settings.exposure = (f32)atof(argv[++i]);
+		else if (!strcmp(arg, "--denoise"))				settings.denoise = 1;
+		else if (!strcmp(arg, "--preview"))				settings.preview = 1;
+		else if (!strcmp(arg, "--packet") && remaining >= 1)		settings.packet_size = atoi(argv[++i]);
+		else if (!strcmp(arg, "--tile") && remaining >= 1)		settings.tile_size = atoi(argv[++i]);
+		else if (!strcmp(arg, "--wavefront"))				settings.wavefront = 1;
+		else if (!strcmp(arg, "--nee"))					settings.nee = 1;
+		else if (!strcmp(arg, "--frames") && remaining >= 1)		settings.frames = atoi(argv[++i]);
+		else if (!strcmp(arg, "--animation") && remaining >= 1)		settings.animation_path = argv[++i];
+		else if (!strcmp(arg, "--benchmark") && remaining >= 1)		settings.benchmark_path = argv[++i];
+		else if (!strcmp(arg, "--baseline") && remaining >= 1)		settings.baseline_path = argv[++i];
+		else if (!strcmp(arg, "--tolerance") && remaining >= 1)		settings.tolerance = (f32)atof(argv[++i]);
+		else if (!strcmp(arg, "--coordinator") && remaining >= 1)	settings.coordinator_address = argv[++i];
+		else if (!strcmp(arg, "--worker") && remaining >= 1)		settings.worker_address = argv[++i];
+		else if (!strcmp(arg, "--trace") && remaining >= 1)		settings.trace_path = argv[++i];
+		else if (!strcmp(arg, "--heatmap"))				settings.heatmap = 1;
+		else if (!strcmp(arg, "--wavefront-benchmark"))			settings.wavefront_benchmark = 1;
+		else if (!strcmp(arg, "--verify"))				settings.verify = 1;
+		else if (!strcmp(arg, "--expect-hash") && remaining >= 1)
+		{
+			settings.check_hash = 1;
+			settings.expected_hash = strtoull(argv[++i], NULL, 16);
+		}
+		else if (!strcmp(arg, "--mesh") && remaining >= 2)
+		{
+			const char* mesh_path = argv[++i];
 
-	for (Sphere* sphere = first; sphere != sphere_end; sphere++)
+			add_mesh_file(mesh_path, atoi(argv[++i]), vec3(0.0f, 0.0f, 0.0f), 1.0f);
+		}
+		else if (!strcmp(arg, "--mesh-transform") && remaining >= 4 && mesh_file_count)
+		{
+			MeshFile* source = mesh_files + mesh_file_count - 1;
+
+			source->offset.x = (f32)atof(argv[++i]);
+			source->offset.y = (f32)atof(argv[++i]);
+			source->offset.z = (f32)atof(argv[++i]);
+			source->scale = (f32)atof(argv[++i]);
+		}
+		else if (!strcmp(arg, "--material-bounces") && remaining >= 3)
+		{
+			settings.material_bounces[METAL] = atoi(argv[++i]);
+			settings.material_bounces[LAMBERT] = atoi(argv[++i]);
+			settings.material_bounces[CHECKER] = atoi(argv[++i]);
+		}
+		else if (!strcmp(arg, "--camera") && remaining >= 3)
+		{
+			settings.cam_position.x = (f32)atof(argv[++i]);
+			settings.cam_position.y = (f32)atof(argv[++i]);
+			settings.cam_position.z = (f32)atof(argv[++i]);
+			settings.camera_from_args |= 1;
+		}
+		else if (!strcmp(arg, "--target") && remaining >= 3)
+		{
+			settings.cam_target.x = (f32)atof(argv[++i]);
+			settings.cam_target.y = (f32)atof(argv[++i]);
+			settings.cam_target.z = (f32)atof(argv[++i]);
+			settings.camera_from_args |= 2;
+		}
+		else
+		{
+			print_usage(argv[0]);
+			return 0;
+		}
+	}
+
+	if (settings.output_width == 0 || settings.output_height == 0 || settings.num_aa_samples == 0 || settings.num_spheres == 0 || settings.tile_size == 0 || settings.pass_samples == 0)
+	{
+		print_usage(argv[0]);
+		return 0;
+	}
+
+	if ((settings.coordinator_address || settings.worker_address) && (settings.checkpoint_path || settings.frames || settings.animation_path || settings.preview))
+	{
+		printf("Distributed renders cannot be checkpointed, previewed or animated\n");
+		return 0;
+	}
+
+	if ((settings.frames || settings.animation_path) && (settings.checkpoint_path || settings.preview))
+	{
+		printf("Animations cannot be checkpointed or previewed\n");
+		return 0;
+	}
+
+	if (settings.benchmark_path && settings.checkpoint_path)
+	{
+		printf("Benchmarks cannot be checkpointed\n");
+		return 0;
+	}
+
+	if (seed_list && !parse_seed_list(seed_list))
 	{
-		if (intersection(&r, *sphere, &temp, t_min, closest))
+		printf("Could not read seed list %s\n", seed_list);
+		return 0;
+	}
+
+	if (settings.seed_count && (settings.scene_path || settings.image_path || settings.checkpoint_path || settings.check_hash || settings.frames || settings.animation_path || settings.coordinator_address || settings.worker_address))
+	{
+		printf("Seed sweeps generate a scene per seed and cannot be combined with --scene, --image, --checkpoint, --expect-hash, animations or distributed rendering\n");
+		return 0;
+	}
+
+	if (!format && settings.image_path && strrchr(settings.image_path, '.')) format = strrchr(settings.image_path, '.') + 1;
+
+	if (format)
+	{
+		u32 found = 0;
+
+		for (u32 f = 0; f < 4; f++)
 		{
-			hit_something = 1;
-			closest = temp.t;
+			if (!strcmp(format, format_names[f]))
+			{
+				settings.image_format = (ImageFormat)f;
+				found = 1;
+			}
+		}
 
-			h->t = temp.t;
-			h->point = temp.point;
-			h->normal = temp.normal;
-			h->material = sphere->material;
+		if (!found)
+		{
+			printf("Unknown image format %s\n", format);
+			return 0;
 		}
 	}
 
-	return hit_something;
+	if (tone_map)
+	{
+		u32 found = 0;
+
+		for (u32 t = 0; t < 4; t++)
+		{
+			if (!strcmp(tone_map, tone_map_names[t]))
+			{
+				settings.tone_map = (ToneMap)t;
+				found = 1;
+			}
+		}
+
+		if (!found)
+		{
+			printf("Unknown tone mapping operator %s\n", tone_map);
+			return 0;
+		}
+	}
+
+	if (sampler)
+	{
+		u32 found = 0;
+
+		for (u32 t = 0; t < 3; t++)
+		{
+			if (!strcmp(sampler, sampler_names[t]))
+			{
+				settings.sampler = (SamplerType)t;
+				found = 1;
+			}
+		}
+
+		if (!found)
+		{
+			printf("Unknown sampler %s\n", sampler);
+			return 0;
+		}
+	}
+
+	if (settings.packet_size > PACKET_MAX) settings.packet_size = PACKET_MAX;
+	if (settings.thread_count == 0) settings.thread_count = 1;
+
+	return 1;
 }
 
-void paint(void)
+// The float framebuffer lives in plain memory, or with --checkpoint in a file mapping laid out as
+// a CheckpointHeader followed by the pixel records. Reopening a checkpoint written with the same
+// settings and scene carries on from the samples it already holds. Any other existing file is
+// refused rather than overwritten; only an empty or new file is set up as a checkpoint.
+u32 setup_accumulation(void)
 {
-	PAINTSTRUCT ps;
-	HDC dc = BeginPaint(hwnd, &ps);
-	s32 x = ps.rcPaint.left;
-	s32 y = ps.rcPaint.top;
-	s32 w = ps.rcPaint.right - ps.rcPaint.left;
-	s32 h = ps.rcPaint.bottom - ps.rcPaint.top;
+	u64 pixels = (u64)settings.output_width * settings.output_height;
+
+	if (settings.heatmap)
+	{
+		pixel_seconds = malloc(pixels * sizeof(f64));
+		memset(pixel_seconds, 0, pixels * sizeof(f64));
+	}
+
+	if (!settings.checkpoint_path)
+	{
+		accumulation = alloc_aligned(pixels * sizeof(AccumPixel), 64);
+		memset(accumulation, 0, pixels * sizeof(AccumPixel));
+
+		return 1;
+	}
+
+	u32 existed = 0;
+
+	checkpoint_size = sizeof(CheckpointHeader) + pixels * sizeof(AccumPixel);
+	checkpoint = map_file(settings.checkpoint_path, checkpoint_size, &existed);
+
+	if (!checkpoint)
+	{
+		if (existed) printf("%s is not a checkpoint for this render\n", settings.checkpoint_path);
+		else printf("Could not map checkpoint %s\n", settings.checkpoint_path);
+		return 0;
+	}
+
+	accumulation = (AccumPixel*)(checkpoint + 1);
+
+	u64 fingerprint = image_fingerprint();
+
+	if (existed)
+	{
+		if (checkpoint->magic != CHECKPOINT_MAGIC || checkpoint->version != CHECKPOINT_VERSION)
+		{
+			printf("%s is not a checkpoint for this render\n", settings.checkpoint_path);
+			return 0;
+		}
+
+		if (checkpoint->width != settings.output_width || checkpoint->height != settings.output_height || checkpoint->seed != SEED || checkpoint->num_spheres != settings.num_spheres || checkpoint->fingerprint != fingerprint)
+		{
+			printf("Checkpoint %s was written for a different render\n", settings.checkpoint_path);
+			return 0;
+		}
+
+		return 1;
+	}
+
+	memset(checkpoint, 0, checkpoint_size);
+
+	checkpoint->magic = CHECKPOINT_MAGIC;
+	checkpoint->version = CHECKPOINT_VERSION;
+	checkpoint->width = settings.output_width;
+	checkpoint->height = settings.output_height;
+	checkpoint->seed = SEED;
+	checkpoint->num_spheres = settings.num_spheres;
+	checkpoint->fingerprint = fingerprint;
+
+	flush_file(checkpoint, checkpoint_size);
+
+	return 1;
+}
+
+// Renders the frame once one path at a time and once as wavefronts, and reports the throughput of
+// each. The two images have to hash the same.
+u32 benchmark_wavefront(void)
+{
+	u64	pixels = (u64)settings.output_width * settings.output_height;
+	f64	seconds[2];
+	u64	hashes[2];
+	u64	samples = 0;
+
+	for (u32 mode = 0; mode < 2; mode++)
+	{
+		memset(accumulation, 0, pixels * sizeof(AccumPixel));
+
+		settings.wavefront = mode;
+		pass_target = settings.num_aa_samples;
+
+		f64 start = get_time();
+
+		render_start();
+		render_finish();
+
+		seconds[mode] = get_time() - start;
+		hashes[mode] = image_hash();
+	}
+
+	for (u64 i = 0; i < pixels; i++) samples += accumulation[i].samples;
+
+	printf("megakernel	%f s	%.3f Msamples/s\n", seconds[0], samples / seconds[0] / 1000000.0);
+	printf("wavefront	%f s	%.3f Msamples/s	%.2fx\n", seconds[1], samples / seconds[1] / 1000000.0, seconds[0] / seconds[1]);
+
+	if (hashes[0] != hashes[1])
+	{
+		printf("Image hashes differ: %016llx %016llx\n", (unsigned long long)hashes[0], (unsigned long long)hashes[1]);
+		return 0;
+	}
+
+	printf("Image hash %016llx\n", (unsigned long long)hashes[0]);
+
+	return 1;
+}
+
+void update_camera(void)
+{
+	v3 world_up = vec3(0.0f, 1.0f, 0.0f);
+	v3 cam_direction = v3_sub(settings.cam_position, settings.cam_target);
+	f32 cam_focal_dist = v3_mag(cam_direction);
+	f32 aspect = (f32)settings.output_width / (f32)settings.output_height;
+
+	setup_camera(&camera, settings.cam_position, settings.cam_target, world_up, settings.v_fov, aspect, settings.cam_aperture, cam_focal_dist);
+}
+
+s32 compare_camera_keys(const void* a, const void* b)
+{
+	u32 fa = ((const CameraKey*)a)->frame;
+	u32 fb = ((const CameraKey*)b)->frame;
+
+	return (fa > fb) - (fa < fb);
+}
+
+s32 compare_sphere_keys(const void* a, const void* b)
+{
+	const SphereKey* ka = a;
+	const SphereKey* kb = b;
+
+	if (ka->sphere != kb->sphere) return (ka->sphere > kb->sphere) - (ka->sphere < kb->sphere);
+
+	return (ka->frame > kb->frame) - (ka->frame < kb->frame);
+}
+
+// Reads keyframes, one per line:
+//
+//	camera <frame> <px> <py> <pz> <tx> <ty> <tz> <v_fov> <aperture>
+//	sphere <frame> <index> <x> <y> <z> <radius>
+//
+// Blank lines and lines starting with # are skipped. Without --frames the animation runs to its
+// last keyframe.
+u32 load_animation(const char* filename)
+{
+	FILE* file = fopen(filename, "r");
+
+	if (!file)
+	{
+		printf("Could not open animation %s\n", filename);
+		return 0;
+	}
+
+	u32	camera_capacity = 16;
+	u32	sphere_capacity = 64;
+	u32	last_frame = 0;
+	u32	line_number = 0;
+	char	line[512];
+
+	animation.cameras = malloc(camera_capacity * sizeof(CameraKey));
+	animation.spheres = malloc(sphere_capacity * sizeof(SphereKey));
+
+	while (fgets(line, sizeof(line), file))
+	{
+		char	keyword[32];
+		u32	valid = 1;
+		u32	frame = 0;
+
+		line_number++;
+
+		if (sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#') continue;
+
+		if (!strcmp(keyword, "camera"))
+		{
+			if (animation.camera_count == camera_capacity)
+			{
+				camera_capacity *= 2;
+				animation.cameras = realloc(animation.cameras, camera_capacity * sizeof(CameraKey));
+			}
+
+			CameraKey* key = animation.cameras + animation.camera_count++;
+
+			valid = sscanf(line, "%*s %u %f %f %f %f %f %f %f %f", &key->frame, &key->position.x, &key->position.y, &key->position.z, &key->target.x, &key->target.y, &key->target.z, &key->v_fov, &key->aperture) == 9;
+			frame = key->frame;
+		}
+		else if (!strcmp(keyword, "sphere"))
+		{
+			if (animation.sphere_count == sphere_capacity)
+			{
+				sphere_capacity *= 2;
+				animation.spheres = realloc(animation.spheres, sphere_capacity * sizeof(SphereKey));
+			}
+
+			SphereKey* key = animation.spheres + animation.sphere_count++;
+
+			valid = sscanf(line, "%*s %u %u %f %f %f %f", &key->frame, &key->sphere, &key->position.x, &key->position.y, &key->position.z, &key->radius) == 6 && key->sphere < settings.num_spheres;
+			frame = key->frame;
+		}
+		else
+		{
+			valid = 0;
+		}
+
+		if (!valid)
+		{
+			printf("%s:%u: could not read '%s'\n", filename, line_number, keyword);
+			fclose(file);
+			return 0;
+		}
+
+		if (frame > last_frame) last_frame = frame;
+	}
+
+	fclose(file);
+
+	qsort(animation.cameras, animation.camera_count, sizeof(CameraKey), compare_camera_keys);
+	qsort(animation.spheres, animation.sphere_count, sizeof(SphereKey), compare_sphere_keys);
+
+	if (!settings.frames) settings.frames = last_frame + 1;
+
+	return 1;
+}
+
+f32 key_blend(u32 frame, u32 from, u32 to)
+{
+	return (to > from) ? (f32)(frame - from) / (f32)(to - from) : 0.0f;
+}
+
+// Moves the camera and spheres to where they are at a frame. With no animation file the camera
+// orbits its target once over the sequence. Moving spheres only refits the BVH.
+void animate_frame(u32 frame)
+{
+	if (animation.camera_count)
+	{
+		u32 next = 0;
+
+		while (next < animation.camera_count && animation.cameras[next].frame <= frame) next++;
+
+		CameraKey* a = animation.cameras + ((next > 0) ? next - 1 : 0);
+		CameraKey* b = animation.cameras + ((next < animation.camera_count) ? next : animation.camera_count - 1);
+		f32 t = (frame < a->frame) ? 0.0f : key_blend(frame, a->frame, b->frame);
+
+		settings.cam_position = v3_add(a->position, v3_mulf(v3_sub(b->position, a->position), t));
+		settings.cam_target = v3_add(a->target, v3_mulf(v3_sub(b->target, a->target), t));
+		settings.v_fov = a->v_fov + (b->v_fov - a->v_fov) * t;
+		settings.cam_aperture = a->aperture + (b->aperture - a->aperture) * t;
+	}
+	else if (!settings.animation_path)
+	{
+		f32 angle = (2.0f * PI * frame) / settings.frames;
+		v3  offset = v3_sub(animation.orbit_position, settings.cam_target);
+
+		settings.cam_position.x = settings.cam_target.x + offset.x * cosf(angle) - offset.z * sinf(angle);
+		settings.cam_position.y = animation.orbit_position.y;
+		settings.cam_position.z = settings.cam_target.z + offset.x * sinf(angle) + offset.z * cosf(angle);
+	}
+
+	update_camera();
+
+	for (u32 first = 0; first < animation.sphere_count;)
+	{
+		u32 last = first;
+
+		while (last + 1 < animation.sphere_count && animation.spheres[last + 1].sphere == animation.spheres[first].sphere) last++;
+
+		u32 next = first;
+
+		while (next <= last && animation.spheres[next].frame <= frame) next++;
+
+		SphereKey* a = animation.spheres + ((next > first) ? next - 1 : first);
+		SphereKey* b = animation.spheres + ((next <= last) ? next : last);
+		f32 t = (frame < a->frame) ? 0.0f : key_blend(frame, a->frame, b->frame);
+		Sphere* sphere = spheres + a->sphere;
+
+		sphere->position = v3_add(a->position, v3_mulf(v3_sub(b->position, a->position), t));
+		sphere->radius = a->radius + (b->radius - a->radius) * t;
+
+		first = last + 1;
+	}
+
+	if (animation.sphere_count)
+	{
+		refit_bvh(&scene_bvh);
+		setup_lights();
+	}
+}
+
+// Renders every frame of an animation in one process: the scene, palette and thread pool are set
+// up once, and between frames only the camera, the moved spheres and the BVH bounds change.
+u32 render_animation(void)
+{
+	u64 pixels = (u64)settings.output_width * settings.output_height;
+	f64 start = get_time();
+
+	if (settings.animation_path && !load_animation(settings.animation_path)) return 0;
+
+	animation.orbit_position = settings.cam_position;
+
+	for (u32 frame = 0; frame < settings.frames; frame++)
+	{
+		f64 frame_start = get_time();
+
+		animate_frame(frame);
+		memset(accumulation, 0, pixels * sizeof(AccumPixel));
+
+		f64 trace_start = get_time();
+
+		pass_target = settings.num_aa_samples;
+
+		render_start();
+		render_finish();
+
+		if (settings.denoise) denoise_image();
 
-	StretchDIBits(dc, x, y, w, h, x, y, w, h, (void*)bitmap_image_data, (BITMAPINFO*)&info_header, DIB_RGB_COLORS, SRCCOPY);
+		f64 trace_end = get_time();
 
-	EndPaint(hwnd, &ps);
+		save_frame(frame);
+		denoise_restore();
+
+		printf("Frame %04u	%f s	%.3f ms setup\n", frame, trace_end - frame_start, (trace_start - frame_start) * 1000.0);
+	}
+
+	render_time = get_time() - start;
+
+	return 1;
 }
 
-LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM w_param, LPARAM l_param)
+void release_scene(void)
 {
-	switch (msg)
-	{
-	case WM_PAINT:
-	{
-		paint();
-	}
-	break;
-	case WM_CLOSE:
-		DestroyWindow(hwnd);
-		break;
-	case WM_DESTROY:
-		PostQuitMessage(0);
-		break;
-	default:
-		return DefWindowProc(hwnd, msg, w_param, l_param);
-		break;
-	}
-	return 0;
+	free(spheres);
+	free(planes);
+	free(materials);
+	free(scene_bvh.indices);
+	free_aligned(scene_bvh.nodes);
+	free_aligned(sphere_soa.x);
+	free_aligned(sphere_soa.y);
+	free_aligned(sphere_soa.z);
+	free_aligned(sphere_soa.radius2);
+	free_aligned(sphere_soa.ids);
 }
 
-void setup_camera(Camera* camera, v3 pos, v3 target, v3 up, f32 vertical_fov, f32 aspect, f32 aperture, f32 focus_distance)
+// Finds a run in a baseline written by run_benchmark(). Only that exact layout needs reading, so
+// this walks the text rather than parsing JSON in general.
+f64 baseline_mrays(const char* json, const char* scene, u32 threads, char* hash)
 {
-	camera->lens_radius = aperture / 2.0f;
+	char	key[64];
+	char*	start;
+	char*	end;
 
-	f32 theta = vertical_fov * (3.14159265358979323846f / 180.0f);
-	f32 half_height = tan(theta / 2.0f);
-	f32 half_width = aspect * half_height;
+	snprintf(key, sizeof(key), "\"name\": \"%s\"", scene);
 
-	camera->position = pos;
+	if (!json || !(start = strstr(json, key))) return 0.0;
 
-	v3	dir = v3_sub(pos, target);
-	camera->w = v3_normalized(dir);
+	end = strstr(start + 1, "\"name\": ");
 
-	v3	cp_dir = v3_cross(up, camera->w);
-	camera->u = v3_normalized(cp_dir);
+	char* stored_hash = strstr(start, "\"hash\": \"");
 
-	camera->v = v3_cross(camera->w, camera->u);
+	if (hash && stored_hash && (!end || stored_hash < end)) sscanf(stored_hash + 9, "%16s", hash);
 
-	v3	hwu = v3_mulf(camera->u, half_width*focus_distance);
-	v3	hhv = v3_mulf(camera->v, half_height*focus_distance);
-	v3	ht = v3_add(hwu, hhv);
-	v3  fdw = v3_mulf(camera->w, focus_distance);
-	v3	total = v3_add(ht, fdw);
+	snprintf(key, sizeof(key), "\"threads\": %u,", threads);
 
-	camera->bottom_left = v3_sub(pos, total);
-	camera->horizontal = v3_mulf(camera->u, 2.0f*focus_distance*half_width);
-	camera->vertical = v3_mulf(camera->v, 2.0f*focus_distance*half_height);
+	char* run = strstr(start, key);
+	char* value = run ? strstr(run, "\"mrays_per_second\": ") : NULL;
+	f64 mrays = 0.0;
+
+	if (!value || (end && value > end)) return 0.0;
+
+	sscanf(value + 20, "%lf", &mrays);
+
+	return mrays;
 }
 
-v3 colour(Ray r)
+// Renders a fixed set of scenes at a fixed size, seed and sample count at 1, 2, 4... threads up
+// to --threads, keeping the fastest of BENCHMARK_REPEATS wall-clock runs for each. Results go to
+// a JSON file; given a baseline written the same way, any run more than the tolerance slower, or
+// any image that no longer hashes the same, is reported as a regression.
+u32 run_benchmark(void)
 {
-	Hit h;
+	u32	max_threads = settings.thread_count;
+	u32	regressions = 0;
+	char*	baseline = NULL;
+	FILE*	json = fopen(settings.benchmark_path, "w");
 
-	if (intersects_all(r, &h, 0.000000001f, FLT_MAX, spheres, NUM_SPHERES))
+	if (!json)
 	{
-		if (r.bounces < MAX_BOUNCES)
+		printf("Could not write %s\n", settings.benchmark_path);
+		return 0;
+	}
+
+	if (settings.baseline_path)
+	{
+		FILE* file = fopen(settings.baseline_path, "rb");
+
+		if (!file)
 		{
-			switch (h.material.type)
-			{
-			case LAMBERT:
-			{
-				v3 random_unit_vector = random_unit_sphere();
-				v3 point_pos = v3_add(h.point, h.normal);
-				v3 target = v3_add(point_pos, random_unit_vector);
+			printf("Could not read baseline %s\n", settings.baseline_path);
+			fclose(json);
+			return 0;
+		}
+
+		fseek(file, 0, SEEK_END);
+		u64 size = ftell(file);
+		fseek(file, 0, SEEK_SET);
 
-				Ray ray;
-				ray.origin = h.point;
-				ray.direction = v3_sub(target, h.point);
-				ray.bounces = r.bounces + 1;
+		baseline = calloc(size + 1, 1);
+		size = fread(baseline, 1, size, file);
+		fclose(file);
+	}
 
-				v3 c = colour(ray);
-				v3 lambert = v3_mulv(c, h.material.albedo);
+	SEED = BENCHMARK_SEED;
+	settings.output_width = BENCHMARK_WIDTH;
+	settings.output_height = BENCHMARK_HEIGHT;
+	settings.num_aa_samples = BENCHMARK_SAMPLES;
+	settings.noise_threshold = 0.0f;
 
-				return lambert;
-			}
+	update_camera();
+	setup_pallete();
+	setup_bitmap();
+	setup_tone_map();
+	setup_sampler();
 
-			case METAL:
-			{
-				v3 ray_dir_n = v3_normalized(r.direction);
-				v3 reflected = v3_reflect(ray_dir_n, h.normal);
-				v3 rnd_fuzz = v3_mulf(random_unit_sphere(), h.material.fuzz);
-				v3 final_reflection_dir = v3_add(reflected, rnd_fuzz);
+	if (!setup_accumulation())
+	{
+		fclose(json);
+		free(baseline);
+		return 0;
+	}
+
+	fprintf(json, "{\n");
+	fprintf(json, "\t\"width\": %u,\n", settings.output_width);
+	fprintf(json, "\t\"height\": %u,\n", settings.output_height);
+	fprintf(json, "\t\"samples\": %u,\n", settings.num_aa_samples);
+	fprintf(json, "\t\"seed\": %i,\n", SEED);
+	fprintf(json, "\t\"packet\": %u,\n", settings.packet_size);
+	fprintf(json, "\t\"wavefront\": %u,\n", settings.wavefront);
+	fprintf(json, "\t\"nee\": %u,\n", settings.nee);
+	fprintf(json, "\t\"sampler\": \"%s\",\n", sampler_names[settings.sampler]);
+	fprintf(json, "\t\"scenes\":\n\t[\n");
+
+	for (u32 s = 0; s < 4; s++)
+	{
+		BenchmarkScene*	scene = benchmark_scenes + s;
+		u64		pixels = (u64)settings.output_width * settings.output_height;
+		u64		samples = pixels * settings.num_aa_samples;
+		f64		single_thread = 0.0;
+		char		baseline_hash[17] = "";
 
-				Ray scattered;
-				scattered.origin = h.point;
-				scattered.direction = final_reflection_dir;
-				scattered.bounces = r.bounces + 1;
+		settings.num_spheres = scene->spheres;
+		setup_scene();
 
-				f32 v = v3_dot(scattered.direction, h.normal);
-				v3	c = colour(scattered);
-				v3  calb = v3_mulv(c, h.material.albedo);
+		for (u32 i = 0; i < settings.num_spheres; i++)
+		{
+			Material* material = materials + spheres[i].material;
 
-				v3 metal = (v > 0.0f) ? calb : vec3(0.0f, 0.0f, 0.0f);
+			if (scene->variant == BENCHMARK_LIGHTS && (i % 4) != 0) material->type = LIGHT;
 
-				return metal;
+			if (scene->variant == BENCHMARK_MIRRORS)
+			{
+				material->type = METAL;
+				material->albedo = vec3(0.9f, 0.9f, 0.9f);
+				material->fuzz = 0.02f;
 			}
+		}
+
+		setup_lights();
+		setup_bvh();
+
+		fprintf(json, "\t\t{\n");
+		fprintf(json, "\t\t\t\"name\": \"%s\",\n", scene->name);
+		fprintf(json, "\t\t\t\"spheres\": %u,\n", scene->spheres);
+		fprintf(json, "\t\t\t\"runs\":\n\t\t\t[\n");
+
+		for (u32 threads = 1; threads <= max_threads; threads = (threads == max_threads) ? threads + 1 : ((threads * 2 < max_threads) ? threads * 2 : max_threads))
+		{
+			f64 best = FLT_MAX;
+			u64 rays = 0;
 
-			case CHECKER:
+			render_shutdown();
+			settings.thread_count = threads;
+
+			for (u32 repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
 			{
-				v3 random_unit_vector = random_unit_sphere();
-				v3 point_pos = v3_add(h.point, h.normal);
-				v3 target = v3_add(point_pos, random_unit_vector);
+				memset(accumulation, 0, pixels * sizeof(AccumPixel));
+				pass_target = settings.num_aa_samples;
+
+				memset(&scheduler.stats, 0, sizeof(RenderStats));
 
-				Ray ray;
-				ray.origin = h.point;
-				ray.direction = v3_sub(target, h.point);
-				ray.bounces = r.bounces + 1;
+				f64 start = get_time();
 
-				v3 c = colour(ray);
+				render_start();
+				render_finish();
 
-				f32 sines = (sin(10.0f*h.point.x) * sin(10.0f*h.point.y) * sin(10.0f*h.point.z) + 1.0f);
-				u8  trunc = sines;
-				v3  check_1 = vec3(0.1f, 0.1f, 0.1f);
-				v3  check_2 = vec3(0.9f, 0.9, 0.9f);
-				v3  check_col = trunc ? check_1 : check_2;
-				v3	check = v3_mulv(c, check_col);
+				f64 seconds = get_time() - start;
 
-				return check;
+				if (seconds < best)
+				{
+					best = seconds;
+					rays = scheduler.stats.rays;
+				}
 			}
 
-			case LIGHT:
+			if (threads == 1) single_thread = best;
+
+			f64 mrays = rays / best / 1000000.0;
+			f64 speedup = single_thread / best;
+			f64 expected = baseline_mrays(baseline, scene->name, threads, NULL);
+
+			fprintf(json, "\t\t\t\t{ \"threads\": %u, \"seconds\": %f, \"rays\": %llu, \"mrays_per_second\": %f, \"samples_per_second\": %f, \"speedup\": %f, \"efficiency\": %f }%s\n", threads, best, (unsigned long long)rays, mrays, samples / best, speedup, speedup / threads, (threads < max_threads) ? "," : "");
+
+			printf("%-14s %3u threads  %9.4f s  %8.3f Mrays/s  %10.0f samples/s  %5.2fx", scene->name, threads, best, mrays, samples / best, speedup);
+
+			if (expected > 0.0)
 			{
-				return  h.material.albedo;
-			}
+				printf("  baseline %8.3f Mrays/s %+6.1f%%", expected, 100.0 * (mrays / expected - 1.0));
+
+				if (mrays < expected * (1.0 - settings.tolerance))
+				{
+					printf("  REGRESSION");
+					regressions++;
+				}
 			}
+
+			printf("\n");
 		}
-		else
-		{
-			return vec3(0.0f, 0.0f, 0.0f);
-		}
-	}
-	else
-	{
-		v3 dir_n = v3_normalized(r.direction);
 
-		f32 t = 0.5f * (dir_n.y + 1.0f);
+		fprintf(json, "\t\t\t],\n");
+		fprintf(json, "\t\t\t\"hash\": \"%016llx\"\n", (unsigned long long)image_hash());
+		fprintf(json, "\t\t}%s\n", (s < 3) ? "," : "");
 
-		v3 lower = vec3(1.0f, 1.0f, 1.0f);
-		v3 upper = vec3(0.5f, 0.7f, 1.0f);
+		baseline_mrays(baseline, scene->name, 1, baseline_hash);
 
-#ifdef NIGHT
+		if (baseline_hash[0] && strtoull(baseline_hash, NULL, 16) != image_hash())
+		{
+			printf("%-14s image hash %016llx differs from baseline %s  REGRESSION\n", scene->name, (unsigned long long)image_hash(), baseline_hash);
+			regressions++;
+		}
 
-		lower = vec3(0.270f, 0.211f, 0.184f);
-		upper = vec3(0.020f, 0.020f, 0.020f);
+		release_scene();
+	}
 
-#endif // NIGHT
+	fprintf(json, "\t]\n}\n");
+	fclose(json);
+	free(baseline);
 
-		v3 white_component = v3_mulf(lower, 1.0f - t);
-		v3 blue_component = v3_mulf(upper, t);
-		v3 gradient = v3_add(white_component, blue_component);
+	render_shutdown();
+	trace_close();
 
-		return gradient;
-	}
+	if (settings.baseline_path) printf("%u regressions against %s\n", regressions, settings.baseline_path);
+
+	return regressions == 0;
 }
 
-void setup_pallete(void)
+thread_result THREAD_CALL VariantWorker(void* data)
 {
-	palette = malloc(NUM_COLOURS * sizeof(v3));
+	SceneVariant* variant = data;
 
-	*(palette + 0) = vec3(255.0f / 255.0f, 107.0f / 255.0f, 107.0f / 255.0f);
-	*(palette + 1) = vec3(85.0f / 255.0f, 98.0f / 255.0f, 112.0f / 255.0f);
-	*(palette + 2) = vec3(78.0f / 255.0f, 205.0f / 255.0f, 198.0f / 255.0f);
-	*(palette + 3) = vec3(198.0f / 255.0f, 77.0f / 255.0f, 88.0f / 255.0f);
-	*(palette + 4) = vec3(199.0f / 255.0f, 244.0f / 255.0f, 100.0f / 255.0f);
+	generate_scene(variant);
+	build_sphere_bvh(&variant->bvh, variant->spheres);
 
-	return;
+	return 0;
 }
 
-v3 get_random_colour_in_pallete(void)
+// Swaps a finished variant in for the scene that was just rendered. Only the per-seed setup is
+// left to do here: the sphere SoA in BVH order and the light list.
+void install_variant(SceneVariant* variant)
 {
-	u32 index = (u32)(nrand() * NUM_COLOURS);
-
-	return palette[index];
+	if (spheres) release_scene();
+
+	SEED = variant->seed;
+	spheres = variant->spheres;
+	planes = variant->planes;
+	materials = variant->materials;
+	material_count = settings.num_spheres + 1;
+	plane_count = 1;
+	scene_bvh = variant->bvh;
+
+	setup_sphere_soa(scene_bvh.indices);
+	setup_lights();
 }
 
-void setup_scene(void)
+// Renders one variant per seed in settings.seeds with a single thread pool, each to its own seed
+// directory exactly as a run with --seed would. The camera, palette, meshes, tone map and sampler
+// tables are set up once. While a variant renders, the next seed's scene and BVH are built on a
+// background thread, which soaks up the cores the render leaves idle as its last tiles finish.
+u32 run_seed_sweep(void)
 {
-	spheres = malloc(NUM_SPHERES * sizeof(Sphere));
+	SceneVariant	variants[2];
+	u64		pixels = (u64)settings.output_width * settings.output_height;
+	f64		start = get_time();
 
-	spheres->position = vec3(0.0f, -100000.0f, -0.0f);
-	spheres->radius = 99999.995f;
-	spheres->material.type = LAMBERT;
-	spheres->material.albedo = vec3(0.2f, 0.2f, 0.2f);
+	update_camera();
+	setup_pallete();
 
-	u32 sphere_count = 1;
+	variants[0].seed = settings.seeds[0];
+	variants[0].thread = thread_create(VariantWorker, variants);
 
-	while (1)
+	for (u32 i = 0; i < settings.seed_count; i++)
 	{
-		if (sphere_count == NUM_SPHERES) break;
-
-		f32 xpos = (nrand() * 5.0f) - 2.5f;;
-
-		(spheres + sphere_count)->radius = (nrand() * 0.25f) + 0.05f;
-		(spheres + sphere_count)->position.x = xpos;
-		(spheres + sphere_count)->position.y = (spheres + sphere_count)->radius;
-		(spheres + sphere_count)->position.z = (nrand() * 2.5f);
-		(spheres + sphere_count)->material.type = (nrand() > 0.60f) ? ((nrand() > 0.35f) ? LIGHT : METAL) : LAMBERT;
-		(spheres + sphere_count)->material.intensity = nrand();
+		SceneVariant*	current = variants + (i & 1);
+		SceneVariant*	next = variants + ((i + 1) & 1);
+		f64		seed_start = get_time();
 
-		f32 brightness = 1.0f;
+		thread_join(current->thread);
+		install_variant(current);
 
-		(spheres + sphere_count)->material.albedo = (spheres + sphere_count)->material.type == METAL ? vec3(brightness, brightness, brightness) : viridis((xpos + 2.5) / 5.0f);
-		(spheres + sphere_count)->material.fuzz = nrand() * 0.25;
+		if (i + 1 < settings.seed_count)
+		{
+			next->seed = settings.seeds[i + 1];
+			next->thread = thread_create(VariantWorker, next);
+		}
 
-		int dismiss = 0;
+		if (i == 0)
+		{
+			if (!setup_meshes()) return 0;
 
-		f32 inner = 0.00f;
-		f32 outer = 4.05f;
+			setup_bitmap();
+			setup_tone_map();
+			setup_sampler();
 
-		for (int i = 0; i < sphere_count; ++i)
+			if (!setup_accumulation()) return 0;
+		}
+		else
 		{
-			v3  dir = v3_sub((spheres + sphere_count)->position, (spheres + i)->position);
-			f32 dis = v3_mag(dir);
-			v3  dir_to_sphere = v3_sub((spheres + sphere_count)->position, camera.position);
-			f32 distance_to_cam = v3_mag(dir_to_sphere);
+			memset(accumulation, 0, pixels * sizeof(AccumPixel));
 
-			if (dis < ((spheres + sphere_count)->radius + (spheres + i)->radius) || distance_to_cam < inner || distance_to_cam > outer)
-			{
-				dismiss = 1;
-				break;
-			}
+			if (pixel_seconds) memset(pixel_seconds, 0, pixels * sizeof(f64));
 		}
 
-		if (dismiss == 0) sphere_count++;
-	}
-}
-
-s32 intersects(f32 rect_x, f32 rect_y, f32 rect_width, f32 rect_height, f32 circle_x, f32 circle_y, f32 circle_radius)
-{
-	f32 delta_x = circle_x - max(rect_x, min(circle_x, rect_x + rect_width));
-	f32 delta_y = circle_y - max(rect_y, min(circle_y, rect_y + rect_height));
-
-	return ((delta_x * delta_x + delta_y * delta_y) < (circle_radius * circle_radius)) ? 1 : 0;
-}
+		memset(&scheduler.stats, 0, sizeof(RenderStats));
 
-void setup_bitmap(void)
-{
-	u32 remainder = OUTPUT_WIDTH % 5;
-	u32 row_size = (remainder == 0) ? (OUTPUT_WIDTH * 4) : ((OUTPUT_WIDTH + 4 - remainder) * 4);
+		f64 trace_start = get_time();
+		u32 preview_index = 0;
 
-	file_header.type = 0x4d42;
-	file_header.size = (row_size * OUTPUT_HEIGHT) + sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
-	file_header.res_1 = 0;
-	file_header.res_2 = 0;
-	file_header.offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+		for (pass_target = 0; next_pass();)
+		{
+			if (!start_pass()) return 0;
 
-	device_context = CreateCompatibleDC(0);
-	bitmap_handle = CreateDIBSection(device_context, (BITMAPINFO*)&file_header, DIB_RGB_COLORS, (void**)&bitmap_image_data, 0, 0);
+			render_finish();
 
-	info_header.size = sizeof(BitmapInfoHeader);
-	info_header.width = OUTPUT_WIDTH;
-	info_header.height = OUTPUT_HEIGHT;
-	info_header.planes = 1;
-	info_header.bits = 32;
-	info_header.compression = 0;
-	info_header.image_size = row_size * OUTPUT_HEIGHT;
-	info_header.x_resolution = 0;
-	info_header.y_resolution = 0;
-	info_header.colours = 0;
-	info_header.colours_important = 0;
+			if (settings.preview) save_preview(preview_index++, get_time() - trace_start);
+		}
 
-	bitmap_image_data = _aligned_malloc(info_header.image_size, 64);
-}
+		if (settings.denoise) denoise_image();
 
-void render_pixel(u32 x, u32 y)
-{
-	v3	col = vec3(0.0f, 0.0f, 0.0f);
+		render_time = get_time() - trace_start;
 
-	for (s16 sample = 0; sample < NUM_AA_SAMPLES; sample++)
-	{
-		f32 u = (x + nrand()) / (f32)OUTPUT_WIDTH;
-		f32 v = (y + nrand()) / (f32)OUTPUT_HEIGHT;
+#ifdef OUTPUT
+		save_file();
+#endif // OUTPUT
 
-		Ray r = get_ray(&camera, u, v);
+		denoise_restore();
 
-		v3 c = colour(r);
-		col.x += c.x;
-		col.y += c.y;
-		col.z += c.z;
+		printf("Seed %i	%f s	%.3f Mrays/s	%.3f ms setup	%016llx\n", SEED, get_time() - seed_start, (render_time > 0.0) ? scheduler.stats.rays / render_time / 1000000.0 : 0.0, (trace_start - seed_start) * 1000.0, (unsigned long long)image_hash());
 	}
 
-	v3 final = v3_div(col, (f32)NUM_AA_SAMPLES);
+	f64 seconds = get_time() - start;
 
-	u8 red = (int)(255.99 * sqrt(final.x));
-	u8 grn = (int)(255.99 * sqrt(final.y));
-	u8 blu = (int)(255.99 * sqrt(final.z));
-	u8 res = (int)0;
+	printf("%u variants in %f s, %.1f variants/hour\n", settings.seed_count, seconds, settings.seed_count * 3600.0 / seconds);
 
-	int bitmap_index = ((y * OUTPUT_WIDTH) + x) * 4;
+	release_scene();
+	render_shutdown();
+	trace_close();
 
-	bitmap_image_data[bitmap_index + 0] = blu;
-	bitmap_image_data[bitmap_index + 1] = grn;
-	bitmap_image_data[bitmap_index + 2] = red;
-	bitmap_image_data[bitmap_index + 3] = res;
+	return 1;
 }
 
-void render(u16 offset, u16 inc)
+u32 setup(void)
 {
-	for (s16 y = offset; y < OUTPUT_HEIGHT; y += inc)
-	{
-		for (s16 x = 0; x < OUTPUT_WIDTH; x++)
-		{
-			render_pixel(x, y);
-		}
-	}
-}
+	if (settings.scene_path && !load_scene(settings.scene_path)) return 0;
 
-DWORD WINAPI PaintThread(void* data)
-{
-	while (1)
-	{
-		RedrawWindow(hwnd, NULL, NULL, RDW_INVALIDATE);
-		Sleep(60);
-	}
+	update_camera();
+	setup_pallete();
 
-	return 0;
-}
+	if (!settings.scene_path) setup_scene();
 
-DWORD WINAPI RenderThread(void* data)
-{
-	u32* d = (u32*)data;
+	setup_lights();
+	setup_bvh();
 
-	u16 offset = (*d >> 16);
-	u16 increment = *d;
+	if (!setup_meshes()) return 0;
 
-	render(offset, increment);
+	setup_bitmap();
+	setup_tone_map();
+	setup_sampler();
 
-	return 0;
+	return 1;
 }
 
+#ifdef WINDOWED
+
 int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE prev_instance, LPSTR cmd_line, int cmd_show)
 {
 	WNDCLASSEX wc;
 	MSG msg;
 
-#ifndef SEED_OVERRIDE
-	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
-	SEED = tm.tm_hour * tm.tm_min * tm.tm_sec;
-#else
-	SEED = SEED_OVERRIDE;
-#endif // !SEED_OVERRRIDE
+	setup_default_settings();
 
-	srand(SEED);
+	if (!parse_args(__argc, __argv)) return 0;
 
 	wc.cbSize = sizeof(WNDCLASSEX);
 	wc.style = 0;
@@ -844,48 +7988,24 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE prev_instance, LPSTR cmd_line
 
 	DWORD dwStyle = (WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_MINIMIZEBOX);
 
-	hwnd = CreateWindowEx(WS_EX_CLIENTEDGE, class_name, class_name, dwStyle, CW_USEDEFAULT, CW_USEDEFAULT, OUTPUT_WIDTH, OUTPUT_HEIGHT + 43, NULL, NULL, h_instance, NULL);
+	hwnd = CreateWindowEx(WS_EX_CLIENTEDGE, class_name, class_name, dwStyle, CW_USEDEFAULT, CW_USEDEFAULT, settings.output_width, settings.output_height + 43, NULL, NULL, h_instance, NULL);
 
 	if (!hwnd) return 0;
 
 	ShowWindow(hwnd, cmd_show);
 	UpdateWindow(hwnd);
 
-	v3 cam_position = vec3(CAM_POS_X, CAM_POS_Y, CAM_POS_Z);
-	v3 cam_target = vec3(CAM_TARGET_X, CAM_TARGET_Y, CAM_TARGET_Z);
-	v3 world_up = vec3(0.0f, 1.0f, 0.0f);
-	v3 cam_direction = v3_sub(cam_position, cam_target);
-	f32 cam_focal_dist = v3_mag(cam_direction);
-
-	setup_camera(&camera, cam_position, cam_target, world_up, V_FOV, ASPECT, CAM_APERTURE, cam_focal_dist);
-	setup_pallete();
-	setup_scene();
-	setup_bitmap();
-
-	SYSTEM_INFO system_info;
-	GetSystemInfo(&system_info);
-
-	u16 cpu_count = 1;
+	if (!setup()) return 0;
 
-#ifdef MULTITHREADED
-	cpu_count = system_info.dwNumberOfProcessors;
-#endif // MULTITHREADED
+	f64 start;
 
-	u32* render_thread_data = malloc(cpu_count * sizeof(u32));
-	HANDLE* render_threads = malloc(cpu_count * sizeof(HANDLE));
-	clock_t start, end;
-	f64 cpu_time_used;
+	if (!setup_accumulation()) return 0;
 
-	start = clock();
+	start = get_time();
 
-	for (u16 i = 0; i < cpu_count; i++)
-	{
-		render_thread_data[i] = i << 16 | cpu_count;
-		render_threads[i] = CreateThread(NULL, 0, RenderThread, (void*)&render_thread_data[i], 0, NULL);
-		SetThreadAffinityMask(render_threads[i], 1 << i);
-	}
+	pass_target = 0;
 
-	HANDLE window_thread = CreateThread(NULL, 0, PaintThread, NULL, 0, NULL);
+	if (!next_pass() || !start_pass()) return 0;
 
 	while (1)
 	{
@@ -893,29 +8013,34 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE prev_instance, LPSTR cmd_line
 		{
 		case RENDER:
 		{
-			u32 active_threads = 0;
-
-			for (u32 i = 0; i < cpu_count; i++)
+			if (render_done())
 			{
-				if (WaitForSingleObject(render_threads[i], 0) != WAIT_OBJECT_0) active_threads++;
-			}
+				render_finish();
 
-			if (active_threads == 0)
-			{
-				end = clock();
+				if (next_pass())
+				{
+					if (!start_pass()) return 0;
+					break;
+				}
+
+				if (settings.denoise)
+				{
+					denoise_image();
+					InvalidateRect(hwnd, NULL, FALSE);
+				}
 
-				TerminateThread(window_thread, 0);
+				render_time = get_time() - start;
 
-				cpu_time_used = ((f64)(end - start)) / CLOCKS_PER_SEC;
-				render_time = cpu_time_used;
 				u8 s[32];
 
 #ifdef OUTPUT
 				save_file();
 #endif // OUTPUT
 
+				trace_close();
+
 #ifdef FINISHED_MESSAGE
-				sprintf(s, "Finished in %f", cpu_time_used);
+				sprintf(s, "Finished in %f", render_time);
 				MessageBox(NULL, s, "Renderer", MB_ICONEXCLAMATION | MB_OK);
 #endif // FINISHED_MESSAGE
 
@@ -938,6 +8063,112 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE prev_instance, LPSTR cmd_line
 	return msg.wParam;
 }
 
+#else
+
+int main(int argc, char** argv)
+{
+	setup_default_settings();
+
+	if (!parse_args(argc, argv)) return 1;
+
+	if (settings.benchmark_path) return run_benchmark() ? 0 : 1;
+
+	if (settings.seed_count) return run_seed_sweep() ? 0 : 1;
+
+	if (!setup()) return 1;
+
+	if (settings.export_path)
+	{
+		if (!export_scene(settings.export_path))
+		{
+			printf("Could not write scene %s\n", settings.export_path);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (settings.verify) return verify_intersections(VERIFY_RAYS) ? 1 : 0;
+
+	if (!setup_accumulation()) return 1;
+
+	if (settings.wavefront_benchmark) return benchmark_wavefront() ? 0 : 1;
+
+	if (settings.frames || settings.animation_path)
+	{
+		if (!render_animation()) return 1;
+
+#ifdef OUTPUT
+		save_file();
+#endif // OUTPUT
+
+		render_shutdown();
+		trace_close();
+
+		return 0;
+	}
+
+	if (settings.worker_address) return (net_startup() && run_worker()) ? 0 : 1;
+
+	f64 start;
+	f64 last_checkpoint = get_time();
+	u32 preview_index = 0;
+
+	start = get_time();
+
+	if (settings.coordinator_address)
+	{
+		if (!net_startup() || (!settings.denoise && !image_stream_begin()) || !run_coordinator()) return 1;
+	}
+	else
+	{
+		for (pass_target = 0; next_pass();)
+		{
+			if (!start_pass()) return 1;
+
+			render_finish();
+
+			if (settings.preview) save_preview(preview_index++, get_time() - start);
+
+			if (checkpoint && (pass_target >= settings.num_aa_samples || get_time() - last_checkpoint >= settings.checkpoint_interval))
+			{
+				flush_file(checkpoint, checkpoint_size);
+				last_checkpoint = get_time();
+
+				printf("Checkpoint at %u samples\n", (pass_target < settings.num_aa_samples) ? pass_target : settings.num_aa_samples);
+			}
+		}
+	}
+
+	if (settings.denoise) denoise_image();
+
+	render_time = get_time() - start;
+
+#ifdef OUTPUT
+	save_file();
+#endif // OUTPUT
+
+#ifdef FINISHED_MESSAGE
+	printf("Finished in %f s, %.3f Mrays/s\n", render_time, (render_time > 0.0) ? scheduler.stats.rays / render_time / 1000000.0 : 0.0);
+	print_stats(&scheduler.stats);
+	if (scheduler.tile_count) printf("%u tiles, %.2f ms p50, %.2f ms p99, %.2f ms max, %f s tail\n", scheduler.tile_count, scheduler.tile_p50 * 1000.0, scheduler.tile_p99 * 1000.0, scheduler.tile_max * 1000.0, scheduler.tail_latency);
+	printf("Image hash %016llx\n", (unsigned long long)image_hash());
+#endif // FINISHED_MESSAGE
+
+	if (settings.check_hash && image_hash() != settings.expected_hash)
+	{
+		printf("Image hash %016llx does not match expected %016llx\n", (unsigned long long)image_hash(), (unsigned long long)settings.expected_hash);
+		return 1;
+	}
+
+	render_shutdown();
+	trace_close();
+
+	return 0;
+}
+
+#endif // WINDOWED
+
 f32 viridis_data[256][3] =
 {
 { 0.267004f, 0.004874f, 0.329415f },